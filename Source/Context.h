@@ -71,6 +71,25 @@ struct Context : public Empty::Context, Empty::utils::noncopyable
         return true;
     }
 
+    // Hidden window whose GL context shares objects with the main one, for another thread to draw with.
+    // Like every GLFW window, it is created and destroyed from the main thread.
+    GLFWwindow* createSharedWindow() const
+    {
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        GLFWwindow* sharedWindow = glfwCreateWindow(1, 1, "Shared context", NULL, window);
+        glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+        return sharedWindow;
+    }
+
+    // Makes the context of a shared window current on the calling thread, see createSharedWindow.
+    // Only sets up GL, windowing and ImGui stay with the main thread's Context.
+    void initShared(GLFWwindow* sharedWindow)
+    {
+        ASSERT(!_init);
+        glfwMakeContextCurrent(sharedWindow);
+        window = sharedWindow;
+    }
+
     void newFrame() const
     {
         ImGui_ImplOpenGL3_NewFrame();
@@ -107,7 +126,8 @@ struct Context : public Empty::Context, Empty::utils::noncopyable
 private:
     Context() : Empty::Context(), Empty::utils::noncopyable(), frameWidth(0), frameHeight(0), window(nullptr), _init(false) { }
     bool _init;
-    static Context _instance;
+    // One per thread, since each thread has its own current GL context and bindings
+    static thread_local Context _instance;
 
     // Callbacks
     static void glfw_error_callback(int error, const char* description)
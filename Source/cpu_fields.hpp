@@ -0,0 +1,74 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <Empty/math/vec.h>
+
+// ****************************************************
+// Types related to scalar fields stored in main memory
+// ****************************************************
+
+// Flat x-major float grid. Indexing matches the GPU fields, with texel (0, 0, 0)
+// in the bottom left back corner of the grid.
+struct CPUScalarField
+{
+	CPUScalarField(const std::string& name, Empty::math::uvec3 size)
+		: name(name)
+		, size(size)
+		, data(static_cast<size_t>(size.x) * size.y * size.z, 0.f)
+	{ }
+
+	size_t index(int x, int y, int z) const { return x + static_cast<size_t>(size.x) * (y + static_cast<size_t>(size.y) * z); }
+
+	bool contains(int x, int y, int z) const
+	{
+		return x >= 0 && y >= 0 && z >= 0 && x < (int)size.x && y < (int)size.y && z < (int)size.z;
+	}
+
+	float& operator()(int x, int y, int z) { return data[index(x, y, z)]; }
+	float operator()(int x, int y, int z) const { return data[index(x, y, z)]; }
+
+	// Field is 0 outside of the grid, like an image load out of bounds or a border-clamped texture
+	float load(int x, int y, int z) const { return contains(x, y, z) ? data[index(x, y, z)] : 0.f; }
+
+	// Field is extended by its boundary values, like an image load with clamped coordinates
+	float loadClamped(int x, int y, int z) const
+	{
+		x = std::clamp(x, 0, (int)size.x - 1);
+		y = std::clamp(y, 0, (int)size.y - 1);
+		z = std::clamp(z, 0, (int)size.z - 1);
+		return data[index(x, y, z)];
+	}
+
+	void clear() { std::fill(data.begin(), data.end(), 0.f); }
+
+	std::string name;
+	Empty::math::uvec3 size;
+	std::vector<float> data;
+};
+
+struct BufferedCPUScalarField
+{
+	BufferedCPUScalarField(const std::string& name, Empty::math::uvec3 size)
+		: fields{ { name + " 1", size }, { name + " 2", size } }
+		, writingBackBuffer(true)
+	{ }
+
+	void clear()
+	{
+		fields[0].clear();
+		fields[1].clear();
+		writingBackBuffer = true;
+	}
+
+	auto& getInput() { return fields[writingBackBuffer ? 0 : 1]; }
+	auto& getOutput() { return fields[writingBackBuffer ? 1 : 0]; }
+
+	void swap() { writingBackBuffer = !writingBackBuffer; }
+
+private:
+	CPUScalarField fields[2];
+	bool writingBackBuffer;
+};
@@ -0,0 +1,516 @@
+#include "cpu_solver.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+using namespace Empty::math;
+
+// *******************************************
+// Sampling helpers mirroring the GPU samplers
+// *******************************************
+
+namespace
+{
+	// Same as grid-space to texel-space in advection.glsl, texel centers are at integer coordinates
+	vec3 gridSpaceToTexelSpace(const vec3& p, float oneOverDx)
+	{
+		return vec3(p.x * oneOverDx - 0.5f, p.y * oneOverDx - 0.5f, p.z * oneOverDx - 0.5f);
+	}
+
+	// Trilinear filtering of a border-clamped texture, see sampleTex in advection.glsl
+	float sampleTrilinear(const CPUScalarField& field, const vec3& texelPosition)
+	{
+		float fx = std::floor(texelPosition.x), fy = std::floor(texelPosition.y), fz = std::floor(texelPosition.z);
+		int x = static_cast<int>(fx), y = static_cast<int>(fy), z = static_cast<int>(fz);
+		float tx = texelPosition.x - fx, ty = texelPosition.y - fy, tz = texelPosition.z - fz;
+
+		auto lerp = [](float a, float b, float t) { return a + (b - a) * t; };
+		auto bilerp = [&](int zz)
+			{
+				float down = lerp(field.load(x, y, zz), field.load(x + 1, y, zz), tx);
+				float up = lerp(field.load(x, y + 1, zz), field.load(x + 1, y + 1, zz), tx);
+				return lerp(down, up, ty);
+			};
+
+		return lerp(bilerp(z), bilerp(z + 1), tz);
+	}
+
+	vec3 bilerpVelocity(const CPUFluidState& fluidState, const CPUScalarField& velocityX, const CPUScalarField& velocityY,
+		const CPUScalarField& velocityZ, const vec3& position)
+	{
+		// TEST: collocated grid
+		vec3 texelPosition = gridSpaceToTexelSpace(position, 1.f / fluidState.grid.cellSize);
+		return vec3(sampleTrilinear(velocityX, texelPosition), sampleTrilinear(velocityY, texelPosition), sampleTrilinear(velocityZ, texelPosition));
+	}
+
+	// Monotonic cubic interpolation from Fedkiw, Stam and Jensen 2001, see advection.glsl
+	float monotonicCubicInterpolation(float qprev, float q0, float q1, float qnext, float t)
+	{
+		float delta = q1 - q0;
+		float d0 = (q1 - qprev) * 0.5f;
+		float d1 = (qnext - q0) * 0.5f;
+
+		// Enforce monotonicity + clamp gradients
+		auto limit = [delta](float d)
+			{
+				if ((delta > 0.f) != (d > 0.f) || (delta < 0.f) != (d < 0.f))
+					return 0.f;
+				// Same sign and delta == 0 means d == 0 too
+				return delta != 0.f && d / delta > 3.f ? delta * 3.f : d;
+			};
+		d0 = limit(d0);
+		d1 = limit(d1);
+
+		float a0 = q0;
+		float a1 = d0;
+		float a2 = delta * 3.f - d0 * 2.f - d1;
+		float a3 = d0 + d1 - delta * 2.f;
+
+		return ((a3 * t + a2) * t + a1) * t + a0;
+	}
+
+	// Monotonic tricubic interpolation over the 4x4x4 texel neighbourhood, see interpolateField in advection.glsl
+	float interpolateField(const CPUScalarField& field, const vec3& texelPosition)
+	{
+		float fx = std::floor(texelPosition.x), fy = std::floor(texelPosition.y), fz = std::floor(texelPosition.z);
+		int x = static_cast<int>(fx), y = static_cast<int>(fy), z = static_cast<int>(fz);
+		float tx = texelPosition.x - fx, ty = texelPosition.y - fy, tz = texelPosition.z - fz;
+
+		// Interpolate along X then Y then Z
+		float zValues[4];
+		for (int k = 0; k < 4; k++)
+		{
+			float yValues[4];
+			for (int j = 0; j < 4; j++)
+			{
+				int yy = y + j - 1, zz = z + k - 1;
+				yValues[j] = monotonicCubicInterpolation(field.load(x - 1, yy, zz), field.load(x, yy, zz),
+					field.load(x + 1, yy, zz), field.load(x + 2, yy, zz), tx);
+			}
+			zValues[k] = monotonicCubicInterpolation(yValues[0], yValues[1], yValues[2], yValues[3], ty);
+		}
+
+		return monotonicCubicInterpolation(zValues[0], zValues[1], zValues[2], zValues[3], tz);
+	}
+
+	// Rounds to the nearest 16-bit float, ties to even, like a store to a 16-bit float texture
+	float roundToHalf(float value)
+	{
+		float magnitude = std::fabs(value);
+		// Largest half is 65504, anything rounding above it overflows
+		if (!(magnitude < 65520.f))
+			return std::isnan(value) ? value : std::copysign(INFINITY, value);
+
+		float rounded;
+		if (magnitude < 6.103515625e-5f)
+		{
+			// Subnormal halves are multiples of 2^-24
+			rounded = std::nearbyint(magnitude * 16777216.f) / 16777216.f;
+		}
+		else
+		{
+			// Keep 10 of the 23 mantissa bits
+			uint32_t bits;
+			std::memcpy(&bits, &magnitude, sizeof(bits));
+			bits += 0xfffu + ((bits >> 13) & 1u);
+			bits &= ~0x1fffu;
+			std::memcpy(&rounded, &bits, sizeof(rounded));
+		}
+
+		return std::copysign(rounded, value);
+	}
+}
+
+// **********************
+// Main fluid sim methods
+// **********************
+
+CPUFluidSim::CPUFluidSim(uvec3 gridSize, unsigned int numThreads)
+	: diffusionJacobiSteps(100)
+	, pressureJacobiSteps(100)
+	, reuseLastPressure(true)
+	, pressureSolver(CPUPressureSolver::Jacobi)
+	, spectralBoundary(SpectralBoundary::Zero)
+	, halfPrecisionStorage(false)
+	, viewerDiagnostics(FluidSimDiagnostics::None)
+	, runAdvection(true)
+	, runDiffusion(true)
+	, runDivergence(true)
+	, runPressure(true)
+	, runProjection(true)
+	, _hooks()
+	, _hookDiagnostics()
+	, _nextHookId(0)
+	, _threadPool(numThreads)
+	, _spectralSolver(_threadPool)
+	, _workingField("Jacobi working field", gridSize)
+{ }
+
+CPUFluidSim::~CPUFluidSim() = default;
+
+FluidSimHookId CPUFluidSim::registerHook(CPUFluidSimHook hook, FluidSimHookStage when, FluidSimDiagnostics diagnostics)
+{
+	_hooks[_nextHookId] = std::make_pair(hook, when);
+	_hookDiagnostics[_nextHookId] = diagnostics;
+
+	return _nextHookId++;
+}
+
+bool CPUFluidSim::modifyHookStage(FluidSimHookId id, FluidSimHookStage newWhen)
+{
+	if (_hooks.find(id) == _hooks.end())
+		return false;
+
+	_hooks[id].second = newWhen;
+
+	return true;
+}
+
+bool CPUFluidSim::modifyHookDiagnostics(FluidSimHookId id, FluidSimDiagnostics diagnostics)
+{
+	if (_hooks.find(id) == _hooks.end())
+		return false;
+
+	_hookDiagnostics[id] = diagnostics;
+
+	return true;
+}
+
+void CPUFluidSim::unregisterHook(FluidSimHookId id)
+{
+	_hooks.erase(id);
+	_hookDiagnostics.erase(id);
+}
+
+void CPUFluidSim::runHooks(FluidSimHookStage stage, CPUFluidState& fluidState, float dt)
+{
+	for (auto& pair : _hooks)
+		if (pair.second.second == stage)
+			pair.second.first(fluidState, dt);
+}
+
+FluidSimDiagnostics CPUFluidSim::requestedDiagnostics() const
+{
+	FluidSimDiagnostics diagnostics = viewerDiagnostics;
+	for (auto& pair : _hookDiagnostics)
+		if (_hooks.at(pair.first).second != FluidSimHookStage::Never)
+			diagnostics = diagnostics | pair.second;
+	return diagnostics;
+}
+
+void CPUFluidSim::applyForces(CPUFluidState& fluidState, const FluidSimMouseClickImpulse& impulse, bool velocityOnly, float dt)
+{
+	const uvec3 size = fluidState.grid.size;
+	const float oneOverForceRadius = 1.f / impulse.radius;
+
+	CPUScalarField& velocityX = fluidState.velocityX.getInput();
+	CPUScalarField& velocityY = fluidState.velocityY.getInput();
+	CPUScalarField& velocityZ = fluidState.velocityZ.getInput();
+	CPUScalarField& ink = fluidState.inkDensity.getInput();
+
+	// See forces.glsl
+	_threadPool.parallelFor(size.z, [&](int zBegin, int zEnd)
+		{
+			for (int z = zBegin; z < zEnd; z++)
+				for (int y = 0; y < (int)size.y; y++)
+					for (int x = 0; x < (int)size.x; x++)
+					{
+						vec3 vector(x + 0.5f - impulse.position.x, y + 0.5f - impulse.position.y, z + 0.5f - impulse.position.z);
+						float factor = std::exp2(-(vector.x * vector.x + vector.y * vector.y + vector.z * vector.z) * oneOverForceRadius);
+
+						velocityX(x, y, z) += impulse.magnitude.x * factor;
+						velocityY(x, y, z) += impulse.magnitude.y * factor;
+						velocityZ(x, y, z) += impulse.magnitude.z * factor;
+						if (!velocityOnly)
+							ink(x, y, z) += impulse.inkAmount * dt * factor;
+					}
+		});
+
+	if (halfPrecisionStorage)
+	{
+		quantizeToHalf(velocityX);
+		quantizeToHalf(velocityY);
+		quantizeToHalf(velocityZ);
+		if (!velocityOnly)
+			quantizeToHalf(ink);
+	}
+}
+
+void CPUFluidSim::scrollGrid(CPUFluidState& fluidState, ivec3 scroll)
+{
+	const uvec3 size = fluidState.grid.size;
+
+	// Same fields as the GPU ring buffers end up with, by copying rather than moving an origin
+	auto doScroll = [this, &size, &scroll](BufferedCPUScalarField& field)
+		{
+			const CPUScalarField& fieldIn = field.getInput();
+			CPUScalarField& fieldOut = field.getOutput();
+
+			_threadPool.parallelFor(size.z, [&](int zBegin, int zEnd)
+				{
+					for (int z = zBegin; z < zEnd; z++)
+						for (int y = 0; y < (int)size.y; y++)
+							for (int x = 0; x < (int)size.x; x++)
+								fieldOut(x, y, z) = fieldIn.load(x - scroll.x, y - scroll.y, z - scroll.z);
+				});
+
+			field.swap();
+		};
+
+	doScroll(fluidState.velocityX);
+	doScroll(fluidState.velocityY);
+	doScroll(fluidState.velocityZ);
+	doScroll(fluidState.pressure);
+	doScroll(fluidState.inkDensity);
+}
+
+void CPUFluidSim::advance(CPUFluidState& fluidState, float dt)
+{
+	runHooks(FluidSimHookStage::Start, fluidState, dt);
+
+	if (runAdvection)
+		advect(fluidState, dt);
+
+	runHooks(FluidSimHookStage::AfterAdvection, fluidState, dt);
+
+	if (runDiffusion)
+		diffuse(fluidState, dt);
+
+	runHooks(FluidSimHookStage::AfterDiffusion, fluidState, dt);
+
+	if (runDivergence)
+		computeDivergence(fluidState, fluidState.divergence);
+
+	runHooks(FluidSimHookStage::AfterDivergence, fluidState, dt);
+
+	if (runPressure)
+		solvePressure(fluidState);
+
+	runHooks(FluidSimHookStage::AfterPressure, fluidState, dt);
+
+	if (runProjection)
+		project(fluidState);
+
+	// Re-compute divergence to check that it is in fact 0, if anyone is looking
+	if (hasDiagnostic(requestedDiagnostics(), FluidSimDiagnostics::DivergenceCheck))
+		computeDivergence(fluidState, fluidState.divergenceCheck);
+
+	runHooks(FluidSimHookStage::AfterProjection, fluidState, dt);
+}
+
+// **********************
+// Fluid simulation steps
+// **********************
+
+void CPUFluidSim::advect(CPUFluidState& fluidState, float dt)
+{
+	const uvec3 size = fluidState.grid.size;
+	const float dx = fluidState.grid.cellSize;
+	const float oneOverDx = 1.f / dx;
+
+	const CPUScalarField& velocityX = fluidState.velocityX.getInput();
+	const CPUScalarField& velocityY = fluidState.velocityY.getInput();
+	const CPUScalarField& velocityZ = fluidState.velocityZ.getInput();
+	const CPUScalarField& ink = fluidState.inkDensity.getInput();
+	CPUScalarField& velocityXOut = fluidState.velocityX.getOutput();
+	CPUScalarField& velocityYOut = fluidState.velocityY.getOutput();
+	CPUScalarField& velocityZOut = fluidState.velocityZ.getOutput();
+	CPUScalarField& inkOut = fluidState.inkDensity.getOutput();
+
+	_threadPool.parallelFor(size.z, [&](int zBegin, int zEnd)
+		{
+			for (int z = zBegin; z < zEnd; z++)
+				for (int y = 0; y < (int)size.y; y++)
+					for (int x = 0; x < (int)size.x; x++)
+					{
+						vec3 position((x + 0.5f) * dx, (y + 0.5f) * dx, (z + 0.5f) * dx);
+
+						// 3rd-order Runge-Kutta backtrace, see traceBack in advection.glsl.
+						// All fields are collocated, so the backtrace is shared between them.
+						vec3 k1 = bilerpVelocity(fluidState, velocityX, velocityY, velocityZ, position);
+						vec3 k2 = bilerpVelocity(fluidState, velocityX, velocityY, velocityZ, position - k1 * (dt * 0.5f));
+						vec3 k3 = bilerpVelocity(fluidState, velocityX, velocityY, velocityZ, position - k2 * (dt * 0.75f));
+						vec3 origin = position - (k1 * 2.f + k2 * 3.f + k3 * 4.f) * (dt / 9.f);
+
+						vec3 texelOrigin = gridSpaceToTexelSpace(origin, oneOverDx);
+						velocityXOut(x, y, z) = interpolateField(velocityX, texelOrigin);
+						velocityYOut(x, y, z) = interpolateField(velocityY, texelOrigin);
+						velocityZOut(x, y, z) = interpolateField(velocityZ, texelOrigin);
+						inkOut(x, y, z) = interpolateField(ink, texelOrigin);
+					}
+		});
+
+	if (halfPrecisionStorage)
+	{
+		quantizeToHalf(velocityXOut);
+		quantizeToHalf(velocityYOut);
+		quantizeToHalf(velocityZOut);
+		quantizeToHalf(inkOut);
+	}
+
+	fluidState.velocityX.swap();
+	fluidState.velocityY.swap();
+	fluidState.velocityZ.swap();
+	fluidState.inkDensity.swap();
+}
+
+void CPUFluidSim::jacobi(const CPUScalarField& source, BufferedCPUScalarField& field, float alpha, float oneOverBeta, int iterations,
+	bool halfPrecision)
+{
+	assert(iterations > 0);
+
+	const uvec3 size = source.size;
+
+	// Alternate writes between the working field and the output field so we write to the output
+	// field last, just like JacobiIterator.
+	bool writeToWorkingField = (iterations & 1) == 0;
+	const CPUScalarField* fieldIn = &field.getInput();
+	CPUScalarField* fieldOut = writeToWorkingField ? &_workingField : &field.getOutput();
+
+	for (int i = 0; i < iterations; i++)
+	{
+		// See jacobi.glsl
+		_threadPool.parallelFor(size.z, [&](int zBegin, int zEnd)
+			{
+				const CPUScalarField& in = *fieldIn;
+				CPUScalarField& out = *fieldOut;
+
+				for (int z = zBegin; z < zEnd; z++)
+					for (int y = 0; y < (int)size.y; y++)
+						for (int x = 0; x < (int)size.x; x++)
+						{
+							// Field is 0 outside of the grid
+							float neighbours = in.load(x - 1, y, z) + in.load(x + 1, y, z)
+								+ in.load(x, y - 1, z) + in.load(x, y + 1, z)
+								+ in.load(x, y, z - 1) + in.load(x, y, z + 1);
+							out(x, y, z) = (neighbours + alpha * source(x, y, z)) * oneOverBeta;
+						}
+			});
+
+		// The working field has the same format as the solved field on the GPU
+		if (halfPrecision)
+			quantizeToHalf(*fieldOut);
+
+		writeToWorkingField = !writeToWorkingField;
+		fieldIn = fieldOut;
+		fieldOut = writeToWorkingField ? &_workingField : &field.getOutput();
+	}
+
+	field.swap();
+}
+
+void CPUFluidSim::diffuse(CPUFluidState& fluidState, float dt)
+{
+	const auto& params = fluidState.grid;
+
+	float alpha = params.cellSize * params.cellSize / (fluidState.physics.kinematicViscosity * dt);
+	float oneOverBeta = 1.f / (alpha + 6.f);
+
+	jacobi(fluidState.velocityX.getInput(), fluidState.velocityX, alpha, oneOverBeta, diffusionJacobiSteps, halfPrecisionStorage);
+	jacobi(fluidState.velocityY.getInput(), fluidState.velocityY, alpha, oneOverBeta, diffusionJacobiSteps, halfPrecisionStorage);
+	jacobi(fluidState.velocityZ.getInput(), fluidState.velocityZ, alpha, oneOverBeta, diffusionJacobiSteps, halfPrecisionStorage);
+}
+
+void CPUFluidSim::computeDivergence(CPUFluidState& fluidState, CPUScalarField& divergence)
+{
+	const uvec3 size = fluidState.grid.size;
+	const float halfOneOverDx = 0.5f / fluidState.grid.cellSize;
+
+	const CPUScalarField& velocityX = fluidState.velocityX.getInput();
+	const CPUScalarField& velocityY = fluidState.velocityY.getInput();
+	const CPUScalarField& velocityZ = fluidState.velocityZ.getInput();
+
+	// See divergence.glsl
+	_threadPool.parallelFor(size.z, [&](int zBegin, int zEnd)
+		{
+			for (int z = zBegin; z < zEnd; z++)
+				for (int y = 0; y < (int)size.y; y++)
+					for (int x = 0; x < (int)size.x; x++)
+					{
+						// Clamp coordinates so gradients are 0 on the boundary
+						// TEST: collocated grid
+						float xleft = velocityX.loadClamped(x - 1, y, z),
+							xright = velocityX.loadClamped(x + 1, y, z),
+							yup = velocityY.loadClamped(x, y + 1, z),
+							ydown = velocityY.loadClamped(x, y - 1, z),
+							zfront = velocityZ.loadClamped(x, y, z + 1),
+							zback = velocityZ.loadClamped(x, y, z - 1);
+
+						divergence(x, y, z) = (xright - xleft + yup - ydown + zfront - zback) * halfOneOverDx;
+					}
+		});
+}
+
+void CPUFluidSim::solvePressure(CPUFluidState& fluidState)
+{
+	const auto& params = fluidState.grid;
+
+	float alpha = -params.cellSize * params.cellSize * fluidState.physics.density;
+	float beta = 6.f;
+
+	// Doesn't need an initial guess
+	if (pressureSolver == CPUPressureSolver::Spectral)
+	{
+		_spectralSolver.solve(fluidState.divergence, fluidState.pressure.getOutput(), alpha, beta, spectralBoundary);
+		fluidState.pressure.swap();
+		return;
+	}
+
+	if (!reuseLastPressure)
+		fluidState.pressure.clear();
+
+	jacobi(fluidState.divergence, fluidState.pressure, alpha, 1.f / beta, pressureJacobiSteps, false);
+}
+
+void CPUFluidSim::project(CPUFluidState& fluidState)
+{
+	const uvec3 size = fluidState.grid.size;
+	const float halfOneOverDx = 0.5f / fluidState.grid.cellSize;
+
+	CPUScalarField& velocityX = fluidState.velocityX.getInput();
+	CPUScalarField& velocityY = fluidState.velocityY.getInput();
+	CPUScalarField& velocityZ = fluidState.velocityZ.getInput();
+	const CPUScalarField& pressure = fluidState.pressure.getInput();
+
+	// See projection.glsl
+	_threadPool.parallelFor(size.z, [&](int zBegin, int zEnd)
+		{
+			for (int z = zBegin; z < zEnd; z++)
+				for (int y = 0; y < (int)size.y; y++)
+					for (int x = 0; x < (int)size.x; x++)
+					{
+						// Clamp coordinates so gradients are 0 on the boundary
+						// TEST: collocated grid
+						float pleft = pressure.loadClamped(x - 1, y, z),
+							pright = pressure.loadClamped(x + 1, y, z),
+							pup = pressure.loadClamped(x, y + 1, z),
+							pdown = pressure.loadClamped(x, y - 1, z),
+							pfront = pressure.loadClamped(x, y, z + 1),
+							pback = pressure.loadClamped(x, y, z - 1);
+
+						velocityX(x, y, z) -= (pright - pleft) * halfOneOverDx;
+						velocityY(x, y, z) -= (pup - pdown) * halfOneOverDx;
+						velocityZ(x, y, z) -= (pfront - pback) * halfOneOverDx;
+					}
+		});
+
+	if (halfPrecisionStorage)
+	{
+		quantizeToHalf(velocityX);
+		quantizeToHalf(velocityY);
+		quantizeToHalf(velocityZ);
+	}
+}
+
+void CPUFluidSim::quantizeToHalf(CPUScalarField& field)
+{
+	_threadPool.parallelFor(static_cast<int>(field.size.z), [&field](int zBegin, int zEnd)
+		{
+			size_t sliceSize = static_cast<size_t>(field.size.x) * field.size.y;
+			for (size_t i = zBegin * sliceSize; i < zEnd * sliceSize; i++)
+				field.data[i] = roundToHalf(field.data[i]);
+		});
+}
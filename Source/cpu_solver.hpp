@@ -0,0 +1,90 @@
+#pragma once
+
+#include <functional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <Empty/math/vec.h>
+
+#include "fluid.hpp"
+#include "solver.hpp"
+#include "spectral_solver.hpp"
+#include "thread_pool.hpp"
+
+// *************************************************************
+// Headless fluid simulation running the GPU pipeline on the CPU
+// *************************************************************
+
+using CPUFluidSimHook = std::function<void(CPUFluidState& fluidState, float dt)>;
+
+enum struct CPUPressureSolver : int
+{
+	Jacobi,
+	// Exact solve in one shot, see SpectralPoissonSolver
+	Spectral,
+};
+
+// Mirrors FluidSim step for step, so both backends produce the same fields up to
+// floating point differences. Every pass is split along Z slices across the thread pool.
+struct CPUFluidSim
+{
+	// 0 threads means one per hardware core
+	CPUFluidSim(Empty::math::uvec3 gridSize, unsigned int numThreads = 0);
+	~CPUFluidSim();
+
+	// Diagnostics are only computed while a hook that reads them is registered at a stage other than Never
+	FluidSimHookId registerHook(CPUFluidSimHook hook, FluidSimHookStage when, FluidSimDiagnostics diagnostics = FluidSimDiagnostics::None);
+	bool modifyHookStage(FluidSimHookId, FluidSimHookStage newWhen);
+	bool modifyHookDiagnostics(FluidSimHookId, FluidSimDiagnostics diagnostics);
+	void unregisterHook(FluidSimHookId);
+
+	void applyForces(CPUFluidState& fluidState, const FluidSimMouseClickImpulse& impulse, bool velocityOnly, float dt);
+	void scrollGrid(CPUFluidState& fluidState, Empty::math::ivec3 scroll);
+	void advance(CPUFluidState& fluidState, float dt);
+
+	unsigned int getNumThreads() const { return _threadPool.size(); }
+
+	int diffusionJacobiSteps;
+	int pressureJacobiSteps;
+	bool reuseLastPressure;
+
+	CPUPressureSolver pressureSolver;
+	// Zero matches the Jacobi solve
+	SpectralBoundary spectralBoundary;
+
+	// Rounds velocity and ink to 16-bit floats whenever they are written, to measure the accuracy
+	// cost of FLUIDSIM_HALF_PRECISION_FIELDS. Pressure stays in 32-bit floats like on the GPU.
+	bool halfPrecisionStorage;
+
+	// Diagnostics read outside of hooks, after advance returns
+	FluidSimDiagnostics viewerDiagnostics;
+
+	bool runAdvection;
+	bool runDiffusion;
+	bool runDivergence;
+	bool runPressure;
+	bool runProjection;
+
+private:
+	void runHooks(FluidSimHookStage stage, CPUFluidState& fluidState, float dt);
+	FluidSimDiagnostics requestedDiagnostics() const;
+
+	void advect(CPUFluidState& fluidState, float dt);
+	void diffuse(CPUFluidState& fluidState, float dt);
+	void computeDivergence(CPUFluidState& fluidState, CPUScalarField& divergence);
+	void solvePressure(CPUFluidState& fluidState);
+	void project(CPUFluidState& fluidState);
+	void jacobi(const CPUScalarField& source, BufferedCPUScalarField& field, float alpha, float oneOverBeta, int iterations, bool halfPrecision);
+	void quantizeToHalf(CPUScalarField& field);
+
+	std::unordered_map<FluidSimHookId, std::pair<CPUFluidSimHook, FluidSimHookStage>> _hooks;
+	std::unordered_map<FluidSimHookId, FluidSimDiagnostics> _hookDiagnostics;
+	FluidSimHookId _nextHookId;
+
+	ThreadPool _threadPool;
+	SpectralPoissonSolver _spectralSolver;
+
+	// Ping-pong storage for Jacobi iterations, shared by all solves
+	CPUScalarField _workingField;
+};
@@ -8,12 +8,22 @@
 // *****************************************
 
 constexpr Empty::gl::DataFormat gpuScalarDataFormat = Empty::gl::DataFormat::Red;
-using GPUScalarField = Empty::gl::Texture<Empty::gl::TextureTarget::Texture2DArray, Empty::gl::TextureFormat::Red32f>;
+using GPUScalarField = Empty::gl::Texture<Empty::gl::TextureTarget::Texture3D, Empty::gl::TextureFormat::Red32f>;
+
+// Components are packed in a single texel so a vector sample is one fetch. The fourth component is unused,
+// there is no 3-component format usable with image load/store.
+constexpr Empty::gl::DataFormat gpuVectorDataFormat = Empty::gl::DataFormat::RGBA;
+using GPUVectorField = Empty::gl::Texture<Empty::gl::TextureTarget::Texture3D, Empty::gl::TextureFormat::RGBA32f>;
+
+// Half the bytes for bandwidth-bound fields that can afford the precision loss
+using GPUHalfScalarField = Empty::gl::Texture<Empty::gl::TextureTarget::Texture3D, Empty::gl::TextureFormat::Red16f>;
+using GPUHalfVectorField = Empty::gl::Texture<Empty::gl::TextureTarget::Texture3D, Empty::gl::TextureFormat::RGBA16f>;
 
 template <typename F, Empty::gl::DataFormat Format>
 struct BufferedField
 {
 	using Field = F;
+	static constexpr Empty::gl::DataFormat dataFormat = Format;
 
 	BufferedField(const std::string& name, Empty::math::uvec3 size) :
 		fields{ { name + " 1" } , { name + " 2"} },
@@ -21,13 +31,15 @@ struct BufferedField
 	{
 		using namespace Empty::gl;
 
+		// Fields are stored as ring buffers, so samples wrap around. ring.glsl zeroes the texels
+		// that come from the other side of the grid.
 		for (int i : { 0, 1 })
 		{
 			fields[i].setStorage(1, size.x, size.y, size.z);
 			fields[i].template clearLevel<Format, DataType::Float>(0);
-			fields[i].setParameter<TextureParam::WrapS>(TextureParamValue::ClampToBorder);
-			fields[i].setParameter<TextureParam::WrapT>(TextureParamValue::ClampToBorder);
-			fields[i].setParameter<TextureParam::WrapR>(TextureParamValue::ClampToBorder);
+			fields[i].template setParameter<TextureParam::WrapS>(TextureParamValue::Repeat);
+			fields[i].template setParameter<TextureParam::WrapT>(TextureParamValue::Repeat);
+			fields[i].template setParameter<TextureParam::WrapR>(TextureParamValue::Repeat);
 		}
 	}
 
@@ -51,3 +63,21 @@ private:
 };
 
 using BufferedScalarField = BufferedField<GPUScalarField, gpuScalarDataFormat>;
+using BufferedVectorField = BufferedField<GPUVectorField, gpuVectorDataFormat>;
+
+// Storage of the fields advected every step, see FLUIDSIM_HALF_PRECISION_FIELDS in CMakeLists.txt.
+// Pressure always stays in 32-bit floats, its solves need the precision. Shaders loading from their
+// images need the matching GLSL format qualifiers, which they get as VELOCITY_FORMAT and INK_FORMAT.
+#ifdef FLUIDSIM_HALF_PRECISION_FIELDS
+using GPUVelocityField = GPUHalfVectorField;
+using GPUInkField = GPUHalfScalarField;
+constexpr const char* velocityImageFormat = "rgba16f";
+constexpr const char* inkImageFormat = "r16f";
+#else
+using GPUVelocityField = GPUVectorField;
+using GPUInkField = GPUScalarField;
+constexpr const char* velocityImageFormat = "rgba32f";
+constexpr const char* inkImageFormat = "r32f";
+#endif
+using BufferedVelocityField = BufferedField<GPUVelocityField, gpuVectorDataFormat>;
+using BufferedInkField = BufferedField<GPUInkField, gpuScalarDataFormat>;
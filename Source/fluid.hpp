@@ -1,7 +1,11 @@
 #pragma once
 
+#include <cstdint>
+
+#include <Empty/gl/Buffer.h>
 #include <Empty/math/vec.h>
 
+#include "cpu_fields.hpp"
 #include "fields.hpp"
 
 // *********************************
@@ -24,6 +28,15 @@ struct FluidPhysicalProperties
 	float kinematicViscosity;
 };
 
+// Must match the GridRing uniform block in ring.glsl
+constexpr int gridRingBinding = 0;
+
+struct FluidGridRing
+{
+	int32_t origin[4];
+	int32_t size[4];
+};
+
 struct FluidSimMouseClickImpulse
 {
 	Empty::math::vec3 position = Empty::math::vec3::zero;
@@ -38,27 +51,36 @@ struct FluidState
 		: grid{ grid }
 		, physics{ physics }
 		, exteriorVelocity{ Empty::math::vec2::zero }
-		, velocityX{ "Velocity X", grid.size }
-		, velocityY{ "Velocity Y", grid.size }
-		, velocityZ{ "Velocity Z", grid.size }
+		, velocity{ "Velocity", grid.size }
 		, pressure{ "Pressure", grid.size }
 		, divergenceTex("Divergence")
 		, divergenceCheckTex("Divergence zero check")
 		, boundariesTex("Boundaries")
 		, inkDensity{ "Ink density", grid.size }
+		, gridOrigin(0, 0, 0)
+		, gridRingBuffer("Grid ring")
 	{
 		divergenceTex.setStorage(1, grid.size.x, grid.size.y, grid.size.z);
 		divergenceCheckTex.setStorage(1, grid.size.x, grid.size.y, grid.size.z);
+		uploadGridRing();
 	}
 
 	void reset()
 	{
-		velocityX.clear();
-		velocityY.clear();
-		velocityZ.clear();
+		velocity.clear();
 		pressure.clear();
 		divergenceTex.template clearLevel<Empty::gl::DataFormat::Red, Empty::gl::DataType::Float>(0);
 		inkDensity.clear();
+		gridOrigin = Empty::math::ivec3(0, 0, 0);
+		uploadGridRing();
+	}
+
+	// Call after moving gridOrigin
+	void uploadGridRing()
+	{
+		FluidGridRing ring{ { gridOrigin.x, gridOrigin.y, gridOrigin.z, 0 },
+			{ (int32_t)grid.size.x, (int32_t)grid.size.y, (int32_t)grid.size.z, 0 } };
+		gridRingBuffer.setStorage(sizeof(ring), Empty::gl::BufferUsage::DynamicDraw, ring);
 	}
 	
 	FluidGridParameters grid;
@@ -66,14 +88,60 @@ struct FluidState
 	Empty::math::vec2 exteriorVelocity;
 
 	// Fields we need
-	BufferedScalarField velocityX;
-	BufferedScalarField velocityY;
-	BufferedScalarField velocityZ;
+	// X, Y and Z components in R, G and B
+	BufferedVelocityField velocity;
 	BufferedScalarField pressure;
 	GPUScalarField divergenceTex;
+	// Only updated while FluidSimDiagnostics::DivergenceCheck is requested
 	GPUScalarField divergenceCheckTex;
 	Empty::gl::Texture<Empty::gl::TextureTarget::Texture2D, Empty::gl::TextureFormat::Red8ui> boundariesTex;
 
 	// Fields we don't need but are cool
-	BufferedScalarField inkDensity;
+	BufferedInkField inkDensity;
+
+	// All fields are ring buffers along every axis, storing logical texel (0, 0, 0) at gridOrigin,
+	// so scrolling the grid only moves the origin. Texture coordinates everywhere are logical,
+	// see ring.glsl, and gridRingBuffer has to be bound to gridRingBinding when using the fields.
+	Empty::math::ivec3 gridOrigin;
+	Empty::gl::Buffer gridRingBuffer;
+};
+
+// Same fields as FluidState, stored in main memory for the CPU solver.
+// Doesn't need a GL context.
+struct CPUFluidState
+{
+	CPUFluidState(const FluidGridParameters& grid, const FluidPhysicalProperties& physics)
+		: grid{ grid }
+		, physics{ physics }
+		, velocityX{ "Velocity X", grid.size }
+		, velocityY{ "Velocity Y", grid.size }
+		, velocityZ{ "Velocity Z", grid.size }
+		, pressure{ "Pressure", grid.size }
+		, divergence{ "Divergence", grid.size }
+		, divergenceCheck{ "Divergence zero check", grid.size }
+		, inkDensity{ "Ink density", grid.size }
+	{ }
+
+	void reset()
+	{
+		velocityX.clear();
+		velocityY.clear();
+		velocityZ.clear();
+		pressure.clear();
+		divergence.clear();
+		inkDensity.clear();
+	}
+
+	FluidGridParameters grid;
+	FluidPhysicalProperties physics;
+
+	BufferedCPUScalarField velocityX;
+	BufferedCPUScalarField velocityY;
+	BufferedCPUScalarField velocityZ;
+	BufferedCPUScalarField pressure;
+	CPUScalarField divergence;
+	// Only updated while FluidSimDiagnostics::DivergenceCheck is requested
+	CPUScalarField divergenceCheck;
+
+	BufferedCPUScalarField inkDensity;
 };
@@ -1,8 +1,10 @@
 #include "gui.h"
 
 #include "Context.h"
+#include "profiler.hpp"
 
-void doGUI(FluidSim& fluidSim, FluidState& fluidState, SimulationControls& simControls, FluidSimRenderParameters& renderParams, Empty::gl::ShaderProgram& debugDrawProgram, float dt)
+void doGUI(FluidSimSettings& simSettings, const FluidSimStats& simStats, FluidGridParameters& grid, FluidPhysicalProperties& physics,
+	const FluidSimCommandRunner& runCommand, SimulationControls& simControls, FluidSimRenderParameters& renderParams, Empty::gl::ShaderProgram& debugDrawProgram, float dt)
 {
 	if (ImGui::Begin("Fluid simulation", nullptr, ImGuiWindowFlags_AlwaysAutoResize))
 	{
@@ -17,35 +19,138 @@ void doGUI(FluidSim& fluidSim, FluidState& fluidState, SimulationControls& simCo
 		if (ImGui::IsKeyPressed(ImGuiKey_R) && !ImGui::GetIO().WantCaptureKeyboard)
 			simControls.runOneStep = true;
 		if (ImGui::Button("Reset"))
-			fluidState.reset();
+			runCommand([](FluidSim&, FluidState& fluidState) { fluidState.reset(); });
 
-		ImGui::Checkbox("Advection", &fluidSim.runAdvection);
-		ImGui::Checkbox("Diffusion", &fluidSim.runDiffusion);
-		ImGui::Checkbox("Divergence", &fluidSim.runDivergence);
-		ImGui::Checkbox("Pressure", &fluidSim.runPressure);
-		ImGui::Checkbox("Projection", &fluidSim.runProjection);
+		ImGui::Checkbox("Advection", &simSettings.runAdvection);
+		ImGui::Checkbox("Diffusion", &simSettings.runDiffusion);
+		ImGui::Checkbox("Divergence", &simSettings.runDivergence);
+		ImGui::Checkbox("Pressure", &simSettings.runPressure);
+		ImGui::Checkbox("Projection", &simSettings.runProjection);
+		ImGui::Checkbox("Fused advection", &simSettings.fusedAdvection);
+		{
+			int interpolation = static_cast<int>(simSettings.advectionInterpolation);
+			if (ImGui::Combo("Advection interpolation", &interpolation, "Monotonic cubic\0B-spline\0Clamped B-spline\0"))
+				simSettings.advectionInterpolation = static_cast<AdvectionInterpolation>(interpolation);
+		}
+		ImGui::Checkbox("Sparse bricks", &simSettings.sparseBricks);
+		if (simSettings.sparseBricks)
+		{
+			ImGui::DragFloat("Brick activity threshold", &simSettings.brickActivityThreshold, 0.00001f, 0.f, 1.f, "%.5f");
+			ImGui::TextDisabled("%d active bricks", simStats.activeBricks);
+		}
+
+		ImGui::Checkbox("Adaptive time step", &simSettings.adaptiveTimeStep);
+		if (simSettings.adaptiveTimeStep)
+		{
+			ImGui::DragFloat("CFL number", &simSettings.cflNumber, 0.01f, 0.1f, 10.f);
+			ImGui::DragInt("Max substeps", &simSettings.maxSubsteps, 1, 1, 32);
+			ImGui::TextDisabled("%d substeps, max velocity %.3f m/s", simStats.lastSubsteps, simStats.maxVelocity);
+		}
 
 		ImGui::Separator();
 		ImGui::DragInt3("Grid scroll", simControls.gridScroll);
 		ImGui::SameLine();
 		if (ImGui::Button("Apply"))
-			fluidSim.scrollGrid(fluidState, simControls.gridScroll);
+		{
+			Empty::math::ivec3 scroll = simControls.gridScroll;
+			runCommand([scroll](FluidSim& fluidSim, FluidState& fluidState) { fluidSim.scrollGrid(fluidState, scroll); });
+		}
 
 		ImGui::Separator();
 		ImGui::TextDisabled("Jacobi solver parameters");
-		ImGui::DragInt("Diffusion Jacobi steps", &fluidSim.diffusionJacobiSteps, 1, 1);
-		ImGui::DragInt("Pressure Jacobi steps", &fluidSim.pressureJacobiSteps, 1, 1);
-		ImGui::Checkbox("Reuse pressure from last step", &fluidSim.reuseLastPressure);
+		ImGui::DragInt("Diffusion Jacobi steps", &simSettings.diffusionJacobiSteps, 1, 1);
+		ImGui::DragInt("Pressure Jacobi steps", &simSettings.pressureJacobiSteps, 1, 1);
+		{
+			int scheme = static_cast<int>(simSettings.relaxationScheme);
+			if (ImGui::Combo("Relaxation scheme", &scheme, "Jacobi\0Red-black SOR\0Chebyshev\0"))
+				simSettings.relaxationScheme = static_cast<RelaxationScheme>(scheme);
+		}
+		if (simSettings.relaxationScheme == RelaxationScheme::Jacobi)
+			ImGui::SliderInt("Jacobi iterations per dispatch", &simSettings.jacobiIterationsPerDispatch, 1, 4);
+		if (simSettings.relaxationScheme == RelaxationScheme::RedBlackSOR)
+		{
+			ImGui::SliderFloat("Diffusion SOR relaxation", &simSettings.diffusionSORRelaxation, 0.1f, 1.99f);
+			ImGui::SliderFloat("Pressure SOR relaxation", &simSettings.pressureSORRelaxation, 0.1f, 1.99f);
+		}
+		{
+			auto toleranceControls = [](const char* label, JacobiTolerance& tolerance)
+				{
+					ImGui::PushID(label);
+					ImGui::DragFloat(label, &tolerance.tolerance, 0.0001f, 0.f, 1.f, "%.5f");
+					if (tolerance.tolerance > 0.f)
+					{
+						ImGui::DragInt("Residual check interval", &tolerance.checkInterval, 1, 1, 100);
+						int norm = static_cast<int>(tolerance.norm);
+						if (ImGui::Combo("Residual norm", &norm, "L2\0L-infinity\0"))
+							tolerance.norm = static_cast<ResidualNorm>(norm);
+					}
+					ImGui::PopID();
+				};
+			toleranceControls("Diffusion Jacobi tolerance", simSettings.diffusionJacobiTolerance);
+			toleranceControls("Pressure Jacobi tolerance", simSettings.pressureJacobiTolerance);
+		}
+		ImGui::Checkbox("Reuse pressure from last step", &simSettings.reuseLastPressure);
+		{
+			int solver = static_cast<int>(simSettings.diffusionSolver);
+			if (ImGui::Combo("Diffusion solver", &solver, "Jacobi\0ADI\0"))
+				simSettings.diffusionSolver = static_cast<DiffusionSolver>(solver);
+		}
+		{
+			int solver = static_cast<int>(simSettings.pressureSolver);
+			if (ImGui::Combo("Pressure solver", &solver, "Jacobi\0Multigrid\0Conjugate gradient\0Poisson filter\0"))
+				simSettings.pressureSolver = static_cast<PressureSolver>(solver);
+		}
+		if (simSettings.pressureSolver == PressureSolver::Multigrid)
+		{
+			int cycle = static_cast<int>(simSettings.multigridCycle) - 1;
+			if (ImGui::Combo("Multigrid cycle", &cycle, "V-cycle\0W-cycle\0"))
+				simSettings.multigridCycle = static_cast<MultigridCycle>(cycle + 1);
+			ImGui::DragInt("Multigrid cycles", &simSettings.multigridCycles, 1, 1, 20);
+			ImGui::DragInt("Multigrid smoothing steps", &simSettings.multigridSmoothingSteps, 1, 1, 10);
+		}
+		else if (simSettings.pressureSolver == PressureSolver::Jacobi && simSettings.pressureJacobiTolerance.tolerance > 0.f)
+		{
+			const auto& report = simStats.pressureSolveReport;
+			ImGui::TextDisabled("%d iterations, residual %.6f", report.iterations, report.residual);
+		}
+		else if (simSettings.pressureSolver == PressureSolver::ConjugateGradient)
+		{
+			int preconditioner = static_cast<int>(simSettings.pcgPreconditioner);
+			if (ImGui::Combo("PCG preconditioner", &preconditioner, "Jacobi\0Incomplete Poisson\0"))
+				simSettings.pcgPreconditioner = static_cast<PCGPreconditioner>(preconditioner);
+			ImGui::DragInt("PCG max iterations", &simSettings.pcgMaxIterations, 1, 1, 1000);
+			ImGui::DragFloat("PCG tolerance", &simSettings.pcgTolerance, 0.0001f, 0.f, 1.f, "%.5f");
+			const auto& report = simStats.pressureSolveReport;
+			ImGui::TextDisabled("%d iterations, residual %.6f", report.iterations, report.residual);
+		}
+		else if (simSettings.pressureSolver == PressureSolver::PoissonFilter)
+		{
+			ImGui::DragInt("Poisson filter iterations", &simSettings.poissonFilterIterations, 1, 1, 256);
+			ImGui::DragInt("Poisson filter rank", &simSettings.poissonFilterRank, 1, 1, 8);
+		}
 		ImGui::Separator();
 		ImGui::TextDisabled("Fluid physics properties");
-		ImGui::SliderFloat("Grid cell size (m)", &fluidState.grid.cellSize, 0.0001f, 1.f);
-		ImGui::SliderFloat("Density (kg/dm^3)", &fluidState.physics.density, 0.0001f, 1.f);
-		ImGui::SliderFloat("Kinematic viscosity (m^2/s)", &fluidState.physics.kinematicViscosity, 0.f, 0.005f, "%.5f");
+		ImGui::SliderFloat("Grid cell size (m)", &grid.cellSize, 0.0001f, 1.f);
+		ImGui::SliderFloat("Density (kg/dm^3)", &physics.density, 0.0001f, 1.f);
+		ImGui::SliderFloat("Kinematic viscosity (m^2/s)", &physics.kinematicViscosity, 0.f, 0.005f, "%.5f");
 		ImGui::Separator();
 		ImGui::TextDisabled("Fluid rendering options");
 		ImGui::DragFloat("In-world sim cell size", &renderParams.gridCellSizeInUnits, 0.001f);
 		ImGui::ColorEdit3("Ink color", renderParams.inkColor);
 		ImGui::DragFloat("Ink color scale", &renderParams.inkMultiplier, 0.01f, 0.0f, 5.f);
+		{
+			// Divisors 1, 2 and 4
+			int resolution = renderParams.resolutionDivisor == 4 ? 2 : renderParams.resolutionDivisor - 1;
+			if (ImGui::Combo("Volume resolution", &resolution, "Full\0Half\0Quarter\0\0"))
+				renderParams.resolutionDivisor = 1 << resolution;
+		}
+		if (renderParams.resolutionDivisor > 1)
+		{
+			ImGui::DragFloat("Upsample depth sharpness", &renderParams.upsampleDepthSharpness, 0.1f, 0.f, 100.f);
+			ImGui::Checkbox("Temporal accumulation", &renderParams.temporalAccumulation);
+			if (renderParams.temporalAccumulation)
+				ImGui::DragFloat("Temporal blend", &renderParams.temporalBlend, 0.01f, 0.01f, 1.f);
+		}
 		ImGui::Separator();
 		ImGui::TextDisabled("Mouse click impulse parameters");
 		ImGui::DragFloat("Force scale", &simControls.forceScale, 0.1f, 0.f, 20.f);
@@ -64,43 +169,109 @@ void doGUI(FluidSim& fluidSim, FluidState& fluidState, SimulationControls& simCo
 				axis[simControls.gaussianImpulseAxis] = 1.f;
 				gImpulse.magnitude = axis * simControls.forceScale * scale;
 				gImpulse.radius = simControls.impulse.radius;
-				gImpulse.position = Empty::math::vec3(fluidState.grid.size) / 2.f;
+				gImpulse.position = Empty::math::vec3(grid.size) / 2.f;
 
-				fluidSim.applyForces(fluidState, gImpulse, false, dt);
+				runCommand([gImpulse, dt](FluidSim& fluidSim, FluidState& fluidState) mutable
+					{
+						fluidSim.applyForces(fluidState, gImpulse, false, dt);
+					});
 			}
 		}
 		ImGui::Separator();
 		ImGui::TextDisabled("Debug texture display");
 		ImGui::Checkbox("Display debug texture", &simControls.displayDebugTexture);
-		if (ImGui::SliderInt("Debug texture Z slice", &simControls.debugTextureSlice, 0, fluidState.grid.size.z - 1))
-			debugDrawProgram.uniform("uUVZ", (simControls.debugTextureSlice + 0.5f) / fluidState.grid.size.z);
+		if (ImGui::SliderInt("Debug texture Z slice", &simControls.debugTextureSlice, 0, grid.size.z - 1))
+			debugDrawProgram.uniform("uUVZ", (simControls.debugTextureSlice + 0.5f) / grid.size.z);
 		ImGui::Combo("Display which", &simControls.whichDebugTexture, "Velocity X\0Velocity Y\0Velocity Z\0Pressure\0Velocity divergence\0Divergence zero check\0Boundaries\0");
+		FluidSimHookId hookId = simControls.debugTextureLambdaHookId;
+		FluidSimDiagnostics diagnostics = simControls.displayDebugTexture && simControls.whichDebugTexture == 5
+			? FluidSimDiagnostics::DivergenceCheck : FluidSimDiagnostics::None;
+		if (diagnostics != simControls.debugTextureDiagnostics)
+		{
+			simControls.debugTextureDiagnostics = diagnostics;
+			runCommand([hookId, diagnostics](FluidSim& fluidSim, FluidState&) { fluidSim.modifyHookDiagnostics(hookId, diagnostics); });
+		}
 		if (ImGui::Combo("Display when", &simControls.whenDebugTexture, "Start of frame\0After advection\0After diffusion\0After divergence\0After pressure computation\0After projection\0"))
-			fluidSim.modifyHookStage(simControls.debugTextureLambdaHookId, static_cast<FluidSimHookStage>(simControls.whenDebugTexture));
+		{
+			FluidSimHookStage stage = static_cast<FluidSimHookStage>(simControls.whenDebugTexture);
+			runCommand([hookId, stage](FluidSim& fluidSim, FluidState&) { fluidSim.modifyHookStage(hookId, stage); });
+		}
 
 		if (ImGui::DragFloat("Debug color scale", &simControls.colorScale, 0.001f, 0.0f, 1.f))
 			debugDrawProgram.uniform("uColorScale", simControls.colorScale);
 	}
 	ImGui::End();
+
+	if (ImGui::Begin("GPU profiler", nullptr, ImGuiWindowFlags_AlwaysAutoResize))
+	{
+		ImGui::TextDisabled("Last frame / average, in ms. Results are a few frames late.");
+		GPUProfiler::forEach([](const std::string& label, const std::vector<GPUProfiler::StageTiming>& timings)
+			{
+				ImGui::Separator();
+				ImGui::TextDisabled("%s", label.c_str());
+				for (const auto& timing : timings)
+				{
+					ImGui::Indent(timing.depth * 10.f + 1.f);
+					ImGui::Text("%-16s %7.3f / %7.3f", timing.name, timing.lastMs, timing.averageMs);
+					ImGui::Unindent(timing.depth * 10.f + 1.f);
+				}
+			});
+
+		ImGui::Separator();
+		if (GPUProfiler::isRecording())
+		{
+			if (ImGui::Button("Stop recording"))
+				GPUProfiler::stopRecording();
+		}
+		else if (ImGui::Button("Record trace"))
+			GPUProfiler::startRecording();
+		ImGui::SameLine();
+		ImGui::TextDisabled("%zu events", GPUProfiler::recordedEvents());
+		if (ImGui::Button("Export trace"))
+		{
+			const char* path = "fluidsim_trace.json";
+			simControls.traceExportStatus = GPUProfiler::exportTrace(path) ? std::string("Wrote ") + path : std::string("Failed to write ") + path;
+		}
+		if (!simControls.traceExportStatus.empty())
+		{
+			ImGui::SameLine();
+			ImGui::TextDisabled("%s", simControls.traceExportStatus.c_str());
+		}
+	}
+	ImGui::End();
 }
 
-void displayTexture(Empty::gl::ShaderProgram& debugDrawProgram, FluidState& fluidState, int whichDebugTexture)
+static void drawDebugTexture(Empty::gl::ShaderProgram& debugDrawProgram, Empty::gl::TextureInfo texture, bool intTexture, int channel,
+	Empty::gl::Buffer& gridRingBuffer)
 {
 	Context& context = Context::get();
 
+	if (intTexture)
+		debugDrawProgram.registerTexture("uIntTexture", texture);
+	else
+		debugDrawProgram.registerTexture("uTexture", texture);
+
+	debugDrawProgram.uniform("uUseIntTexture", intTexture);
+	debugDrawProgram.uniform("uChannel", channel);
+
+	context.bind(gridRingBuffer, Empty::gl::IndexedBufferTarget::Uniform, gridRingBinding);
+	context.setShaderProgram(debugDrawProgram);
+	context.drawArrays(Empty::gl::PrimitiveType::Triangles, 0, 6);
+}
+
+void displayTexture(Empty::gl::ShaderProgram& debugDrawProgram, FluidState& fluidState, int whichDebugTexture)
+{
 	Empty::gl::TextureInfo texture;
 	bool intTexture = false;
+	int channel = 0;
 
 	switch (whichDebugTexture)
 	{
 	case 0:
-		texture = fluidState.velocityX.getInput();
-		break;
 	case 1:
-		texture = fluidState.velocityY.getInput();
-		break;
 	case 2:
-		texture = fluidState.velocityZ.getInput();
+		texture = fluidState.velocity.getInput();
+		channel = whichDebugTexture;
 		break;
 	case 3:
 		texture = fluidState.pressure.getInput();
@@ -122,13 +293,10 @@ void displayTexture(Empty::gl::ShaderProgram& debugDrawProgram, FluidState& flui
 		FATAL("invalid requested debug texture");
 	}
 
-	if (intTexture)
-		debugDrawProgram.registerTexture("uIntTexture", texture);
-	else
-		debugDrawProgram.registerTexture("uTexture", texture);
-
-	debugDrawProgram.uniform("uUseIntTexture", intTexture);
+	drawDebugTexture(debugDrawProgram, texture, intTexture, channel, fluidState.gridRingBuffer);
+}
 
-	context.setShaderProgram(debugDrawProgram);
-	context.drawArrays(Empty::gl::PrimitiveType::Triangles, 0, 6);
+void displayInk(Empty::gl::ShaderProgram& debugDrawProgram, GPUInkField& inkDensity, Empty::gl::Buffer& gridRingBuffer)
+{
+	drawDebugTexture(debugDrawProgram, inkDensity, false, 0, gridRingBuffer);
 }
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <functional>
+#include <string>
+
+#include <Empty/gl/Buffer.h>
 #include <Empty/gl/ShaderProgram.hpp>
 #include <Empty/math/vec.h>
 
@@ -28,7 +32,19 @@ struct SimulationControls
 	FluidSimMouseClickImpulse impulse;
 
 	FluidSimHookId debugTextureLambdaHookId;
+	// Last handed to the hook
+	FluidSimDiagnostics debugTextureDiagnostics = FluidSimDiagnostics::None;
+
+	// Result of the last GPU trace export
+	std::string traceExportStatus;
 };
 
-void doGUI(FluidSim& fluidSim, FluidState& fluidState, SimulationControls& simControls, FluidSimRenderParameters& renderParams, Empty::gl::ShaderProgram& debugDrawProgram, float dt);
+// Runs a command on the sim and its state right away, or hands it to the thread stepping them
+using FluidSimCommandRunner = std::function<void(FluidSimCommand command)>;
+
+// Edits settings and shows stats which may be copies of the sim's, and only touches the sim and its state through runCommand
+void doGUI(FluidSimSettings& simSettings, const FluidSimStats& simStats, FluidGridParameters& grid, FluidPhysicalProperties& physics,
+	const FluidSimCommandRunner& runCommand, SimulationControls& simControls, FluidSimRenderParameters& renderParams, Empty::gl::ShaderProgram& debugDrawProgram, float dt);
 void displayTexture(Empty::gl::ShaderProgram& debugDrawProgram, FluidState& fluidState, int whichDebugTexture);
+// Same as the ink density debug texture, from a copy of the ink stored with another grid ring
+void displayInk(Empty::gl::ShaderProgram& debugDrawProgram, GPUInkField& inkDensity, Empty::gl::Buffer& gridRingBuffer);
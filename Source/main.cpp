@@ -1,3 +1,12 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <utility>
+
 #include <Empty/gl/Buffer.h>
 #include <Empty/gl/VertexArray.h>
 #include <Empty/gl/ShaderProgram.hpp>
@@ -5,10 +14,13 @@
 #include <Empty/utils/macros.h>
 
 #include "Camera.h"
+#include "cpu_solver.hpp"
 #include "fields.hpp"
 #include "fluid.hpp"
 #include "gui.h"
+#include "profiler.hpp"
 #include "render.hpp"
+#include "sim_thread.hpp"
 #include "solver.hpp"
 
 #define IM_VEC2_CLASS_EXTRA                                                   \
@@ -19,7 +31,7 @@
 
 using namespace Empty::gl;
 
-Context Context::_instance;
+thread_local Context Context::_instance;
 
 void debugCallback(DebugMessageSource source, DebugMessageType type, DebugMessageSeverity severity, int id, const std::string& text, const void* userData)
 {
@@ -38,8 +50,136 @@ void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 	}
 };
 
+// Runs the CPU solver without opening a window, for machines without a GPU.
+// Usage : FluidSimTest --headless [frames] [threads]
+int runHeadless(int frames, unsigned int threads, bool spectral)
+{
+	FluidGridParameters grid;
+	grid.size = Empty::math::uvec3(64, 64, 64);
+	grid.cellSize = 0.8f;
+	FluidPhysicalProperties physics;
+	physics.density = 1.f;
+	physics.kinematicViscosity = 0.0025f;
+	CPUFluidState fluidState(grid, physics);
+	CPUFluidSim fluidSim(fluidState.grid.size, threads);
+	fluidSim.viewerDiagnostics = FluidSimDiagnostics::DivergenceCheck;
+	if (spectral)
+		fluidSim.pressureSolver = CPUPressureSolver::Spectral;
+
+	TRACE("Running " << frames << " headless frames on " << fluidSim.getNumThreads() << " threads with "
+		<< (spectral ? "spectral" : "Jacobi") << " pressure solves");
+
+	const float dt = 1 / 60.f;
+
+	// Same as the GUI's centered gaussian
+	FluidSimMouseClickImpulse impulse;
+	impulse.inkAmount *= 20.f;
+	impulse.magnitude = Empty::math::vec3(0.f, 100.f, 0.f);
+	impulse.position = Empty::math::vec3(fluidState.grid.size) / 2.f;
+	fluidSim.applyForces(fluidState, impulse, false, dt);
+
+	auto then = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < frames; i++)
+		fluidSim.advance(fluidState, dt);
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - then;
+	TRACE("Done in " << elapsed.count() << " ms (" << elapsed.count() / frames << " ms per frame)");
+
+	// What the pressure solve left, to compare solvers
+	double divergence = 0.;
+	for (float value : fluidState.divergenceCheck.data)
+		divergence += static_cast<double>(value) * value;
+	TRACE("Divergence after projection : " << std::sqrt(divergence / fluidState.divergenceCheck.data.size()) << " RMS");
+
+	return 0;
+}
+
+// Runs the CPU solver with 32-bit storage and with emulated 16-bit storage side by side, and reports
+// how far the 16-bit fields drift, to judge the accuracy cost of FLUIDSIM_HALF_PRECISION_FIELDS.
+// Usage : FluidSimTest --half-drift [frames] [threads]
+int runHalfPrecisionDrift(int frames, unsigned int threads)
+{
+	FluidGridParameters grid;
+	grid.size = Empty::math::uvec3(64, 64, 64);
+	grid.cellSize = 0.8f;
+	FluidPhysicalProperties physics;
+	physics.density = 1.f;
+	physics.kinematicViscosity = 0.0025f;
+	CPUFluidState fullState(grid, physics);
+	CPUFluidState halfState(grid, physics);
+	CPUFluidSim fullSim(grid.size, threads);
+	CPUFluidSim halfSim(grid.size, threads);
+	halfSim.halfPrecisionStorage = true;
+	fullSim.viewerDiagnostics = FluidSimDiagnostics::DivergenceCheck;
+	halfSim.viewerDiagnostics = FluidSimDiagnostics::DivergenceCheck;
+
+	const float dt = 1 / 60.f;
+
+	// Same as the headless run
+	FluidSimMouseClickImpulse impulse;
+	impulse.inkAmount *= 20.f;
+	impulse.magnitude = Empty::math::vec3(0.f, 100.f, 0.f);
+	impulse.position = Empty::math::vec3(grid.size) / 2.f;
+	fullSim.applyForces(fullState, impulse, false, dt);
+	halfSim.applyForces(halfState, impulse, false, dt);
+
+	// Root mean square of the difference relative to the root mean square of the 32-bit field
+	auto drift = [](std::initializer_list<std::pair<const CPUScalarField*, const CPUScalarField*>> fields)
+		{
+			double difference = 0., reference = 0.;
+			for (const auto& pair : fields)
+				for (size_t i = 0; i < pair.first->data.size(); i++)
+				{
+					double full = pair.first->data[i], half = pair.second->data[i];
+					difference += (half - full) * (half - full);
+					reference += full * full;
+				}
+			return reference > 0. ? std::sqrt(difference / reference) : 0.;
+		};
+
+	for (int i = 1; i <= frames; i++)
+	{
+		fullSim.advance(fullState, dt);
+		halfSim.advance(halfState, dt);
+
+		if (i % 10 != 0 && i != frames)
+			continue;
+
+		double velocityDrift = drift({ { &fullState.velocityX.getInput(), &halfState.velocityX.getInput() },
+			{ &fullState.velocityY.getInput(), &halfState.velocityY.getInput() },
+			{ &fullState.velocityZ.getInput(), &halfState.velocityZ.getInput() } });
+		double inkDrift = drift({ { &fullState.inkDensity.getInput(), &halfState.inkDensity.getInput() } });
+		double divergenceDrift = drift({ { &fullState.divergenceCheck, &halfState.divergenceCheck } });
+		TRACE("Frame " << i << " : velocity " << velocityDrift * 100. << "%, ink " << inkDrift * 100.
+			<< "%, divergence after projection " << divergenceDrift * 100. << "% relative RMS drift");
+	}
+
+	return 0;
+}
+
 int main(int argc, char* argv[])
 {
+	if (argc > 1 && std::string(argv[1]) == "--headless")
+	{
+		int frames = argc > 2 ? std::max(1, std::atoi(argv[2])) : 100;
+		unsigned int threads = argc > 3 ? static_cast<unsigned int>(std::max(0, std::atoi(argv[3]))) : 0;
+		bool spectral = argc > 4 && std::string(argv[4]) == "spectral";
+		return runHeadless(frames, threads, spectral);
+	}
+
+	if (argc > 1 && std::string(argv[1]) == "--half-drift")
+	{
+		int frames = argc > 2 ? std::max(1, std::atoi(argv[2])) : 100;
+		unsigned int threads = argc > 3 ? static_cast<unsigned int>(std::max(0, std::atoi(argv[3]))) : 0;
+		return runHalfPrecisionDrift(frames, threads);
+	}
+
+	// Steps the sim on its own thread at a fixed rate instead of once per frame.
+	// Usage : FluidSimTest --async-sim [steps per second]
+	bool asyncSim = argc > 1 && std::string(argv[1]) == "--async-sim";
+	float simStepsPerSecond = asyncSim && argc > 2 ? std::max(1.f, static_cast<float>(std::atof(argv[2]))) : 60.f;
+
 	Context& context = Context::get();
 
 	if (!context.init("Fluid simulation tests", 1920, 1080))
@@ -55,6 +195,8 @@ int main(int argc, char* argv[])
 	context.enable(ContextCapability::Blend);
 	context.blendFunction(BlendFunction::SourceAlpha, BlendFunction::OneMinusSourceAlpha);
 
+	GPUProfiler::get().label = "Render thread";
+
 	// Fluid setup
 	FluidGridParameters grid;
 	grid.size = Empty::math::uvec3(64, 64, 64);
@@ -64,6 +206,8 @@ int main(int argc, char* argv[])
 	physics.kinematicViscosity = 0.0025f;
 	FluidState fluidState(grid, physics);
 	FluidSim fluidSim(fluidState.grid.size);
+	// Frame times vary, headless runs keep a fixed time step instead
+	fluidSim.adaptiveTimeStep = true;
 
 	// Fluid rendering
 	VertexArray debugVAO("Debug VAO");
@@ -85,14 +229,18 @@ int main(int argc, char* argv[])
 	ShaderProgram debugDrawProgram("Debug draw program");
 	debugDrawProgram.attachFile(ShaderType::Vertex, "shaders/draw/debug_vertex.glsl", "Debug draw vertex");
 	debugDrawProgram.attachFile(ShaderType::Fragment, "shaders/draw/debug_fragment.glsl", "Debug draw fragment");
+	debugDrawProgram.attachFile(ShaderType::Fragment, "shaders/sim/ring.glsl", "Debug draw ring");
 	debugDrawProgram.build();
 	debugDrawProgram.uniform("uRect", simControls.debugRect);
 	debugDrawProgram.uniform("uOneOverScreenSize", Empty::math::vec2(1.f / context.frameWidth, 1.f / context.frameHeight));
 	debugDrawProgram.uniform("uColorScale", simControls.colorScale);
 	debugDrawProgram.uniform("uUVZ", 0.f);
 
-	auto debugTextureLambda = [&simControls, &debugDrawProgram](FluidState& fluidState, float dt)
+	auto debugTextureLambda = [&simControls, &debugDrawProgram, asyncSim](FluidState& fluidState, float dt)
 		{
+			// The sim thread has no window to draw to, the debug texture is displayed between steps instead
+			if (asyncSim)
+				return;
 			Context::get().memoryBarrier(MemoryBarrierType::ShaderImageAccess);
 			if (simControls.displayDebugTexture)
 				displayTexture(debugDrawProgram, fluidState, simControls.whichDebugTexture);
@@ -100,15 +248,32 @@ int main(int argc, char* argv[])
 
 	simControls.debugTextureLambdaHookId = fluidSim.registerHook(debugTextureLambda, FluidSimHookStage::Start);
 
+	// What the GUI edits in place of the sim while it runs on its own thread
+	SimulationThread::Settings asyncSettings{ fluidSim, fluidState.grid, fluidState.physics };
+
+	// Last, so it stops before the sim and its state go away
+	std::unique_ptr<SimulationThread> simThread;
+	if (asyncSim)
+		simThread = std::make_unique<SimulationThread>(fluidSim, fluidState, simStepsPerSecond);
+
 	while (!glfwWindowShouldClose(context.window))
 	{
 		context.newFrame();
+		GPUProfiler::get().newFrame();
 
 		double now = glfwGetTime();
 		Empty::math::vec2 mouseNow = ImGui::GetMousePos();
 		float dt = static_cast<float>(now - then);
 
-		doGUI(fluidSim, fluidState, simControls, fluidRenderParameters, debugDrawProgram, dt);
+		// A sim on its own thread is only handed copies of what the GUI edits, and commands, at the start of its next step
+		if (simThread)
+			doGUI(asyncSettings.sim, simThread->getStats(), asyncSettings.grid, asyncSettings.physics,
+				[&simThread](FluidSimCommand command) { simThread->queueCommand(std::move(command)); },
+				simControls, fluidRenderParameters, debugDrawProgram, dt);
+		else
+			doGUI(fluidSim, fluidSim.getStats(), fluidState.grid, fluidState.physics,
+				[&fluidSim, &fluidState](FluidSimCommand command) { command(fluidSim, fluidState); },
+				simControls, fluidRenderParameters, debugDrawProgram, dt);
 
 		/// Simulation steps
 
@@ -125,14 +290,33 @@ int main(int argc, char* argv[])
 			impulse.position.z = simControls.debugTextureSlice + 0.5f;
 			impulse.position.y = fluidState.grid.size.y - impulse.position.y;
 
-			context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
-			fluidSim.applyForces(fluidState, impulse, rightMouseDown, dt);
+			if (simThread)
+				simThread->pushImpulse(impulse, rightMouseDown, dt);
+			else
+			{
+				context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+				fluidSim.applyForces(fluidState, impulse, rightMouseDown, dt);
+			}
 		}
 
 		context.bind(debugVAO);
 
 		// Advance simulation
-		if (!simControls.pauseSimulation || simControls.runOneStep)
+		if (simThread)
+		{
+			asyncSettings.paused = simControls.pauseSimulation;
+			asyncSettings.stepOnce = simControls.runOneStep;
+			simThread->submitSettings(asyncSettings);
+			simControls.runOneStep = false;
+
+			// Only reading the live fields waits on the sim
+			if (simControls.displayDebugTexture)
+			{
+				SimulationThread::Lock simLock(*simThread);
+				displayTexture(debugDrawProgram, fluidState, simControls.whichDebugTexture);
+			}
+		}
+		else if (!simControls.pauseSimulation || simControls.runOneStep)
 		{
 			fluidSim.advance(fluidState, simControls.runOneStep ? 1 / 60.f : dt);
 
@@ -147,7 +331,12 @@ int main(int argc, char* argv[])
 
 		// Display it
 		{
-			fluidRenderer.renderFluidSim(fluidState, fluidRenderParameters, camera, simControls.debugTextureSlice);
+			GPUInkField* publishedInk = simThread ? &simThread->acquireInk() : nullptr;
+			if (publishedInk)
+				fluidRenderer.renderFluidSim(*publishedInk, simThread->getPublishedGridRing(), fluidRenderParameters, camera,
+					simControls.debugTextureSlice);
+			else
+				fluidRenderer.renderFluidSim(fluidState, fluidRenderParameters, camera, simControls.debugTextureSlice);
 
 			// Display the debug view
 			auto* drawList = ImGui::GetBackgroundDrawList();
@@ -157,7 +346,9 @@ int main(int argc, char* argv[])
 				ImColor(0, 255, 0));
 
 			context.bind(debugVAO);
-			if (!simControls.displayDebugTexture)
+			if (publishedInk && !simControls.displayDebugTexture)
+				displayInk(debugDrawProgram, *publishedInk, simThread->getPublishedGridRing());
+			else if (!simControls.displayDebugTexture)
 				displayTexture(debugDrawProgram, fluidState, 7); // ink density
 		}
 
@@ -181,6 +372,8 @@ int main(int argc, char* argv[])
 		mouseThen = mouseNow;
 	}
 
+	simThread.reset();
+	GPUProfiler::get().release();
 	context.terminate();
 
 	return 0;
@@ -0,0 +1,170 @@
+#include "poisson_filter.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <random>
+
+namespace
+{
+	// Dense cube of side 2 * radius + 1 centered on the origin
+	struct Kernel
+	{
+		Kernel(int radius)
+			: side(2 * radius + 1)
+			, data(static_cast<size_t>(side) * side * side, 0.)
+		{ }
+
+		size_t index(int x, int y, int z) const { return x + static_cast<size_t>(side) * (y + static_cast<size_t>(side) * z); }
+
+		int side;
+		std::vector<double> data;
+	};
+
+	// Beyond 4 standard deviations of the random walk J^i describes, what's left is negligible
+	int kernelRadius(int iterations)
+	{
+		return std::min(iterations - 1, static_cast<int>(std::ceil(4. * std::sqrt(iterations / 3.))) + 1);
+	}
+
+	Kernel jacobiKernel(int iterations, float beta, int radius)
+	{
+		Kernel kernel(radius), power(radius), next(radius);
+		int side = kernel.side;
+		double oneOverBeta = 1. / beta;
+
+		power.data[power.index(radius, radius, radius)] = 1.;
+		for (int i = 0; i < iterations; i++)
+		{
+			for (size_t t = 0; t < kernel.data.size(); t++)
+				kernel.data[t] += power.data[t];
+
+			if (i == iterations - 1)
+				break;
+
+			// J^i only reaches i cells away from the center
+			int lo = std::max(0, radius - i - 1), hi = std::min(side - 1, radius + i + 1);
+			auto at = [&](int x, int y, int z) { return x < 0 || y < 0 || z < 0 || x >= side || y >= side || z >= side ? 0. : power.data[power.index(x, y, z)]; };
+			for (int z = lo; z <= hi; z++)
+				for (int y = lo; y <= hi; y++)
+					for (int x = lo; x <= hi; x++)
+						next.data[next.index(x, y, z)] = oneOverBeta * (at(x - 1, y, z) + at(x + 1, y, z) + at(x, y - 1, z)
+							+ at(x, y + 1, z) + at(x, y, z - 1) + at(x, y, z + 1));
+			std::swap(power.data, next.data);
+		}
+
+		return kernel;
+	}
+
+	// G(., f, f), the contraction of the kernel with f along its last two axes
+	std::vector<double> contract(const Kernel& kernel, const std::vector<double>& f)
+	{
+		int side = kernel.side;
+		std::vector<double> result(side, 0.);
+		for (int z = 0; z < side; z++)
+			for (int y = 0; y < side; y++)
+			{
+				double fyz = f[y] * f[z];
+				const double* row = &kernel.data[kernel.index(0, y, z)];
+				for (int x = 0; x < side; x++)
+					result[x] += row[x] * fyz;
+			}
+		return result;
+	}
+
+	double dot(const std::vector<double>& a, const std::vector<double>& b)
+	{
+		double sum = 0.;
+		for (size_t i = 0; i < a.size(); i++)
+			sum += a[i] * b[i];
+		return sum;
+	}
+
+	void normalize(std::vector<double>& f)
+	{
+		double norm = std::sqrt(dot(f, f));
+		if (norm > 0.)
+			for (double& value : f)
+				value /= norm;
+	}
+}
+
+PoissonFilters computePoissonFilters(int iterations, float beta, int rank)
+{
+	assert(iterations > 0 && rank > 0);
+
+	constexpr int powerIterations = 20;
+	constexpr int refinementSweeps = 6;
+
+	PoissonFilters filters;
+	filters.iterations = iterations;
+	filters.rank = rank;
+	filters.radius = std::max(0, kernelRadius(iterations));
+
+	Kernel kernel = jacobiKernel(iterations, beta, filters.radius);
+	int side = kernel.side;
+
+	std::vector<double> weights(rank, 0.);
+	std::vector<std::vector<double>> factors(rank, std::vector<double>(side, 0.));
+
+	// Symmetric power iteration for term r against the kernel minus all other terms,
+	// whose contraction is G(., f, f) - sum of w_j f_j (f_j . f)^2
+	auto fitTerm = [&](int r, int numTerms)
+		{
+			std::vector<double>& f = factors[r];
+			for (int it = 0; it <= powerIterations; it++)
+			{
+				std::vector<double> next = contract(kernel, f);
+				for (int j = 0; j < numTerms; j++)
+				{
+					if (j == r)
+						continue;
+					double projection = dot(factors[j], f);
+					for (int x = 0; x < side; x++)
+						next[x] -= weights[j] * factors[j][x] * projection * projection;
+				}
+
+				if (it == powerIterations)
+				{
+					// w = E(f, f, f)
+					weights[r] = dot(next, f);
+					break;
+				}
+
+				normalize(next);
+				f = next;
+			}
+		};
+
+	// Greedy deflation, then a few sweeps refitting each term against the others
+	std::mt19937 rng(0);
+	std::uniform_real_distribution<double> distribution(-1., 1.);
+	for (int r = 0; r < rank; r++)
+	{
+		std::vector<double>& f = factors[r];
+		if (r == 0)
+		{
+			// The kernel is positive, start from its marginal
+			for (int z = 0; z < side; z++)
+				for (int y = 0; y < side; y++)
+					for (int x = 0; x < side; x++)
+						f[x] += kernel.data[kernel.index(x, y, z)];
+		}
+		else
+			for (double& value : f)
+				value = distribution(rng);
+		normalize(f);
+		fitTerm(r, r + 1);
+	}
+
+	for (int sweep = 0; sweep < refinementSweeps && rank > 1; sweep++)
+		for (int r = 0; r < rank; r++)
+			fitTerm(r, rank);
+
+	filters.weights.assign(weights.begin(), weights.end());
+	filters.taps.reserve(static_cast<size_t>(rank) * side);
+	for (const auto& f : factors)
+		filters.taps.insert(filters.taps.end(), f.begin(), f.end());
+
+	return filters;
+}
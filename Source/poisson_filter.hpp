@@ -0,0 +1,25 @@
+#pragma once
+
+#include <vector>
+
+// ********************************************************************
+// Separable filters approximating many Jacobi iterations of the solver
+// ********************************************************************
+
+// Rank-r separable approximation of the 3D kernel G = sum of J^i for i < iterations, J being the Jacobi
+// iteration matrix of the 7-point laplacian. Convolving the update x1 - x0 of a single Jacobi iteration
+// with G gives xk - x0. G is symmetric, so the approximation is a sum of weights[r] * f x f x f with f
+// the r-th set of 2 * radius + 1 taps.
+// The kernel doesn't depend on the grid : extending fields with odd reflections about the boundary
+// reproduces Jacobi iterations with zero boundaries. See Rabbani, Guertin et al., 2022.
+// Compact Poisson Filters for Fast Fluid Simulation.
+struct PoissonFilters
+{
+	int iterations = 0;
+	int rank = 0;
+	int radius = 0;
+	std::vector<float> weights;
+	std::vector<float> taps;
+};
+
+PoissonFilters computePoissonFilters(int iterations, float beta, int rank);
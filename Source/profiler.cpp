@@ -0,0 +1,200 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+
+thread_local GPUProfiler GPUProfiler::_instance;
+
+std::mutex GPUProfiler::_profilersMutex;
+std::vector<GPUProfiler*> GPUProfiler::_profilers;
+std::atomic<bool> GPUProfiler::_recording(false);
+
+GPUProfiler::GPUProfiler()
+	: _current{ {}, 0 }
+	, _depth(0)
+{
+	std::lock_guard<std::mutex> lock(_profilersMutex);
+	label = "Thread " + std::to_string(_profilers.size());
+	_profilers.push_back(this);
+}
+
+GPUProfiler::~GPUProfiler()
+{
+	// The thread's context is gone by now, queries that weren't released leak with it
+	std::lock_guard<std::mutex> lock(_profilersMutex);
+	_profilers.erase(std::find(_profilers.begin(), _profilers.end(), this));
+}
+
+GPUProfiler::Scope::Scope(const char* name)
+	: _profiler(GPUProfiler::get())
+	, _event(_profiler._current.events.size())
+{
+	GLuint begin = _profiler.timestamp();
+	_profiler._current.events.push_back({ name, _profiler._depth++, begin, 0 });
+}
+
+GPUProfiler::Scope::~Scope()
+{
+	GLuint end = _profiler.timestamp();
+	_profiler._current.events[_event].end = end;
+	_profiler._current.lastQuery = end;
+	_profiler._depth--;
+}
+
+GLuint GPUProfiler::timestamp()
+{
+	if (_freeQueries.empty())
+	{
+		GLuint query;
+		glGenQueries(1, &query);
+		_allQueries.push_back(query);
+		_freeQueries.push_back(query);
+	}
+
+	GLuint query = _freeQueries.back();
+	_freeQueries.pop_back();
+	glQueryCounter(query, GL_TIMESTAMP);
+	return query;
+}
+
+void GPUProfiler::newFrame()
+{
+	// Scopes still open belong to the next frame
+	if (_depth == 0 && !_current.events.empty())
+	{
+		_inFlight.push_back(std::move(_current));
+		_current = { {}, 0 };
+	}
+
+	while (!_inFlight.empty())
+	{
+		GLuint available = GL_FALSE;
+		glGetQueryObjectuiv(_inFlight.front().lastQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			break;
+
+		readBack(_inFlight.front());
+		for (const Event& event : _inFlight.front().events)
+		{
+			_freeQueries.push_back(event.begin);
+			_freeQueries.push_back(event.end);
+		}
+		_inFlight.pop_front();
+	}
+}
+
+void GPUProfiler::readBack(const Frame& frame)
+{
+	constexpr float averageWeight = 0.05f;
+
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	for (StageTiming& timing : _timings)
+		timing.lastMs = 0.f;
+
+	bool recording = _recording;
+	for (const Event& event : frame.events)
+	{
+		GLuint64 begin, end;
+		glGetQueryObjectui64v(event.begin, GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(event.end, GL_QUERY_RESULT, &end);
+
+		auto timing = std::find_if(_timings.begin(), _timings.end(),
+			[&event](const StageTiming& timing) { return std::strcmp(timing.name, event.name) == 0; });
+		if (timing == _timings.end())
+			timing = _timings.insert(_timings.end(), { event.name, event.depth, 0.f, -1.f });
+		timing->lastMs += (end - begin) * 1e-6f;
+
+		if (recording && _recorded.size() < maxRecordedEvents)
+			_recorded.push_back({ event.name, begin, end });
+	}
+
+	for (StageTiming& timing : _timings)
+		timing.averageMs = timing.averageMs < 0.f ? timing.lastMs : timing.averageMs + (timing.lastMs - timing.averageMs) * averageWeight;
+}
+
+void GPUProfiler::release()
+{
+	glDeleteQueries(static_cast<GLsizei>(_allQueries.size()), _allQueries.data());
+	_allQueries.clear();
+	_freeQueries.clear();
+	_inFlight.clear();
+	_current = { {}, 0 };
+}
+
+void GPUProfiler::forEach(const std::function<void(const std::string& label, const std::vector<StageTiming>& timings)>& f)
+{
+	std::lock_guard<std::mutex> lock(_profilersMutex);
+	for (GPUProfiler* profiler : _profilers)
+	{
+		std::lock_guard<std::mutex> profilerLock(profiler->_mutex);
+		if (!profiler->_timings.empty())
+			f(profiler->label, profiler->_timings);
+	}
+}
+
+void GPUProfiler::startRecording()
+{
+	std::lock_guard<std::mutex> lock(_profilersMutex);
+	for (GPUProfiler* profiler : _profilers)
+	{
+		std::lock_guard<std::mutex> profilerLock(profiler->_mutex);
+		profiler->_recorded.clear();
+	}
+	_recording = true;
+}
+
+void GPUProfiler::stopRecording()
+{
+	_recording = false;
+}
+
+size_t GPUProfiler::recordedEvents()
+{
+	std::lock_guard<std::mutex> lock(_profilersMutex);
+	size_t events = 0;
+	for (GPUProfiler* profiler : _profilers)
+	{
+		std::lock_guard<std::mutex> profilerLock(profiler->_mutex);
+		events += profiler->_recorded.size();
+	}
+	return events;
+}
+
+bool GPUProfiler::exportTrace(const std::string& path)
+{
+	std::ofstream file(path);
+	if (!file)
+		return false;
+
+	std::lock_guard<std::mutex> lock(_profilersMutex);
+	std::vector<std::unique_lock<std::mutex>> profilerLocks;
+	for (GPUProfiler* profiler : _profilers)
+		profilerLocks.emplace_back(profiler->_mutex);
+
+	// Timestamps all come from the GPU clock, traces start at the earliest one
+	uint64_t origin = std::numeric_limits<uint64_t>::max();
+	for (GPUProfiler* profiler : _profilers)
+		for (const RecordedEvent& event : profiler->_recorded)
+			origin = std::min(origin, event.begin);
+
+	// Microseconds, with the nanoseconds as decimals
+	file << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+	bool first = true;
+	for (size_t i = 0; i < _profilers.size(); i++)
+	{
+		file << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << i
+			<< ",\"args\":{\"name\":\"" << _profilers[i]->label << "\"}}";
+		first = false;
+
+		for (const RecordedEvent& event : _profilers[i]->_recorded)
+			file << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"gpu\",\"ph\":\"X\",\"pid\":0,\"tid\":" << i
+				<< ",\"ts\":" << (event.begin - origin) * 1e-3 << ",\"dur\":" << (event.end - event.begin) * 1e-3 << "}";
+	}
+	file << "\n]}\n";
+
+	return static_cast<bool>(file);
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <Empty/utils/noncopyable.h>
+#include <glad/glad.h>
+
+// ***********************************************
+// Timing GPU work without stalling on the results
+// ***********************************************
+
+// Records GL timestamps around named scopes of GPU commands, and reads them back once the GPU is done
+// with them, a few frames later. Query objects aren't shared between contexts, so there is one profiler
+// per thread, like Context. Timings and recorded events of every thread can be read from any thread.
+struct GPUProfiler : Empty::utils::noncopyable
+{
+	// Profiler of the calling thread, timing the commands of its context
+	static GPUProfiler& get() { return _instance; }
+
+	// Times the GPU commands issued during its lifetime. Scopes nest, names are expected to be literals.
+	struct Scope : Empty::utils::noncopyable
+	{
+		explicit Scope(const char* name);
+		~Scope();
+
+	private:
+		GPUProfiler& _profiler;
+		size_t _event;
+	};
+
+	// Time spent in one scope name per frame, summed over its scopes in the frame
+	struct StageTiming
+	{
+		const char* name;
+		// Of its first scope
+		int depth;
+		float lastMs;
+		float averageMs;
+	};
+
+	// Closes the current frame and reads back the frames the GPU is done with. Call once per frame, or per step.
+	void newFrame();
+	// Deletes the query objects, call before the thread's context goes away
+	void release();
+
+	// Calls f with the label and stage timings of each profiler that timed something
+	static void forEach(const std::function<void(const std::string& label, const std::vector<StageTiming>& timings)>& f);
+
+	// While recording, every read back scope is kept for exportTrace, up to maxRecordedEvents per profiler
+	static void startRecording();
+	static void stopRecording();
+	static bool isRecording() { return _recording; }
+	static size_t recordedEvents();
+	// Writes the recorded scopes as Chrome trace event JSON, for chrome://tracing or Perfetto. One thread per profiler.
+	static bool exportTrace(const std::string& path);
+
+	static constexpr size_t maxRecordedEvents = 1 << 16;
+
+	// Shows up in the GUI and traces
+	std::string label;
+
+private:
+	GPUProfiler();
+	~GPUProfiler();
+
+	struct Event
+	{
+		const char* name;
+		int depth;
+		GLuint begin;
+		GLuint end;
+	};
+
+	struct Frame
+	{
+		std::vector<Event> events;
+		// Queries complete in order, so the frame is ready once its last one is
+		GLuint lastQuery;
+	};
+
+	struct RecordedEvent
+	{
+		const char* name;
+		uint64_t begin;
+		uint64_t end;
+	};
+
+	GLuint timestamp();
+	void readBack(const Frame& frame);
+
+	static thread_local GPUProfiler _instance;
+
+	static std::mutex _profilersMutex;
+	static std::vector<GPUProfiler*> _profilers;
+	static std::atomic<bool> _recording;
+
+	std::vector<GLuint> _freeQueries;
+	std::vector<GLuint> _allQueries;
+	Frame _current;
+	int _depth;
+	std::deque<Frame> _inFlight;
+
+	// Guards what other threads read
+	mutable std::mutex _mutex;
+	std::vector<StageTiming> _timings;
+	std::vector<RecordedEvent> _recorded;
+};
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Empty/gl/Buffer.h>
+#include <Empty/utils/noncopyable.h>
+
+#include "Context.h"
+
+// ********************************************************
+// Reading GPU results back to main memory without stalling
+// ********************************************************
+
+// Copies part of a buffer to a staging buffer right after the commands writing to it, and fences the copy.
+// Several requests can be in flight, one per staging buffer, so results keep coming back when the GPU runs
+// a few requests behind. Polling never waits, so results typically arrive a frame late.
+struct AsyncReadback : Empty::utils::noncopyable
+{
+	AsyncReadback(const std::string& label, size_t size, int slots = 3)
+		: _size(size)
+		, _slots(slots)
+		, _oldest(0)
+		, _pending(0)
+	{
+		std::vector<char> zeros(size, 0);
+		for (int i = 0; i < slots; i++)
+		{
+			_slots[i].staging = std::make_unique<Empty::gl::Buffer>(label + " " + std::to_string(i + 1));
+			_slots[i].staging->setStorage(size, Empty::gl::BufferUsage::StreamRead, zeros.data());
+		}
+	}
+
+	~AsyncReadback() { cancel(); }
+
+	bool isPending() const { return _pending > 0; }
+	bool canRequest() const { return _pending < static_cast<int>(_slots.size()); }
+
+	// Call right after the commands writing to the buffer. Returns false and requests nothing when
+	// all slots are still in flight, older requests are never dropped.
+	bool request(Empty::gl::Buffer& buffer, size_t offset = 0)
+	{
+		if (!canRequest())
+			return false;
+
+		Slot& slot = _slots[(_oldest + _pending) % _slots.size()];
+		++_pending;
+
+		// Copies read shader storage writes only after this barrier
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+		Context& context = Context::get();
+		context.bind(buffer, Empty::gl::BufferTarget::CopyRead);
+		context.bind(*slot.staging, Empty::gl::BufferTarget::CopyWrite);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, offset, 0, _size);
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		return true;
+	}
+
+	// Forgets about the pending requests, if any
+	void cancel()
+	{
+		while (_pending > 0)
+		{
+			glDeleteSync(_slots[_oldest].fence);
+			_slots[_oldest].fence = nullptr;
+			_oldest = (_oldest + 1) % _slots.size();
+			--_pending;
+		}
+	}
+
+	// Copies the result of the oldest request into data and returns true if its copy is complete.
+	// Results come back in the order they were requested, call it in a loop to get the latest one.
+	bool poll(void* data)
+	{
+		if (_pending == 0)
+			return false;
+
+		Slot& slot = _slots[_oldest];
+		GLenum status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+			return false;
+
+		glDeleteSync(slot.fence);
+		slot.fence = nullptr;
+		_oldest = (_oldest + 1) % _slots.size();
+		--_pending;
+
+		// Nothing writes to the staging buffer after the fenced copy, so this doesn't wait
+		Context::get().bind(*slot.staging, Empty::gl::BufferTarget::CopyRead);
+		glGetBufferSubData(GL_COPY_READ_BUFFER, 0, _size, data);
+		return true;
+	}
+
+private:
+	struct Slot
+	{
+		std::unique_ptr<Empty::gl::Buffer> staging;
+		GLsync fence = nullptr;
+	};
+
+	size_t _size;
+	std::vector<Slot> _slots;
+	int _oldest;
+	int _pending;
+};
+
+// Buffer the GPU writes to and the CPU reads from in place, mapped once for its whole lifetime.
+// Once the fence of the commands writing to it has signaled, results are read straight from the mapping,
+// without a copy. Polling never waits either, so results typically arrive a frame late.
+struct PersistentReadback : Empty::utils::noncopyable
+{
+	PersistentReadback(const std::string& label, size_t size)
+		: buffer(label)
+		, _fence(nullptr)
+		, _data(nullptr)
+	{
+		constexpr GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+		Context::get().bind(buffer, Empty::gl::BufferTarget::CopyRead);
+		glBufferStorage(GL_COPY_READ_BUFFER, size, nullptr, flags);
+		_data = glMapBufferRange(GL_COPY_READ_BUFFER, 0, size, flags);
+	}
+
+	~PersistentReadback()
+	{
+		if (_fence)
+			glDeleteSync(_fence);
+	}
+
+	bool isPending() const { return _fence != nullptr; }
+
+	// Call right after the commands writing to the buffer. Replaces any pending request.
+	void request()
+	{
+		// Shader writes have to be made visible to the mapping before the fence
+		glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+
+		if (_fence)
+			glDeleteSync(_fence);
+		_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	// Returns the mapped contents of the buffer if the fenced commands are complete, null otherwise.
+	// They stay valid until the next commands writing to the buffer.
+	const void* poll()
+	{
+		if (!_fence)
+			return nullptr;
+
+		GLenum status = glClientWaitSync(_fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+			return nullptr;
+
+		glDeleteSync(_fence);
+		_fence = nullptr;
+
+		return _data;
+	}
+
+	Empty::gl::Buffer buffer;
+
+private:
+	GLsync _fence;
+	const void* _data;
+};
@@ -1,12 +1,22 @@
 #include "render.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <string>
+
 #include <Empty/math/funcs.h>
+#include <Empty/utils/macros.h>
 
 #include "Context.h"
+#include "profiler.hpp"
 
 using namespace Empty::gl;
 using namespace Empty::math;
 
+// Must match ink_occupancy.glsl and fluid_fragment.glsl
+constexpr int occupancyBrickSize = 8;
+constexpr int occupancyBinding = 0;
+
 // ####################################################
 
 FluidSimRenderParameters::FluidSimRenderParameters(vec3 position, uvec3 gridSize, float gridCellSizeInUnits)
@@ -15,6 +25,10 @@ FluidSimRenderParameters::FluidSimRenderParameters(vec3 position, uvec3 gridSize
 	, gridCellSizeInUnits(gridCellSizeInUnits)
 	, inkColor{0.f, 1.f, 0.f}
 	, inkMultiplier(1.f)
+	, resolutionDivisor(1)
+	, upsampleDepthSharpness(20.f)
+	, temporalAccumulation(false)
+	, temporalBlend(0.2f)
 	, gridVerticesBuf("Fluid volume geometry buffer")
 	, gridOutlineIndicesBuf("Fluid grid outline indices buffer")
 	, gridFacesIndicesBuf("Fluid volume faces indices buffer")
@@ -55,22 +69,93 @@ FluidSimRenderer::FluidSimRenderer(int frameWidth, int frameHeight)
 	: _vao("Fluid sim render VAO")
 	, _fluidProgram("Fluid render program")
 	, _gridProgram("Grid render program")
+	, _occupancyProgram("Ink occupancy program")
+	, _upsampleProgram("Fluid upsample program")
+	, _occupancy()
+	, _occupancySize(0, 0, 0)
+	, _frameWidth(frameWidth)
+	, _frameHeight(frameHeight)
+	, _lowResolutionDivisor(1)
+	, _currentLowResolution(0)
+	, _hasHistory(false)
+	, _previousCameraToWorld(mat4::Identity())
+	, _frameIndex(0)
 	, _vs()
 {
 	_fluidProgram.attachFile(ShaderType::Vertex, "shaders/draw/fluid_vertex.glsl", "Fluid render vertex shader");
 	_fluidProgram.attachFile(ShaderType::Fragment, "shaders/draw/fluid_fragment.glsl", "Fluid render fragment shader");
+	_fluidProgram.attachFile(ShaderType::Fragment, "shaders/draw/fluid_ray.glsl", "Fluid render ray shader");
+	_fluidProgram.attachFile(ShaderType::Fragment, "shaders/sim/ring.glsl", "Fluid render ring shader");
 	_fluidProgram.build();
 
+	_upsampleProgram.attachFile(ShaderType::Vertex, "shaders/draw/fluid_vertex.glsl", "Fluid upsample vertex shader");
+	_upsampleProgram.attachFile(ShaderType::Fragment, "shaders/draw/fluid_upsample_fragment.glsl", "Fluid upsample fragment shader");
+	_upsampleProgram.attachFile(ShaderType::Fragment, "shaders/draw/fluid_ray.glsl", "Fluid upsample ray shader");
+	_upsampleProgram.build();
+
 	_gridProgram.attachFile(ShaderType::Vertex, "shaders/draw/grid_vertex.glsl", "Sim grid render vertex shader");
 	_gridProgram.attachFile(ShaderType::Fragment, "shaders/draw/grid_fragment.glsl", "Sim grid render fragment shader");
 	_gridProgram.build();
 
+	_occupancyProgram.attachFile(ShaderType::Compute, "shaders/draw/ink_occupancy.glsl", "Ink occupancy shader");
+	_occupancyProgram.attachFile(ShaderType::Compute, "shaders/sim/ring.glsl", "Ink occupancy ring shader");
+	_occupancyProgram.build();
+
 	_vs.add("aPosition", VertexAttribType::Float, 3);
 	_gridProgram.locateAttributes(_vs);
 }
 
 void FluidSimRenderer::renderFluidSim(FluidState& fluidState, const FluidSimRenderParameters& params, const Camera& camera, int highlightSlice)
 {
+	renderFluidSim(fluidState.inkDensity.getInput(), fluidState.gridRingBuffer, params, camera, highlightSlice);
+}
+
+void FluidSimRenderer::prepareLowResolution(int divisor)
+{
+	if (divisor == _lowResolutionDivisor && _lowResolutionTargets[0])
+		return;
+
+	int width = std::max(_frameWidth / divisor, 1), height = std::max(_frameHeight / divisor, 1);
+	for (int i : { 0, 1 })
+	{
+		_lowResolutionTargets[i] = std::make_unique<LowResolutionTarget>("Fluid low resolution target " + std::to_string(i + 1));
+		_lowResolutionTargets[i]->setStorage(1, width, height);
+		_lowResolutionFramebuffers[i] = std::make_unique<Framebuffer>("Fluid low resolution framebuffer " + std::to_string(i + 1));
+		_lowResolutionFramebuffers[i]->attach<FramebufferAttachment::Color>(*_lowResolutionTargets[i], 0);
+		if (!_lowResolutionFramebuffers[i]->isComplete())
+			FATAL("Fluid low resolution framebuffer is incomplete");
+	}
+
+	_lowResolutionDivisor = divisor;
+	_hasHistory = false;
+}
+
+void FluidSimRenderer::updateOccupancy(GPUInkField& inkDensity, uvec3 gridSize)
+{
+	Context& context = Context::get();
+
+	uvec3 size(gridSize.x / occupancyBrickSize, gridSize.y / occupancyBrickSize, gridSize.z / occupancyBrickSize);
+	if (!_occupancy || size.x != _occupancySize.x || size.y != _occupancySize.y || size.z != _occupancySize.z)
+	{
+		_occupancy = std::make_unique<GPUScalarField>("Ink occupancy");
+		_occupancy->setStorage(1, size.x, size.y, size.z);
+		_occupancySize = size;
+	}
+
+	_occupancyProgram.registerTexture("uInkDensity", inkDensity);
+	_occupancyProgram.registerTexture("uOccupancy", *_occupancy, false);
+	context.bind(_occupancy->getLevel(0), occupancyBinding, AccessPolicy::WriteOnly, GPUScalarField::Format);
+
+	context.memoryBarrier(MemoryBarrierType::TextureFetch);
+	context.setShaderProgram(_occupancyProgram);
+	context.dispatchCompute(size.x, size.y, size.z);
+	context.memoryBarrier(MemoryBarrierType::TextureFetch);
+}
+
+void FluidSimRenderer::renderFluidSim(GPUInkField& inkDensity, Buffer& gridRingBuffer, const FluidSimRenderParameters& params, const Camera& camera,
+	int highlightSlice)
+{
+	GPUProfiler::Scope scope("Render");
 	Context& context = Context::get();
 
 	mat4 m = scale(vec3(params.gridSizeInCells) * params.gridCellSizeInUnits / 2.f);
@@ -96,20 +181,80 @@ void FluidSimRenderer::renderFluidSim(FluidState& fluidState, const FluidSimRend
 
 	// Draw fluid sim
 	{
+		// Every frame, since the ink may come from any step or a published copy of it
+		context.bind(gridRingBuffer, IndexedBufferTarget::Uniform, gridRingBinding);
+		updateOccupancy(inkDensity, params.gridSizeInCells);
+
 		context.enable(ContextCapability::CullFace);
 		context.faceCullingMode(FaceCullingMode::Front);
+
+		mat4 cameraToFluidSim = inverse(m) * camera.m;
+		bool lowResolution = params.resolutionDivisor > 1;
 	
 		_fluidProgram.uniform("uMV", mv);
 		_fluidProgram.uniform("uP", camera.p);
-		_fluidProgram.uniform("uCameraToFluidSim", inverse(m) * camera.m);
-		_fluidProgram.registerTexture("uInkDensity", fluidState.inkDensity.getInput());
+		_fluidProgram.uniform("uCameraToFluidSim", cameraToFluidSim);
+		_fluidProgram.registerTexture("uInkDensity", inkDensity);
+		_fluidProgram.registerTexture("uOccupancy", *_occupancy);
 		_fluidProgram.uniform("uInkColor", params.inkColor);
 		_fluidProgram.uniform("uInkMultiplier", params.inkMultiplier);
+		_fluidProgram.uniform("uLowResolution", lowResolution);
 
 		_vao.attachElementBuffer(params.gridFacesIndicesBuf);
 
-		context.setShaderProgram(_fluidProgram);
-		context.drawElements(PrimitiveType::Triangles, ElementType::Int, 0, 36);
+		if (!lowResolution)
+		{
+			_fluidProgram.uniform("uRayOffset", 0.f);
+			_fluidProgram.uniform("uTemporalAccumulation", false);
+
+			context.setShaderProgram(_fluidProgram);
+			context.drawElements(PrimitiveType::Triangles, ElementType::Int, 0, 36);
+			_hasHistory = false;
+		}
+		else
+		{
+			prepareLowResolution(params.resolutionDivisor);
+
+			int current = _currentLowResolution, previous = 1 - _currentLowResolution;
+			bool accumulate = params.temporalAccumulation && _hasHistory;
+
+			// Golden ratio sequence, so successive frames sample evenly between the steps
+			float rayOffset = params.temporalAccumulation ? std::fmod(_frameIndex * 0.618034f, 1.f) : 0.f;
+			_fluidProgram.uniform("uRayOffset", rayOffset);
+			_fluidProgram.uniform("uTemporalAccumulation", accumulate);
+			_fluidProgram.uniform("uTemporalBlend", params.temporalBlend);
+			_fluidProgram.uniform("uFluidSimToPreviousClip", camera.p * inverse(_previousCameraToWorld) * m);
+			_fluidProgram.registerTexture("uHistory", *_lowResolutionTargets[previous]);
+
+			// Nothing is drawn outside of the cube, which stays without coverage
+			context.bind(*_lowResolutionFramebuffers[current]);
+			_lowResolutionFramebuffers[current]->clearAttachment<FramebufferAttachment::Color>(0, vec4::zero);
+			context.setViewport(std::max(_frameWidth / params.resolutionDivisor, 1), std::max(_frameHeight / params.resolutionDivisor, 1));
+			context.disable(ContextCapability::Blend);
+
+			context.setShaderProgram(_fluidProgram);
+			context.drawElements(PrimitiveType::Triangles, ElementType::Int, 0, 36);
+
+			context.bind(*Framebuffer::dflt);
+			context.setViewport(_frameWidth, _frameHeight);
+			context.enable(ContextCapability::Blend);
+
+			_upsampleProgram.uniform("uMV", mv);
+			_upsampleProgram.uniform("uP", camera.p);
+			_upsampleProgram.uniform("uCameraToFluidSim", cameraToFluidSim);
+			_upsampleProgram.uniform("uInkColor", params.inkColor);
+			_upsampleProgram.uniform("uResolutionDivisor", params.resolutionDivisor);
+			_upsampleProgram.uniform("uDepthSharpness", params.upsampleDepthSharpness);
+			_upsampleProgram.registerTexture("uLowResolution", *_lowResolutionTargets[current]);
+
+			context.setShaderProgram(_upsampleProgram);
+			context.drawElements(PrimitiveType::Triangles, ElementType::Int, 0, 36);
+
+			_currentLowResolution = previous;
+			_hasHistory = true;
+			_previousCameraToWorld = camera.m;
+			_frameIndex++;
+		}
 	}
 
 	// Draw highlighted slice
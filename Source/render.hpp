@@ -1,12 +1,16 @@
 #pragma once
 
+#include <memory>
+
 #include <Empty/gl/Buffer.h>
+#include <Empty/gl/Framebuffer.h>
 #include <Empty/gl/ShaderProgram.hpp>
 #include <Empty/gl/VertexArray.h>
 #include <Empty/gl/VertexStructure.h>
 #include <Empty/math/vec.h>
 
 #include "Camera.h"
+#include "fields.hpp"
 #include "fluid.hpp"
 
 struct FluidSimRenderParameters
@@ -20,6 +24,13 @@ struct FluidSimRenderParameters
 	Empty::math::vec3 inkColor;
 	float inkMultiplier;
 
+	// Raymarches the fluid at 1/resolutionDivisor of the frame's resolution (1, 2 or 4), and upsamples it
+	int resolutionDivisor;
+	float upsampleDepthSharpness;
+	// Reduced resolution only : jitters the raymarch every frame, and blends with the last frame's result
+	bool temporalAccumulation;
+	float temporalBlend;
+
 	Empty::gl::Buffer gridVerticesBuf;
 	Empty::gl::Buffer gridOutlineIndicesBuf;
 	Empty::gl::Buffer gridFacesIndicesBuf;
@@ -30,10 +41,37 @@ struct FluidSimRenderer
 	FluidSimRenderer(int frameWidth, int frameHeight);
 
 	void renderFluidSim(FluidState& fluidState, const FluidSimRenderParameters& params, const Camera& camera, int highlightSlice = -1);
+	// Draws an ink field stored with the grid origin in gridRingBuffer
+	void renderFluidSim(GPUInkField& inkDensity, Empty::gl::Buffer& gridRingBuffer, const FluidSimRenderParameters& params, const Camera& camera,
+		int highlightSlice = -1);
 
 private:
+	using LowResolutionTarget = Empty::gl::Texture<Empty::gl::TextureTarget::Texture2D, Empty::gl::TextureFormat::RGBA16f>;
+
+	// Reallocates the reduced resolution targets when the divisor changes
+	void prepareLowResolution(int divisor);
+
+	// Rebuilds the occupancy grid the fluid raymarch skips empty bricks with. Expects the ink's grid ring to be bound.
+	void updateOccupancy(GPUInkField& inkDensity, Empty::math::uvec3 gridSize);
+
 	Empty::gl::VertexArray _vao;
 	Empty::gl::ShaderProgram _fluidProgram;
 	Empty::gl::ShaderProgram _gridProgram;
+	Empty::gl::ShaderProgram _occupancyProgram;
+	Empty::gl::ShaderProgram _upsampleProgram;
+	// Largest ink density in each 8^3 brick of the grid and the texels around it
+	std::unique_ptr<GPUScalarField> _occupancy;
+	Empty::math::uvec3 _occupancySize;
+
+	int _frameWidth, _frameHeight;
+	// Ping-pong, so the last frame's target is the history of the current one
+	std::unique_ptr<LowResolutionTarget> _lowResolutionTargets[2];
+	std::unique_ptr<Empty::gl::Framebuffer> _lowResolutionFramebuffers[2];
+	int _lowResolutionDivisor;
+	int _currentLowResolution;
+	// Whether the other target holds last frame's result, and the camera it was seen from
+	bool _hasHistory;
+	Empty::math::mat4 _previousCameraToWorld;
+	unsigned int _frameIndex;
 	Empty::gl::VertexStructure _vs;
 };
\ No newline at end of file
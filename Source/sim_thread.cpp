@@ -0,0 +1,249 @@
+#include "sim_thread.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+
+#include <Empty/utils/macros.h>
+
+#include "Context.h"
+#include "profiler.hpp"
+
+using namespace Empty::gl;
+
+SimulationThread::PublishedInk::PublishedInk(const std::string& name, Empty::math::uvec3 size)
+	: ink(name)
+	, written(nullptr)
+	, read(nullptr)
+{
+	// Same as the fields, see BufferedField
+	ink.setStorage(1, size.x, size.y, size.z);
+	ink.template clearLevel<gpuScalarDataFormat, DataType::Float>(0);
+	ink.template setParameter<TextureParam::WrapS>(TextureParamValue::Repeat);
+	ink.template setParameter<TextureParam::WrapT>(TextureParamValue::Repeat);
+	ink.template setParameter<TextureParam::WrapR>(TextureParamValue::Repeat);
+}
+
+SimulationThread::SimulationThread(FluidSim& fluidSim, FluidState& fluidState, float stepsPerSecond)
+	: _fluidSim(fluidSim)
+	, _fluidState(fluidState)
+	, _window(Context::get().createSharedWindow())
+	, _stepsPerSecond(stepsPerSecond)
+	, _paused(false)
+	, _stepOnce(false)
+	, _stepFence(nullptr)
+	, _lockFence(nullptr)
+	, _stats(fluidSim.getStats())
+	, _published{ { { "Published ink 1", fluidState.grid.size }, { "Published ink 2", fluidState.grid.size }, { "Published ink 3", fluidState.grid.size } } }
+	, _back(0)
+	, _front(1)
+	, _ready(2)
+	, _publishedGridRing("Published grid ring")
+	, _stop(false)
+{
+	if (!_window)
+		FATAL("Failed to create the simulation thread's GL context");
+
+	Empty::math::uvec3 size = fluidState.grid.size;
+	FluidGridRing ring{ { 0, 0, 0, 0 }, { (int32_t)size.x, (int32_t)size.y, (int32_t)size.z, 0 } };
+	_publishedGridRing.setStorage(sizeof(ring), BufferUsage::StaticDraw, ring);
+
+	// The sim thread's context only sees objects created before it once they're complete
+	glFinish();
+
+	_thread = std::thread(&SimulationThread::run, this);
+}
+
+SimulationThread::~SimulationThread()
+{
+	_stop = true;
+	_thread.join();
+
+	for (GLsync fence : { _stepFence, _lockFence })
+		if (fence)
+			glDeleteSync(fence);
+	for (auto& published : _published)
+		for (GLsync fence : { published.written, published.read })
+			if (fence)
+				glDeleteSync(fence);
+
+	glfwDestroyWindow(_window);
+}
+
+SimulationThread::Lock::Lock(SimulationThread& thread)
+	: _thread(thread)
+	, _lock(thread._mutex)
+{
+	if (_thread._stepFence)
+		glWaitSync(_thread._stepFence, 0, GL_TIMEOUT_IGNORED);
+}
+
+SimulationThread::Lock::~Lock()
+{
+	// Replaces a fence the sim thread hasn't waited on yet, this one comes later
+	if (_thread._lockFence)
+		glDeleteSync(_thread._lockFence);
+	_thread._lockFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	// Fences only signal in other contexts once flushed
+	glFlush();
+}
+
+bool SimulationThread::pushImpulse(const FluidSimMouseClickImpulse& impulse, bool velocityOnly, float dt)
+{
+	return _impulses.push({ impulse, velocityOnly, dt });
+}
+
+void SimulationThread::submitSettings(const Settings& settings)
+{
+	std::lock_guard<std::mutex> lock(_handoffMutex);
+	bool stepOnce = _pendingSettings && _pendingSettings->stepOnce;
+	_pendingSettings = settings;
+	_pendingSettings->stepOnce |= stepOnce;
+}
+
+void SimulationThread::queueCommand(FluidSimCommand command)
+{
+	std::lock_guard<std::mutex> lock(_handoffMutex);
+	_pendingCommands.push_back(std::move(command));
+}
+
+FluidSimStats SimulationThread::getStats()
+{
+	std::lock_guard<std::mutex> lock(_handoffMutex);
+	return _stats;
+}
+
+GPUInkField& SimulationThread::acquireInk()
+{
+	if (_ready.load(std::memory_order_acquire) & publishedBit)
+	{
+		// The sim thread may overwrite the current front once the draws from it are done
+		PublishedInk& released = _published[_front];
+		released.read = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		glFlush();
+
+		_front = _ready.exchange(_front, std::memory_order_acq_rel) & ~publishedBit;
+
+		glWaitSync(_published[_front].written, 0, GL_TIMEOUT_IGNORED);
+	}
+
+	return _published[_front].ink;
+}
+
+void SimulationThread::publish()
+{
+	PublishedInk& published = _published[_back];
+
+	// The render thread may still be drawing from it
+	if (published.read)
+	{
+		glWaitSync(published.read, 0, GL_TIMEOUT_IGNORED);
+		glDeleteSync(published.read);
+		published.read = nullptr;
+	}
+	if (published.written)
+		glDeleteSync(published.written);
+
+	_fluidSim.unwrapInk(_fluidState, published.ink);
+
+	// Texture fetches from the render thread see image stores after this barrier and the fence
+	Context::get().memoryBarrier(MemoryBarrierType::TextureFetch);
+	published.written = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glFlush();
+
+	_back = _ready.exchange(_back | publishedBit, std::memory_order_acq_rel) & ~publishedBit;
+}
+
+void SimulationThread::applyHandoff()
+{
+	std::optional<Settings> settings;
+	{
+		std::lock_guard<std::mutex> lock(_handoffMutex);
+		settings.swap(_pendingSettings);
+		_commands.swap(_pendingCommands);
+	}
+
+	if (settings)
+	{
+		static_cast<FluidSimSettings&>(_fluidSim) = settings->sim;
+		_fluidState.grid.cellSize = settings->grid.cellSize;
+		_fluidState.physics = settings->physics;
+		_paused = settings->paused;
+		_stepOnce |= settings->stepOnce;
+	}
+
+	if (!_commands.empty())
+	{
+		Context::get().memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+		for (FluidSimCommand& command : _commands)
+			command(_fluidSim, _fluidState);
+		_commands.clear();
+	}
+}
+
+void SimulationThread::run()
+{
+	using Clock = std::chrono::steady_clock;
+
+	Context::get().initShared(_window);
+	GPUProfiler::get().label = "Simulation thread";
+
+	Clock::time_point nextStep = Clock::now();
+	while (!_stop)
+	{
+		std::this_thread::sleep_until(nextStep);
+
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		float dt = 1.f / _stepsPerSecond;
+		// Catch up on no more than one late step, rather than piling them up
+		nextStep = std::max(nextStep + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<float>(dt)), Clock::now());
+
+		if (_lockFence)
+		{
+			glWaitSync(_lockFence, 0, GL_TIMEOUT_IGNORED);
+			glDeleteSync(_lockFence);
+			_lockFence = nullptr;
+		}
+
+		applyHandoff();
+
+		// Impulses come with the render thread's dt, folded into their ink amount so they go in one batch
+		_batchedImpulses.clear();
+		QueuedImpulse queued;
+		while (_impulses.pop(queued))
+		{
+			queued.impulse.inkAmount = queued.velocityOnly ? 0.f : queued.impulse.inkAmount * queued.dt;
+			_batchedImpulses.push_back(queued.impulse);
+		}
+		if (!_batchedImpulses.empty())
+		{
+			Context::get().memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+			_fluidSim.applyForces(_fluidState, _batchedImpulses, false, 1.f);
+		}
+
+		if (!_paused || _stepOnce)
+		{
+			_fluidSim.advance(_fluidState, dt);
+			_stepOnce = false;
+		}
+
+		publish();
+		GPUProfiler::get().newFrame();
+
+		FluidSimStats stats = _fluidSim.getStats();
+		{
+			std::lock_guard<std::mutex> handoffLock(_handoffMutex);
+			_stats = stats;
+		}
+
+		if (_stepFence)
+			glDeleteSync(_stepFence);
+		_stepFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		glFlush();
+	}
+
+	glFinish();
+	GPUProfiler::get().release();
+	glfwMakeContextCurrent(nullptr);
+}
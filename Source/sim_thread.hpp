@@ -0,0 +1,173 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Empty/gl/Buffer.h>
+#include <Empty/utils/noncopyable.h>
+#include <glad/glad.h>
+
+#include "fields.hpp"
+#include "fluid.hpp"
+#include "solver.hpp"
+
+struct GLFWwindow;
+
+// *********************************************************
+// Running the GPU solver at its own rate, on its own thread
+// *********************************************************
+
+// Lock-free queue between exactly one producer thread and one consumer thread
+template <typename T, size_t Capacity>
+struct SingleProducerQueue
+{
+	SingleProducerQueue() : _head(0), _tail(0) { }
+
+	// Producer only. Fails when the queue is full.
+	bool push(const T& value)
+	{
+		size_t tail = _tail.load(std::memory_order_relaxed);
+		size_t next = (tail + 1) % Capacity;
+		if (next == _head.load(std::memory_order_acquire))
+			return false;
+
+		_items[tail] = value;
+		_tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer only. Fails when the queue is empty.
+	bool pop(T& value)
+	{
+		size_t head = _head.load(std::memory_order_relaxed);
+		if (head == _tail.load(std::memory_order_acquire))
+			return false;
+
+		value = _items[head];
+		_head.store((head + 1) % Capacity, std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::array<T, Capacity> _items;
+	// Apart, so the threads don't share a cache line
+	alignas(64) std::atomic<size_t> _head;
+	alignas(64) std::atomic<size_t> _tail;
+};
+
+// Steps a FluidSim at a fixed rate on a thread with a GL context shared with the render thread,
+// so that rendering and simulation don't throttle each other. Construct and destroy from the render
+// thread, which hands settings, commands and impulses over to the next step without waiting on it,
+// and draws the ink field from a triple buffer the sim thread publishes to after every step.
+// Only reading the live fields, with a Lock, waits on the sim.
+struct SimulationThread : Empty::utils::noncopyable
+{
+	SimulationThread(FluidSim& fluidSim, FluidState& fluidState, float stepsPerSecond);
+	~SimulationThread();
+
+	// What the render thread may change between steps
+	struct Settings
+	{
+		FluidSimSettings sim;
+		// Only the cell size is applied, the grid size is fixed
+		FluidGridParameters grid;
+		FluidPhysicalProperties physics;
+		bool paused = false;
+		// Runs one step while paused
+		bool stepOnce = false;
+	};
+
+	// Holds off stepping, so the render thread can read the live fields. Waits for the sim thread to be done
+	// submitting its current step. GL commands issued afterwards on the render thread, not only under
+	// the lock, run after the last step, and those issued under the lock run before the next one.
+	struct Lock : Empty::utils::noncopyable
+	{
+		explicit Lock(SimulationThread& thread);
+		~Lock();
+
+	private:
+		SimulationThread& _thread;
+		std::unique_lock<std::mutex> _lock;
+	};
+
+	// Applied before the next step, with the render thread's dt. Fails when too many are in flight.
+	bool pushImpulse(const FluidSimMouseClickImpulse& impulse, bool velocityOnly, float dt);
+	// Replaces the settings the next step starts with, keeping a stepOnce it hasn't seen yet
+	void submitSettings(const Settings& settings);
+	// Runs before the next step, after the commands queued before it
+	void queueCommand(FluidSimCommand command);
+	// As of the last step
+	FluidSimStats getStats();
+
+	// Latest published ink, with GL commands drawing from it ordered after its copy. Stays valid until
+	// the next call. Ink is published unwrapped, and draws with getPublishedGridRing.
+	GPUInkField& acquireInk();
+	Empty::gl::Buffer& getPublishedGridRing() { return _publishedGridRing; }
+
+private:
+	struct QueuedImpulse
+	{
+		FluidSimMouseClickImpulse impulse;
+		bool velocityOnly;
+		float dt;
+	};
+
+	// Ink and the fences ordering its copy and draws across contexts
+	struct PublishedInk
+	{
+		PublishedInk(const std::string& name, Empty::math::uvec3 size);
+
+		GPUInkField ink;
+		// Signaled once the sim thread is done writing ink
+		GLsync written;
+		// Signaled once the render thread is done drawing from ink
+		GLsync read;
+	};
+
+	void run();
+	// Applies what the render thread handed over since the last step
+	void applyHandoff();
+	void publish();
+
+	FluidSim& _fluidSim;
+	FluidState& _fluidState;
+	GLFWwindow* _window;
+	float _stepsPerSecond;
+	bool _paused;
+	bool _stepOnce;
+
+	// Held while submitting a step
+	std::mutex _mutex;
+	// Last step and last Lock, for the other thread to wait on
+	GLsync _stepFence;
+	GLsync _lockFence;
+
+	SingleProducerQueue<QueuedImpulse, 64> _impulses;
+	std::vector<FluidSimMouseClickImpulse> _batchedImpulses;
+
+	// Only held while copying, so neither thread waits on the other's work
+	std::mutex _handoffMutex;
+	std::optional<Settings> _pendingSettings;
+	std::vector<FluidSimCommand> _pendingCommands;
+	FluidSimStats _stats;
+	// Swapped with _pendingCommands, keeping both allocations around
+	std::vector<FluidSimCommand> _commands;
+
+	// Triple buffer : the sim thread writes to _back, the render thread draws from _front, and they swap
+	// them with the index in _ready, which has publishedBit set while it holds ink the render thread hasn't seen
+	static constexpr int publishedBit = 4;
+	std::array<PublishedInk, 3> _published;
+	int _back;
+	int _front;
+	std::atomic<int> _ready;
+	Empty::gl::Buffer _publishedGridRing;
+
+	std::atomic<bool> _stop;
+	std::thread _thread;
+};
@@ -1,6 +1,15 @@
 #include "solver.hpp"
 
 #include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
 
 #include <Empty/gl/Buffer.h>
 #include <Empty/gl/ShaderProgram.hpp>
@@ -8,34 +17,115 @@
 
 #include "Context.h"
 #include "fluid.hpp"
+#include "poisson_filter.hpp"
+#include "profiler.hpp"
+#include "readback.hpp"
 
 using namespace Empty::gl;
 
+// Attaches a compute shader declaring velocity or ink images, with VELOCITY_FORMAT and INK_FORMAT
+// defined right after its #version line, see GPUVelocityField
+static void attachFieldShader(ShaderProgram& program, const std::string& path, const std::string& label)
+{
+	std::ifstream file(path);
+	if (!file)
+		FATAL("Failed to open " << path);
+	std::stringstream source;
+	source << file.rdbuf();
+
+	std::string text = source.str();
+	text.insert(text.find('\n') + 1, std::string("#define VELOCITY_FORMAT ") + velocityImageFormat + "\n#define INK_FORMAT " + inkImageFormat
+		+ "\n#line 2\n");
+	program.attachSource(ShaderType::Compute, text, label);
+}
+
 // ********************************************
 // Shared constants related to fluid simulation
 // ********************************************
 
-constexpr int allVelocityXBinding = 0;
-constexpr int allVelocityYBinding = 1;
-constexpr int allVelocityZBinding = 2;
+constexpr int allVelocityBinding = 0;
 
 constexpr int advectionFieldInBinding = 3;
 constexpr int advectionFieldOutBinding = 4;
+constexpr int advectionVelocityOutBinding = 5;
 
 constexpr int jacobiFieldSourceBinding = 0;
 constexpr int jacobiFieldInBinding = 1;
 constexpr int jacobiFieldOutBinding = 2;
+constexpr int jacobiFieldPreviousBinding = 3;
+constexpr int jacobiVectorFieldSourceBinding = 4;
+constexpr int jacobiVectorFieldInBinding = 5;
+constexpr int jacobiVectorFieldOutBinding = 6;
+constexpr int jacobiVectorFieldPreviousBinding = 7;
 
 constexpr int forcesFieldBinding = 0;
+constexpr int forcesVelocityBinding = 1;
 
 constexpr int divergenceOutBinding = 3;
 
 constexpr int projectionPressureBinding = 3;
-
-// TEST: collocated grid
-const Empty::math::bvec3 xStagger(false, false, false);
-const Empty::math::bvec3 yStagger(false, false, false);
-const Empty::math::bvec3 zStagger(false, false, false);
+constexpr int projectionDivergenceBinding = 4;
+constexpr int projectionVelocityOutBinding = 5;
+
+constexpr int restrictionFineSourceBinding = 0;
+constexpr int restrictionFineSolutionBinding = 1;
+constexpr int restrictionCoarseSourceBinding = 2;
+
+constexpr int prolongationCoarseSolutionBinding = 0;
+constexpr int prolongationFineSolutionBinding = 1;
+
+constexpr int pcgSourceBinding = 0;
+constexpr int pcgSolutionBinding = 1;
+constexpr int pcgResidualBinding = 2;
+
+constexpr int pcgLaplacianDirectionBinding = 0;
+constexpr int pcgLaplacianOutBinding = 1;
+
+constexpr int pcgUpdateSolutionBinding = 0;
+constexpr int pcgUpdateResidualBinding = 1;
+constexpr int pcgUpdateDirectionBinding = 2;
+constexpr int pcgUpdateLaplacianBinding = 3;
+
+constexpr int pcgPreconditionFieldInBinding = 0;
+constexpr int pcgPreconditionFieldOutBinding = 1;
+constexpr int pcgPreconditionResidualBinding = 2;
+
+constexpr int pcgDirectionPreconditionedBinding = 0;
+constexpr int pcgDirectionBinding = 1;
+
+constexpr int poissonFilterFieldInBinding = 0;
+constexpr int poissonFilterSourceBinding = 1;
+constexpr int poissonFilterAccumulateBinding = 2;
+constexpr int poissonFilterFieldOutBinding = 3;
+
+constexpr int adiFieldInBinding = 0;
+constexpr int adiFieldOutBinding = 1;
+
+constexpr int brickActivityVelocityBinding = 0;
+constexpr int brickActivityInkBinding = 1;
+constexpr int brickClearFieldBinding = 0;
+
+constexpr int maxVelocityBinding = 0;
+
+constexpr int unwrapFieldBinding = 0;
+constexpr int unwrapFieldOutBinding = 1;
+
+// Storage blocks
+constexpr int pcgScalarsBinding = 0;
+constexpr int reductionPartialSumsBinding = 1;
+constexpr int jacobiResidualsBinding = 2;
+constexpr int poissonFilterTapsBinding = 0;
+constexpr int activeBricksBinding = 3;
+constexpr int activeBrickCountBinding = 4;
+constexpr int brickActivityBinding = 0;
+constexpr int brickListedBinding = 1;
+constexpr int brickActiveListBinding = 2;
+constexpr int brickClearedListBinding = 3;
+constexpr int brickActiveDispatchBinding = 4;
+constexpr int brickClearedDispatchBinding = 5;
+constexpr int forcesImpulsesBinding = 0;
+
+// TEST: collocated grid. Velocity components are packed in one texture and share a stagger.
 const Empty::math::bvec3 noStagger(false, false, false);
 
 // f(boundary) + f(neighbour) = 0 -> f(boundary) = -f(neighbour)
@@ -51,15 +141,71 @@ constexpr int entryPointWorkGroupX = 8;
 constexpr int entryPointWorkGroupY = 8;
 constexpr int entryPointWorkGroupZ = 8;
 
+// Must match the packing in brick_compact.glsl
+constexpr unsigned int maxBricksPerAxis = 1024;
+
+// Optimal weight for Jacobi smoothing of the 7-point laplacian
+constexpr float multigridSmootherRelaxation = 6.f / 7.f;
+// Enough to nearly solve the coarsest level, which is tiny
+constexpr int multigridCoarsestSteps = 64;
+
+// Must match MAX_LINE_LENGTH in poisson_filter.glsl
+constexpr unsigned int poissonFilterMaxLineLength = 1024;
+
+// Must match the #defines in adi.glsl
+constexpr unsigned int adiWorkGroupSize = 64;
+constexpr unsigned int adiMaxLineLength = 1024;
+
+// Must match the #defines in pcg_precondition.glsl and pcg_reduce.glsl
+constexpr int pcgPreconditionDiagonal = 0;
+constexpr int pcgPreconditionIncompletePoissonUpper = 1;
+constexpr int pcgPreconditionIncompletePoissonLower = 2;
+constexpr int pcgReduceInit = 0;
+constexpr int pcgReduceStepSize = 1;
+constexpr int pcgReduceDirection = 2;
+
+// Must match the #defines in jacobi.glsl
+constexpr int jacobiRedBlackNone = 0;
+constexpr int jacobiRedBlackRed = 1;
+constexpr int jacobiRedBlackBlack = 2;
+
+// Must match the #defines in jacobi_blocked.glsl
+constexpr int jacobiBlockedMaxScalarIterations = 4;
+constexpr int jacobiBlockedMaxVectorIterations = 2;
+
+// Spectral radius of the Jacobi iteration matrix of the 7-point laplacian with zero boundaries,
+// from which Chebyshev acceleration derives its weights
+static float jacobiSpectralRadius(Empty::math::uvec3 size, float beta)
+{
+	constexpr float pi = 3.14159265358979f;
+	return 2.f * (std::cos(pi / (size.x + 1)) + std::cos(pi / (size.y + 1)) + std::cos(pi / (size.z + 1))) / beta;
+}
+
+// Residual checks a Jacobi solve can have in flight. Checks falling due while all of them are in flight are
+// skipped rather than replacing older ones, so an early stop comes at most that many check intervals late.
+constexpr int jacobiResidualCheckSlots = 4;
+
+// Mirrors the PCGScalars storage block in the pcg_*.glsl shaders
+struct PCGScalars
+{
+	float rz;
+	float alpha;
+	float beta;
+	float residual;
+	uint32_t iterations;
+	uint32_t converged;
+};
+
 // *******************************************
 // Classes representing fluid simulation steps
 // *******************************************
 
 struct FluidSim::GridScrollStep
 {
-	GridScrollStep()
+	GridScrollStep(Shader& ringShader)
 		: scrollProgram("Grid scroll program")
 	{
+		scrollProgram.attachShader(ringShader);
 		scrollProgram.attachFile(ShaderType::Compute, "shaders/sim/grid_scroll.glsl", "Grid scroll shader");
 		if (!scrollProgram.build())
 		{
@@ -67,31 +213,52 @@ struct FluidSim::GridScrollStep
 		}
 	}
 
+	// Logical texel t now holds what logical texel t - scroll held, which stays where it is stored :
+	// only the origin moves, and the slab of texels that came from outside of the grid is zeroed.
 	void compute(FluidState& fluidState, Empty::math::ivec3 scroll)
 	{
 		Context& context = Context::get();
 
-		scrollProgram.uniform("uTexelScroll", scroll);
-		context.setShaderProgram(scrollProgram);
+		const int size[3] = { (int)fluidState.grid.size.x, (int)fluidState.grid.size.y, (int)fluidState.grid.size.z };
+		const int texelScroll[3] = { scroll.x, scroll.y, scroll.z };
+		int origin[3] = { fluidState.gridOrigin.x, fluidState.gridOrigin.y, fluidState.gridOrigin.z };
+		for (int axis = 0; axis < 3; axis++)
+			origin[axis] = ((origin[axis] - texelScroll[axis]) % size[axis] + size[axis]) % size[axis];
 
-		auto doScroll = [this, &context](BufferedScalarField& field)
-			{
-				auto& fieldIn = field.getInput();
-				scrollProgram.registerTexture("uFieldIn", fieldIn, false);
-				context.bind(fieldIn.getLevel(0), 0, AccessPolicy::ReadOnly, GPUScalarField::Format);
+		fluidState.gridOrigin = Empty::math::ivec3(origin[0], origin[1], origin[2]);
+		fluidState.uploadGridRing();
+		context.bind(fluidState.gridRingBuffer, IndexedBufferTarget::Uniform, gridRingBinding);
 
-				auto& fieldOut = field.getOutput();
-				scrollProgram.registerTexture("uFieldOut", fieldOut, false);
-				context.bind(fieldOut.getLevel(0), 1, AccessPolicy::WriteOnly, GPUScalarField::Format);
+		// The output textures are overwritten before being read again
+		auto& pressureTex = fluidState.pressure.getInput();
+		auto& inkTex = fluidState.inkDensity.getInput();
+		auto& velocityTex = fluidState.velocity.getInput();
+		scrollProgram.registerTexture("uPressure", pressureTex, false);
+		scrollProgram.registerTexture("uInk", inkTex, false);
+		scrollProgram.registerTexture("uVelocity", velocityTex, false);
+		context.bind(pressureTex.getLevel(0), 0, AccessPolicy::WriteOnly, GPUScalarField::Format);
+		context.bind(inkTex.getLevel(0), 1, AccessPolicy::WriteOnly, GPUInkField::Format);
+		context.bind(velocityTex.getLevel(0), 2, AccessPolicy::WriteOnly, GPUVelocityField::Format);
 
-				context.dispatchComputeIndirect();
-			};
+		context.setShaderProgram(scrollProgram);
 
-		doScroll(fluidState.velocityX);
-		doScroll(fluidState.velocityY);
-		doScroll(fluidState.velocityZ);
-		doScroll(fluidState.pressure);
-		doScroll(fluidState.inkDensity);
+		// One slab per axis, they overlap in the corners
+		for (int axis = 0; axis < 3; axis++)
+		{
+			int thickness = std::min(std::abs(texelScroll[axis]), size[axis]);
+			if (thickness == 0)
+				continue;
+
+			int slabOrigin[3] = { 0, 0, 0 };
+			int slabSize[3] = { size[0], size[1], size[2] };
+			slabOrigin[axis] = texelScroll[axis] > 0 ? 0 : size[axis] - thickness;
+			slabSize[axis] = thickness;
+
+			scrollProgram.uniform("uSlabOrigin", Empty::math::ivec3(slabOrigin[0], slabOrigin[1], slabOrigin[2]));
+			scrollProgram.uniform("uSlabSize", Empty::math::ivec3(slabSize[0], slabSize[1], slabSize[2]));
+			context.dispatchCompute((slabSize[0] + entryPointWorkGroupX - 1) / entryPointWorkGroupX,
+				(slabSize[1] + entryPointWorkGroupY - 1) / entryPointWorkGroupY, (slabSize[2] + entryPointWorkGroupZ - 1) / entryPointWorkGroupZ);
+		}
 	}
 
 	ShaderProgram scrollProgram;
@@ -99,15 +266,18 @@ struct FluidSim::GridScrollStep
 
 struct FluidSim::AdvectionStep
 {
-	AdvectionStep(Shader& entryPointShader)
+	AdvectionStep(Shader& entryPointShader, Shader& bricksShader, Shader& ringShader)
 		: advectionProgram("Advection program")
 	{
 		advectionProgram.attachShader(entryPointShader);
+		advectionProgram.attachShader(bricksShader);
+		advectionProgram.attachShader(ringShader);
 		advectionProgram.attachFile(ShaderType::Compute, "shaders/sim/advection.glsl", "Advection shader");
 		advectionProgram.build();
 	}
 
-	void compute(FluidState& fluidState, float dt)
+	// Fused advection traces each cell back once for the velocity and the ink, instead of once for each
+	void compute(FluidState& fluidState, float dt, bool fused, AdvectionInterpolation interpolation)
 	{
 		Context& context = Context::get();
 
@@ -120,47 +290,44 @@ struct FluidSim::AdvectionStep
 			advectionProgram.uniform("uGridParams.oneOverGridSize", data);
 		}
 		advectionProgram.uniform("udt", dt);
+		advectionProgram.uniform("uInterpolation", static_cast<int>(interpolation));
 
 		// Inputs are exposed with samplers to benefit from bilinear filtering
 
-		auto& velocityXTex = fluidState.velocityX.getInput();
-		advectionProgram.registerTexture("uVelocityX", velocityXTex, false);
-		context.bind(velocityXTex, allVelocityXBinding);
-
-		auto& velocityYTex = fluidState.velocityY.getInput();
-		advectionProgram.registerTexture("uVelocityY", velocityYTex, false);
-		context.bind(velocityYTex, allVelocityYBinding);
+		auto& velocityTex = fluidState.velocity.getInput();
+		advectionProgram.registerTexture("uVelocity", velocityTex, false);
+		context.bind(velocityTex, allVelocityBinding);
 
-		auto& velocityZTex = fluidState.velocityZ.getInput();
-		advectionProgram.registerTexture("uVelocityZ", velocityZTex, false);
-		context.bind(velocityZTex, allVelocityZBinding);
+		auto& velocityOutTex = fluidState.velocity.getOutput();
+		advectionProgram.registerTexture("uVelocityOut", velocityOutTex, false);
+		context.bind(velocityOutTex.getLevel(0), advectionVelocityOutBinding, AccessPolicy::WriteOnly, GPUVelocityField::Format);
 
-		context.setShaderProgram(advectionProgram);
+		auto& inkTex = fluidState.inkDensity.getInput();
+		advectionProgram.registerTexture("uFieldIn", inkTex, false);
+		context.bind(inkTex, advectionFieldInBinding);
 
-		auto advect = [this, &context](BufferedScalarField& field, float boundaryCondition, Empty::math::bvec3 stagger)
-			{
-				auto& fieldIn = field.getInput();
-				advectionProgram.registerTexture("uFieldIn", fieldIn, false);
-				context.bind(fieldIn, advectionFieldInBinding);
+		auto& inkOutTex = fluidState.inkDensity.getOutput();
+		advectionProgram.registerTexture("uFieldOut", inkOutTex, false);
+		context.bind(inkOutTex.getLevel(0), advectionFieldOutBinding, AccessPolicy::WriteOnly, GPUInkField::Format);
 
-				auto& fieldOut = field.getOutput();
-				advectionProgram.registerTexture("uFieldOut", fieldOut, false);
-				context.bind(fieldOut.getLevel(0), advectionFieldOutBinding, AccessPolicy::WriteOnly, GPUScalarField::Format);
+		context.setShaderProgram(advectionProgram);
 
-				// advectionProgram.uniform("uBoundaryCondition", boundaryCondition);
-				advectionProgram.uniform("uFieldStagger", stagger);
+		// advectionProgram.uniform("uBoundaryCondition", zeroBoundaryCondition);
+		// TEST: collocated grid, the ink has the same stagger as the velocity
+		advectionProgram.uniform("uFieldStagger", noStagger);
 
-				context.dispatchComputeIndirect();
-			};
+		advectionProgram.uniform("uAdvectVelocity", true);
+		advectionProgram.uniform("uAdvectField", fused);
+		context.dispatchComputeIndirect();
 
-		advect(fluidState.velocityX, staggeredNoSlipBoundaryCondition, xStagger);
-		advect(fluidState.velocityY, staggeredNoSlipBoundaryCondition, yStagger);
-		advect(fluidState.velocityZ, staggeredNoSlipBoundaryCondition, zStagger);
-		advect(fluidState.inkDensity, zeroBoundaryCondition, noStagger);
+		if (!fused)
+		{
+			advectionProgram.uniform("uAdvectVelocity", false);
+			advectionProgram.uniform("uAdvectField", true);
+			context.dispatchComputeIndirect();
+		}
 
-		fluidState.velocityX.swap();
-		fluidState.velocityY.swap();
-		fluidState.velocityZ.swap();
+		fluidState.velocity.swap();
 		fluidState.inkDensity.swap();
 	}
 
@@ -168,10 +335,79 @@ struct FluidSim::AdvectionStep
 	Empty::gl::ShaderProgram advectionProgram;
 };
 
+// Finishes the residual reductions started by jacobi.glsl. Each Jacobi iterator owns
+// the buffer the results go to, so several solves can have checks in flight at once.
+struct JacobiResidualReducer
+{
+	JacobiResidualReducer(Empty::math::uvec3 gridSize)
+		: partialSumsBuffer("Jacobi residual partial sums")
+		, reduceProgram("Jacobi residual reduce program")
+		, numWorkGroups((gridSize.x / entryPointWorkGroupX) * (gridSize.y / entryPointWorkGroupY) * (gridSize.z / entryPointWorkGroupZ))
+		, activeBrickDispatchBuffer(nullptr)
+	{
+		std::vector<Empty::math::vec2> partialSums(numWorkGroups, Empty::math::vec2::zero);
+		partialSumsBuffer.setStorage(partialSums.size() * sizeof(Empty::math::vec2), BufferUsage::DynamicCopy, partialSums.data());
+
+		reduceProgram.attachFile(ShaderType::Compute, "shaders/sim/jacobi_residual.glsl", "Jacobi residual shader");
+		reduceProgram.build();
+	}
+
+	// Call before a Jacobi iteration computing the residual
+	void bindPartialSums(Context& context)
+	{
+		context.bind(partialSumsBuffer, IndexedBufferTarget::ShaderStorage, reductionPartialSumsBinding);
+	}
+
+	// Stores the root mean square and maximum of the residual in a slot of residualsBuffer.
+	// numTexels is the number of texels the residual was computed on.
+	void reduce(Context& context, Buffer& residualsBuffer, int slot, float numTexels)
+	{
+		context.bind(residualsBuffer, IndexedBufferTarget::ShaderStorage, jacobiResidualsBinding);
+
+		reduceProgram.uniform("uNumPartialSums", numWorkGroups);
+		reduceProgram.uniform("uOneOverNumTexels", 1.f / numTexels);
+		reduceProgram.uniform("uSlot", slot);
+		reduceProgram.uniform("uSparseBricks", activeBrickDispatchBuffer != nullptr);
+		if (activeBrickDispatchBuffer)
+			context.bind(*activeBrickDispatchBuffer, IndexedBufferTarget::ShaderStorage, activeBrickCountBinding);
+
+		context.memoryBarrier(MemoryBarrierType::ShaderStorage);
+		context.setShaderProgram(reduceProgram);
+		context.dispatchCompute(1, 1, 1);
+
+		// Every solve shares the partial sums, the next residual dispatch may only overwrite them once read
+		context.memoryBarrier(MemoryBarrierType::ShaderStorage);
+	}
+
+	Empty::gl::Buffer partialSumsBuffer;
+	Empty::gl::ShaderProgram reduceProgram;
+
+	unsigned int numWorkGroups;
+	// Set while Jacobi iterations only dispatch the active bricks, which leaves the partial sums of
+	// the others out of date. Their count is the first indirect dispatch argument.
+	Empty::gl::Buffer* activeBrickDispatchBuffer;
+};
+
+// Solves for a scalar field, or for all components of a vector field at once
+template <typename BufferedFieldType>
 struct JacobiIterator
 {
+	using Field = typename BufferedFieldType::Field;
+	static constexpr bool isVectorField = BufferedFieldType::dataFormat == gpuVectorDataFormat;
+
 	JacobiIterator(const std::string& label, Empty::math::uvec3 gridSize)
-		: _workingField(label + " working field")
+		: _label(label)
+		, _gridSize(gridSize)
+		, _workingField()
+		, _residualsBuffer(label + " residuals")
+		, _scheme(RelaxationScheme::Jacobi)
+		, _spectralRadius(0.f)
+		, _chebyshevWeight(1.f)
+		, _blockedProgram(nullptr)
+		, _iterationsPerStep(1)
+		, _boundProgram(nullptr)
+		, _uploaded()
+		, _blockedUploaded()
 		, _fieldSource(nullptr)
 		, _field(nullptr)
 		, _numIterations(-1)
@@ -179,29 +415,117 @@ struct JacobiIterator
 		, _writeToWorkingField(true)
 		, _iterationFieldIn()
 		, _iterationFieldOut()
+		, _residualReducer(nullptr)
+		, _tolerance()
+		, _residualReadback(label + " residual readback", sizeof(Empty::math::vec2), jacobiResidualCheckSlots)
+		, _residualCheckIterations()
+		, _converged(false)
+		, _lastCheckedIteration(-1)
+		, _lastResidual(0.f)
 	{
-		_workingField.setStorage(1, gridSize.x, gridSize.y, gridSize.z);
+		std::vector<Empty::math::vec2> residuals(1, Empty::math::vec2::zero);
+		_residualsBuffer.setStorage(residuals.size() * sizeof(Empty::math::vec2), BufferUsage::DynamicRead, residuals.data());
 	}
 
-	void init(GPUScalarField& fieldSource, BufferedScalarField& field, int jacobiIterations)
+	// Chebyshev acceleration needs the spectral radius of the Jacobi iteration matrix, see jacobiSpectralRadius
+	void init(Field& fieldSource, BufferedFieldType& field, int jacobiIterations,
+		RelaxationScheme scheme = RelaxationScheme::Jacobi, float spectralRadius = 0.f)
 	{
 		assert(jacobiIterations > 0);
+		assert(scheme != RelaxationScheme::Chebyshev || (spectralRadius >= 0.f && spectralRadius < 1.f));
 
+		_scheme = scheme;
+		_spectralRadius = spectralRadius;
+		_chebyshevWeight = 1.f;
+		_blockedProgram = nullptr;
+		_iterationsPerStep = 1;
 		_fieldSource = &fieldSource;
 		_field = &field;
+		_boundProgram = nullptr;
+		_uploaded = {};
+		_blockedUploaded = {};
 
 		_numIterations = jacobiIterations;
 		_currentIteration = 0;
+		_iterationFieldIn = field.getInput().getLevel(0);
+
+		if (_scheme == RelaxationScheme::RedBlackSOR)
+		{
+			// Sweeps update the output field in place, the first one reading from the input field
+			_workingField.reset();
+			_writeToWorkingField = false;
+			_iterationFieldOut = field.getOutput().getLevel(0);
+			return;
+		}
+
+		if (!_workingField)
+		{
+			_workingField = std::make_unique<Field>(_label + " working field");
+			_workingField->setStorage(1, _gridSize.x, _gridSize.y, _gridSize.z);
+			// Sparse dispatches read the bricks around the active ones without writing them
+			_workingField->template clearLevel<BufferedFieldType::dataFormat, DataType::Float>(0);
+		}
+
 		_writeToWorkingField = (_numIterations & 1) == 0;
 
 		// Alternate writes between the working texture and the output field so we write to the output
 		// field last. The first step uses the actual input field as input, the other steps alternate between
 		// working field and output field.
-		_iterationFieldIn = field.getInput().getLevel(0);
-		_iterationFieldOut = _writeToWorkingField ? _workingField.getLevel(0) : field.getOutput().getLevel(0);
+		_iterationFieldOut = _writeToWorkingField ? _workingField->getLevel(0) : field.getOutput().getLevel(0);
+	}
+
+	// Lets iterations stop once the residual is below tolerance, the iteration count passed to init
+	// becoming a maximum. Call right after init.
+	void enableEarlyStop(JacobiResidualReducer& reducer, const JacobiTolerance& tolerance)
+	{
+		assert(_field != nullptr && _currentIteration == 0);
+		assert(tolerance.checkInterval > 0);
+
+		_residualReducer = &reducer;
+		_tolerance = tolerance;
+		_converged = false;
+		_lastCheckedIteration = -1;
+
+		// The parity of the iteration count isn't known anymore : write to the output field first,
+		// and let finish() add an iteration if we end up on the working field.
+		if (_scheme != RelaxationScheme::RedBlackSOR)
+		{
+			_writeToWorkingField = false;
+			_iterationFieldOut = _field->getOutput().getLevel(0);
+		}
 	}
 
-	// Expects all parameters except textures to be set in the jacobi program, and it to be active.
+	// Runs several iterations per step in shared memory with jacobi_blocked.glsl, which only
+	// supports RelaxationScheme::Jacobi. Residual checks happen on the first step past each
+	// check interval. Call right after init, before or after enableEarlyStop.
+	void enableTemporalBlocking(ShaderProgram& blockedProgram, int iterationsPerStep)
+	{
+		assert(_field != nullptr && _currentIteration == 0);
+		assert(_scheme == RelaxationScheme::Jacobi && iterationsPerStep > 0);
+
+		_blockedProgram = &blockedProgram;
+		_iterationsPerStep = std::min(iterationsPerStep, isVectorField ? jacobiBlockedMaxVectorIterations : jacobiBlockedMaxScalarIterations);
+
+		// Writing to the output field last depends on the parity of the step count now
+		if (!_residualReducer)
+		{
+			int numSteps = (_numIterations + _iterationsPerStep - 1) / _iterationsPerStep;
+			_writeToWorkingField = (numSteps & 1) == 0;
+			_iterationFieldOut = _writeToWorkingField ? _workingField->getLevel(0) : _field->getOutput().getLevel(0);
+		}
+	}
+
+	// Also picks up the residual checks the GPU is done with, without waiting for the others
+	bool isDone()
+	{
+		if (_residualReducer)
+			pollResidualChecks();
+		return _converged || _currentIteration >= _numIterations;
+	}
+
+	// Expects all parameters except textures to be set in the jacobi program, uResidualScale included
+	// when early stop is enabled, and uRelaxation being the over-relaxation factor for red-black SOR.
+	// Chebyshev acceleration sets uRelaxation itself. A red-black SOR step is a full sweep.
 	void step(ShaderProgram& jacobiProgram)
 	{
 		assert(_field != nullptr);
@@ -209,25 +533,87 @@ struct JacobiIterator
 
 		Context& context = Context::get();
 
-		context.bind(_fieldSource->getLevel(0), jacobiFieldSourceBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
-		context.bind(_iterationFieldIn, jacobiFieldInBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
-		context.bind(_iterationFieldOut, jacobiFieldOutBinding, AccessPolicy::WriteOnly, GPUScalarField::Format);
+		// The residual of this iteration's input, ie after _currentIteration iterations
+		bool checkResidual = _residualReducer && _currentIteration > 0 && _currentIteration % _tolerance.checkInterval < _iterationsPerStep
+			&& _residualReadback.canRequest();
+		int iterations = std::min(_iterationsPerStep, _numIterations - _currentIteration);
+		float numCheckedTexels = static_cast<float>(_gridSize.x) * _gridSize.y * _gridSize.z;
 
-		context.dispatchComputeIndirect();
+		if (_scheme == RelaxationScheme::RedBlackSOR)
+		{
+			dispatch(context, jacobiProgram, jacobiRedBlackRed, false, _currentIteration == 0);
+			context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+			_iterationFieldIn = _iterationFieldOut;
+
+			// Only black cells can see their residual without racing with the cells being updated,
+			// so residual checks sample half of the grid after the red pass.
+			dispatch(context, jacobiProgram, jacobiRedBlackBlack, checkResidual, false);
+			numCheckedTexels *= 0.5f;
+		}
+		else if (_blockedProgram)
+			dispatchBlocked(context, iterations, checkResidual);
+		else
+		{
+			if (_scheme == RelaxationScheme::Chebyshev)
+				setupChebyshev(context, jacobiProgram);
+			dispatch(context, jacobiProgram, jacobiRedBlackNone, checkResidual, false);
+		}
+
+		if (checkResidual)
+		{
+			_residualReducer->reduce(context, _residualsBuffer, 0, numCheckedTexels);
+			_boundProgram = nullptr;
+			_residualReadback.request(_residualsBuffer);
+			_residualCheckIterations.push_back(_currentIteration);
+		}
+
+		if (_scheme == RelaxationScheme::RedBlackSOR)
+		{
+			++_currentIteration;
+			return;
+		}
 
 		// I could simply swap _iterationFieldInBinding and _iterationFieldOutBinding but _iterationFieldInBinding
 		// is _fieldInBinding for the first step only, and we can never write to that.
 		_writeToWorkingField = !_writeToWorkingField;
 		_iterationFieldIn = _iterationFieldOut;
-		_iterationFieldOut = _writeToWorkingField ? _workingField.getLevel(0) : _field->getOutput().getLevel(0);
+		_iterationFieldOut = _writeToWorkingField ? _workingField->getLevel(0) : _field->getOutput().getLevel(0);
+
+		_currentIteration += iterations;
+	}
 
+	// Makes sure the solution ends up in the output field. Only does work if Jacobi iterations stopped
+	// early on the working field, in which case it runs one last iteration.
+	void finish(ShaderProgram& jacobiProgram)
+	{
+		if (_scheme == RelaxationScheme::RedBlackSOR || _currentIteration == 0 || _writeToWorkingField)
+			return;
+
+		Context& context = Context::get();
+		context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+		if (_scheme == RelaxationScheme::Chebyshev)
+			setupChebyshev(context, jacobiProgram);
+		dispatch(context, jacobiProgram, jacobiRedBlackNone, false, false);
 		++_currentIteration;
 	}
 
+	int getIterations() const { return _currentIteration; }
+	// Null until a Jacobi solve needs it
+	Field* getWorkingField() { return _workingField.get(); }
+	// -1 if no residual check came back during the solve
+	int getLastCheckedIteration() const { return _lastCheckedIteration; }
+	float getLastResidual() const { return _lastResidual; }
+
 	void reset()
 	{
-		assert(_currentIteration == _numIterations);
+		assert(_converged || _currentIteration >= _numIterations);
 
+		// Checks still in flight are about this solve only
+		_residualReadback.cancel();
+		_residualCheckIterations.clear();
+
+		_blockedProgram = nullptr;
+		_iterationsPerStep = 1;
 		_fieldSource = nullptr;
 		_field = nullptr;
 		_numIterations = -1;
@@ -235,125 +621,403 @@ struct JacobiIterator
 		_writeToWorkingField = true;
 		_iterationFieldIn = TextureLevelInfo{};
 		_iterationFieldOut = TextureLevelInfo{};
+		_residualReducer = nullptr;
+		_converged = false;
 	}
 
 private:
-	GPUScalarField _workingField;
+	// What this solve last set in each program, -1 for uniforms it hasn't set yet. Nothing else
+	// touches these uniforms or the Jacobi image units until the solve is over.
+	struct UploadedState
+	{
+		int redBlackPass = -1;
+		int copyOtherColor = -1;
+		int computeResidual = -1;
+		int relaxFromPrevious = -1;
+		int iterations = -1;
+		bool source = false;
+	};
+
+	// x(k+1) = x(k-1) + w(k+1) * (jacobi(x(k)) - x(k-1)), with w(1) = 1, w(2) = 1 / (1 - rho^2 / 2)
+	// and w(k+1) = 1 / (1 - rho^2 * w(k) / 4). Iterate k-1 is in the field iterate k+1 overwrites,
+	// except for the second iteration where it's the input field.
+	void setupChebyshev(Context& context, ShaderProgram& jacobiProgram)
+	{
+		float rho2 = _spectralRadius * _spectralRadius;
+		if (_currentIteration == 0)
+			_chebyshevWeight = 1.f;
+		else if (_currentIteration == 1)
+			_chebyshevWeight = 1.f / (1.f - rho2 / 2.f);
+		else
+			_chebyshevWeight = 1.f / (1.f - rho2 * _chebyshevWeight / 4.f);
+
+		jacobiProgram.uniform("uRelaxation", _chebyshevWeight);
+		upload(jacobiProgram, "uRelaxFromPrevious", _uploaded.relaxFromPrevious, _currentIteration > 0);
+		if (_currentIteration > 0)
+		{
+			auto previous = _currentIteration == 1 ? _field->getInput().getLevel(0) : _iterationFieldOut;
+			context.bind(previous, isVectorField ? jacobiVectorFieldPreviousBinding : jacobiFieldPreviousBinding, AccessPolicy::ReadOnly, Field::Format);
+		}
+	}
+
+	// uRelaxFromPrevious is only ever set by Chebyshev iterations, and reset after them
+	void dispatch(Context& context, ShaderProgram& jacobiProgram, int redBlackPass, bool computeResidual, bool copyOtherColor)
+	{
+		if (_scheme != RelaxationScheme::Chebyshev)
+			upload(jacobiProgram, "uRelaxFromPrevious", _uploaded.relaxFromPrevious, false);
+		upload(jacobiProgram, "uRedBlackPass", _uploaded.redBlackPass, redBlackPass);
+		upload(jacobiProgram, "uCopyOtherColor", _uploaded.copyOtherColor, copyOtherColor);
+		upload(jacobiProgram, "uComputeResidual", _uploaded.computeResidual, computeResidual);
+		if (computeResidual)
+			_residualReducer->bindPartialSums(context);
+
+		bindFields(context, jacobiProgram, _uploaded);
+		bindProgram(context, jacobiProgram);
+		context.dispatchComputeIndirect();
+	}
+
+	// Same number of 8^3 work groups as jacobi.glsl, so it shares its indirect dispatch buffer
+	void dispatchBlocked(Context& context, int iterations, bool computeResidual)
+	{
+		upload(*_blockedProgram, "uIterations", _blockedUploaded.iterations, iterations);
+		upload(*_blockedProgram, "uComputeResidual", _blockedUploaded.computeResidual, computeResidual);
+		if (computeResidual)
+			_residualReducer->bindPartialSums(context);
+
+		bindFields(context, *_blockedProgram, _blockedUploaded);
+		bindProgram(context, *_blockedProgram);
+		context.dispatchComputeIndirect();
+	}
+
+	// The source field and uVectorField are set on the first dispatch only, after which plain
+	// iterations only rebind the two fields they ping-pong between
+	void bindFields(Context& context, ShaderProgram& program, UploadedState& uploaded)
+	{
+		if (!uploaded.source)
+		{
+			program.uniform("uVectorField", isVectorField);
+			context.bind(_fieldSource->getLevel(0), isVectorField ? jacobiVectorFieldSourceBinding : jacobiFieldSourceBinding,
+				AccessPolicy::ReadOnly, Field::Format);
+			uploaded.source = true;
+		}
+
+		context.bind(_iterationFieldIn, isVectorField ? jacobiVectorFieldInBinding : jacobiFieldInBinding, AccessPolicy::ReadOnly, Field::Format);
+		context.bind(_iterationFieldOut, isVectorField ? jacobiVectorFieldOutBinding : jacobiFieldOutBinding, AccessPolicy::WriteOnly, Field::Format);
+	}
+
+	// Residual reductions switch programs in between iterations
+	void bindProgram(Context& context, ShaderProgram& program)
+	{
+		if (_boundProgram == &program)
+			return;
+		context.setShaderProgram(program);
+		_boundProgram = &program;
+	}
+
+	template <typename T>
+	static void upload(ShaderProgram& program, const char* name, int& uploaded, T value)
+	{
+		if (uploaded == static_cast<int>(value))
+			return;
+		program.uniform(name, value);
+		uploaded = static_cast<int>(value);
+	}
+
+	void pollResidualChecks()
+	{
+		// Checks come back in order
+		Empty::math::vec2 residuals;
+		while (_residualReadback.poll(&residuals))
+		{
+			_lastCheckedIteration = _residualCheckIterations.front();
+			_residualCheckIterations.pop_front();
+			_lastResidual = _tolerance.norm == ResidualNorm::L2 ? residuals.x : residuals.y;
+			if (_lastResidual <= _tolerance.tolerance)
+				_converged = true;
+		}
+	}
+
+	std::string _label;
+	Empty::math::uvec3 _gridSize;
+
+	// Only allocated while Jacobi iterations need it
+	std::unique_ptr<Field> _workingField;
+	Empty::gl::Buffer _residualsBuffer;
 
-	GPUScalarField* _fieldSource;
-	BufferedScalarField* _field;
+	RelaxationScheme _scheme;
+	float _spectralRadius;
+	float _chebyshevWeight;
+
+	ShaderProgram* _blockedProgram;
+	int _iterationsPerStep;
+
+	ShaderProgram* _boundProgram;
+	UploadedState _uploaded;
+	UploadedState _blockedUploaded;
+
+	Field* _fieldSource;
+	BufferedFieldType* _field;
 
 	int _numIterations;
 	int _currentIteration;
 	bool _writeToWorkingField;
 	Empty::gl::TextureLevelInfo _iterationFieldIn;
 	Empty::gl::TextureLevelInfo _iterationFieldOut;
+
+	JacobiResidualReducer* _residualReducer;
+	JacobiTolerance _tolerance;
+	AsyncReadback _residualReadback;
+	// Iteration of each check in flight, oldest first
+	std::deque<int> _residualCheckIterations;
+	bool _converged;
+	int _lastCheckedIteration;
+	float _lastResidual;
 };
 
 struct FluidSim::DiffusionStep
 {
-	DiffusionStep(Empty::math::uvec3 gridSize)
-		: jacobiX("Diffuse Jacobi X", gridSize)
-		, jacobiY("Diffuse Jacobi Y", gridSize)
-		, jacobiZ("Diffuse Jacobi Z", gridSize)
-	{ }
+	DiffusionStep(Shader& ringShader, Empty::math::uvec3 gridSize)
+		: jacobi("Diffuse Jacobi", gridSize)
+		, adiProgram("ADI program")
+	{
+		// Line coefficients are kept in shared memory
+		assert(gridSize.x <= adiMaxLineLength && gridSize.y <= adiMaxLineLength && gridSize.z <= adiMaxLineLength);
+
+		adiProgram.attachShader(ringShader);
+		attachFieldShader(adiProgram, "shaders/sim/adi.glsl", "ADI shader");
+		adiProgram.build();
+	}
 
-	void compute(ShaderProgram& jacobiProgram, FluidState& fluidState, float dt, int jacobiIterations)
+	void compute(ShaderProgram& jacobiProgram, ShaderProgram& blockedJacobiProgram, JacobiResidualReducer& residualReducer, FluidState& fluidState,
+		float dt, int jacobiIterations, const JacobiTolerance& tolerance, RelaxationScheme scheme, float sorRelaxation, int iterationsPerDispatch)
 	{
 		const auto& params = fluidState.grid;
 
 		Context& context = Context::get();
 
-		// Perform Jacobi iterations on individual components
-		jacobiX.init(fluidState.velocityX.getInput(), fluidState.velocityX, jacobiIterations);
-		jacobiY.init(fluidState.velocityY.getInput(), fluidState.velocityY, jacobiIterations);
-		jacobiZ.init(fluidState.velocityZ.getInput(), fluidState.velocityZ, jacobiIterations);
+		// Perform Jacobi iterations on all components at once
+		float alpha = params.cellSize * params.cellSize / (fluidState.physics.kinematicViscosity * dt);
+		float beta = alpha + 6.f;
+		jacobi.init(fluidState.velocity.getInput(), fluidState.velocity, jacobiIterations, scheme, jacobiSpectralRadius(params.size, beta));
+
+		if (tolerance.tolerance > 0.f)
+			jacobi.enableEarlyStop(residualReducer, tolerance);
+		if (scheme == RelaxationScheme::Jacobi && iterationsPerDispatch > 1)
+			jacobi.enableTemporalBlocking(blockedJacobiProgram, iterationsPerDispatch);
 
 		// Upload solver parameters
+		for (ShaderProgram* program : { &jacobiProgram, &blockedJacobiProgram })
 		{
-			float alpha = params.cellSize * params.cellSize / (fluidState.physics.kinematicViscosity * dt);
-			float oneOverBeta = 1.f / (alpha + 6.f);
-			jacobiProgram.uniform("uAlpha", alpha);
-			jacobiProgram.uniform("uOneOverBeta", oneOverBeta);
-			// jacobiProgram.uniform("uBoundaryCondition", staggeredNoSlipBoundaryCondition);
+			float oneOverBeta = 1.f / beta;
+			program->uniform("uAlpha", alpha);
+			program->uniform("uOneOverBeta", oneOverBeta);
+			program->uniform("uRelaxation", scheme == RelaxationScheme::RedBlackSOR ? sorRelaxation : 1.f);
+			program->uniform("uResidualScale", 1.f / (alpha * oneOverBeta));
+			program->uniform("uBoundaryCondition", staggeredNoSlipBoundaryCondition);
+			// TEST: collocated grid, all components share the same stagger
+			// program->uniform("uFieldStagger", noStagger);
 		}
 
-		context.setShaderProgram(jacobiProgram);
-
-		for (int i = 0; i < jacobiIterations; i++)
+		for (int i = 0; !jacobi.isDone(); i++)
 		{
 			if (i > 0)
 				context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
-			// jacobiProgram.uniform("uFieldStagger", xStagger);
-			jacobiX.step(jacobiProgram);
-			// jacobiProgram.uniform("uFieldStagger", yStagger);
-			jacobiY.step(jacobiProgram);
-			// jacobiProgram.uniform("uFieldStagger", zStagger);
-			jacobiZ.step(jacobiProgram);
+			jacobi.step(jacobiProgram);
 		}
 
-		jacobiX.reset();
-		jacobiY.reset();
-		jacobiZ.reset();
+		jacobi.finish(jacobiProgram);
+		jacobi.reset();
 
-		fluidState.velocityX.swap();
-		fluidState.velocityY.swap();
-		fluidState.velocityZ.swap();
+		fluidState.velocity.swap();
 	}
 
-	JacobiIterator jacobiX;
-	JacobiIterator jacobiY;
-	JacobiIterator jacobiZ;
+	// Approximates the implicit solve of compute with the product of one implicit solve per axis,
+	// each one a batch of tridiagonal systems. The splitting error is O(dt^2), and there is no
+	// iteration count to pick : 3 passes replace all Jacobi iterations.
+	void computeADI(FluidState& fluidState, float dt)
+	{
+		const auto& params = fluidState.grid;
+
+		Context& context = Context::get();
+
+		float alpha = params.cellSize * params.cellSize / (fluidState.physics.kinematicViscosity * dt);
+		adiProgram.uniform("uAlpha", alpha);
+
+		context.setShaderProgram(adiProgram);
+
+		// The first pass leaves the input untouched, the others solve in place in the output
+		auto& velocityIn = fluidState.velocity.getInput();
+		auto& velocityOut = fluidState.velocity.getOutput();
+		pass(context, params.size, 0, velocityIn, velocityOut);
+		context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+		pass(context, params.size, 1, velocityOut, velocityOut);
+		context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+		pass(context, params.size, 2, velocityOut, velocityOut);
+
+		fluidState.velocity.swap();
+	}
+
+	// Solves all lines of the grid along axis
+	void pass(Context& context, Empty::math::uvec3 size, int axis, GPUVelocityField& fieldIn, GPUVelocityField& fieldOut)
+	{
+		adiProgram.uniform("uAxis", axis);
+
+		adiProgram.registerTexture("uFieldIn", fieldIn, false);
+		adiProgram.registerTexture("uFieldOut", fieldOut, false);
+		context.bind(fieldIn.getLevel(0), adiFieldInBinding, AccessPolicy::ReadOnly, GPUVelocityField::Format);
+		context.bind(fieldOut.getLevel(0), adiFieldOutBinding, AccessPolicy::ReadWrite, GPUVelocityField::Format);
+
+		// One invocation per line
+		unsigned int dims[3] = { size.x, size.y, size.z };
+		unsigned int numLines = dims[(axis + 1) % 3] * dims[(axis + 2) % 3];
+		context.dispatchCompute((numLines + adiWorkGroupSize - 1) / adiWorkGroupSize, 1, 1);
+	}
+
+	JacobiIterator<BufferedVelocityField> jacobi;
+
+	Empty::gl::ShaderProgram adiProgram;
 };
 
+// Layout of the Impulses storage block in forces.glsl
+struct ForcesImpulse
+{
+	Empty::math::vec4 centerAndOneOverRadius;
+	Empty::math::vec4 forceAndInk;
+};
+
+// Impulses are cut off where their gaussian falls under 2^-forcesCutoffExponent
+constexpr float forcesCutoffExponent = 16.f;
+
 struct FluidSim::ForcesStep
 {
-	ForcesStep(Shader& entryPointShader)
+	ForcesStep(Shader& entryPointShader, Shader& bricksShader, Shader& ringShader)
 		: forcesProgram("Forces program")
+		, impulsesBuffer("Forces impulses")
+		, bricksBuffer("Forces bricks")
 	{
 		forcesProgram.attachShader(entryPointShader);
-		forcesProgram.attachFile(ShaderType::Compute, "shaders/sim/forces.glsl", "Forces shader");
+		forcesProgram.attachShader(bricksShader);
+		forcesProgram.attachShader(ringShader);
+		attachFieldShader(forcesProgram, "shaders/sim/forces.glsl", "Forces shader");
 		forcesProgram.build();
 	}
 
-	void compute(FluidState& fluidState, const FluidSimMouseClickImpulse& impulse, float dt, bool velocityOnly)
+	// Lists the stored bricks covering the support box of at least one impulse, packed like brick_compact.glsl
+	static std::vector<unsigned int> listBricks(const FluidState& fluidState, const std::vector<FluidSimMouseClickImpulse>& impulses)
+	{
+		const Empty::math::uvec3 size = fluidState.grid.size;
+		const int gridSize[3] = { (int)size.x, (int)size.y, (int)size.z };
+		const int gridOrigin[3] = { fluidState.gridOrigin.x, fluidState.gridOrigin.y, fluidState.gridOrigin.z };
+		const int numBricks[3] = { gridSize[0] / entryPointWorkGroupX, gridSize[1] / entryPointWorkGroupY, gridSize[2] / entryPointWorkGroupZ };
+		const int brickSize[3] = { entryPointWorkGroupX, entryPointWorkGroupY, entryPointWorkGroupZ };
+
+		std::vector<bool> covered(static_cast<size_t>(numBricks[0]) * numBricks[1] * numBricks[2], false);
+		std::vector<bool> axisCovered[3];
+
+		for (const auto& impulse : impulses)
+		{
+			float extent = std::sqrt(forcesCutoffExponent * impulse.radius);
+			const float center[3] = { impulse.position.x, impulse.position.y, impulse.position.z };
+
+			// The logical texels a box covers wrap around to stored bricks anywhere along each axis
+			bool empty = false;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				axisCovered[axis].assign(numBricks[axis], false);
+				int first = std::max(static_cast<int>(std::floor(center[axis] - extent)), 0);
+				int last = std::min(static_cast<int>(std::ceil(center[axis] + extent)), gridSize[axis] - 1);
+				empty = empty || first > last;
+				for (int texel = first; texel <= last; texel++)
+					axisCovered[axis][((texel + gridOrigin[axis]) % gridSize[axis] + gridSize[axis]) % gridSize[axis] / brickSize[axis]] = true;
+			}
+			if (empty)
+				continue;
+
+			for (int z = 0; z < numBricks[2]; z++)
+				for (int y = 0; y < numBricks[1]; y++)
+					for (int x = 0; x < numBricks[0]; x++)
+						if (axisCovered[0][x] && axisCovered[1][y] && axisCovered[2][z])
+							covered[x + numBricks[0] * (y + numBricks[1] * z)] = true;
+		}
+
+		std::vector<unsigned int> bricks;
+		for (int z = 0; z < numBricks[2]; z++)
+			for (int y = 0; y < numBricks[1]; y++)
+				for (int x = 0; x < numBricks[0]; x++)
+					if (covered[x + numBricks[0] * (y + numBricks[1] * z)])
+						bricks.push_back(x | (y << 10) | (z << 20));
+		return bricks;
+	}
+
+	// All impulses go in one dispatch per field, over the bricks around them. Expects the grid ring to be bound.
+	void compute(FluidState& fluidState, const std::vector<FluidSimMouseClickImpulse>& impulses, float dt, bool velocityOnly)
 	{
+		std::vector<unsigned int> bricks = listBricks(fluidState, impulses);
+		if (bricks.empty())
+			return;
+
+		std::vector<ForcesImpulse> packed;
+		packed.reserve(impulses.size());
+		for (const auto& impulse : impulses)
+		{
+			const auto& center = impulse.position;
+			const auto& force = impulse.magnitude;
+			packed.push_back({ Empty::math::vec4(center.x, center.y, center.z, 1.f / impulse.radius),
+				Empty::math::vec4(force.x, force.y, force.z, velocityOnly ? 0.f : impulse.inkAmount * dt) });
+		}
+
+		impulsesBuffer.setStorage(packed.size() * sizeof(ForcesImpulse), BufferUsage::DynamicDraw, packed.data());
+		bricksBuffer.setStorage(bricks.size() * sizeof(unsigned int), BufferUsage::DynamicDraw, bricks.data());
+
 		Context& context = Context::get();
 
-		forcesProgram.uniform("uForceCenter", impulse.position);
-		forcesProgram.uniform("uOneOverForceRadius", 1.f / impulse.radius);
+		context.bind(impulsesBuffer, IndexedBufferTarget::ShaderStorage, forcesImpulsesBinding);
+		context.bind(bricksBuffer, IndexedBufferTarget::ShaderStorage, activeBricksBinding);
+		forcesProgram.uniform("uNumImpulses", static_cast<int>(packed.size()));
+		forcesProgram.uniform("uSparseBricks", true);
 
 		context.setShaderProgram(forcesProgram);
 
-		auto applyForce = [this, &context](GPUScalarField& field, float forceMagnitude, float boundaryCondition, Empty::math::bvec3 stagger)
+		auto applyForce = [this, &context, &bricks](GPUInkField& field, float boundaryCondition, Empty::math::bvec3 stagger)
 			{
 				forcesProgram.registerTexture("uField", field, false);
-				context.bind(field.getLevel(0), forcesFieldBinding, AccessPolicy::ReadWrite, GPUScalarField::Format);
+				context.bind(field.getLevel(0), forcesFieldBinding, AccessPolicy::ReadWrite, GPUInkField::Format);
 
-				forcesProgram.uniform("uForceMagnitude", forceMagnitude);
+				forcesProgram.uniform("uVectorField", false);
 				// forcesProgram.uniform("uBoundaryCondition", boundaryCondition);
 				forcesProgram.uniform("uFieldStagger", stagger);
-				context.dispatchComputeIndirect();
+				context.dispatchCompute(static_cast<int>(bricks.size()), 1, 1);
 			};
 
-	applyForce(fluidState.velocityX.getInput(), impulse.magnitude.x, staggeredNoSlipBoundaryCondition, xStagger);
-	applyForce(fluidState.velocityY.getInput(), impulse.magnitude.y, staggeredNoSlipBoundaryCondition, yStagger);
-	applyForce(fluidState.velocityZ.getInput(), impulse.magnitude.z, staggeredNoSlipBoundaryCondition, zStagger);
+		{
+			auto& velocityTex = fluidState.velocity.getInput();
+			forcesProgram.registerTexture("uVelocity", velocityTex, false);
+			context.bind(velocityTex.getLevel(0), forcesVelocityBinding, AccessPolicy::ReadWrite, GPUVelocityField::Format);
+
+			forcesProgram.uniform("uVectorField", true);
+			// TEST: collocated grid
+			forcesProgram.uniform("uFieldStagger", noStagger);
+			context.dispatchCompute(static_cast<int>(bricks.size()), 1, 1);
+		}
 		if (!velocityOnly)
-		applyForce(fluidState.inkDensity.getInput(), impulse.inkAmount * dt, zeroBoundaryCondition, noStagger);
+		applyForce(fluidState.inkDensity.getInput(), zeroBoundaryCondition, noStagger);
 
 		// Don't swap textures since we read from and write to the same textures
 	}
 
 	Empty::gl::ShaderProgram forcesProgram;
+
+	Empty::gl::Buffer impulsesBuffer;
+	Empty::gl::Buffer bricksBuffer;
 };
 
 struct FluidSim::DivergenceStep
 {
-	DivergenceStep()
+	DivergenceStep(Shader& ringShader)
 		: divergenceProgram("Divergence program")
 	{
-		divergenceProgram.attachFile(ShaderType::Compute, "shaders/sim/divergence.glsl", "Divergence shader");
+		divergenceProgram.attachShader(ringShader);
+		attachFieldShader(divergenceProgram, "shaders/sim/divergence.glsl", "Divergence shader");
 		divergenceProgram.build();
 	}
 
@@ -363,18 +1027,12 @@ struct FluidSim::DivergenceStep
 
 		Context& context = Context::get();
 
-		auto& velocityXTex = fluidState.velocityX.getInput();
-		auto& velocityYTex = fluidState.velocityY.getInput();
-		auto& velocityZTex = fluidState.velocityZ.getInput();
+		auto& velocityTex = fluidState.velocity.getInput();
 
 		divergenceProgram.uniform("uOneOverDx", 1.f / params.cellSize);
-		divergenceProgram.registerTexture("uVelocityX", velocityXTex, false);
-		divergenceProgram.registerTexture("uVelocityY", velocityYTex, false);
-		divergenceProgram.registerTexture("uVelocityZ", velocityZTex, false);
+		divergenceProgram.registerTexture("uVelocity", velocityTex, false);
 		divergenceProgram.registerTexture("uDivergence", tex, false);
-		context.bind(velocityXTex.getLevel(0), allVelocityXBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
-		context.bind(velocityYTex.getLevel(0), allVelocityYBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
-		context.bind(velocityZTex.getLevel(0), allVelocityZBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
+		context.bind(velocityTex.getLevel(0), allVelocityBinding, AccessPolicy::ReadOnly, GPUVelocityField::Format);
 		context.bind(tex.getLevel(0), divergenceOutBinding, AccessPolicy::WriteOnly, GPUScalarField::Format);
 
 		context.setShaderProgram(divergenceProgram);
@@ -390,7 +1048,10 @@ struct FluidSim::PressureStep
 		: jacobi("Pressure jacobi", gridSize)
 	{ }
 
-	void compute(ShaderProgram& jacobiProgram, FluidState& fluidState, int jacobiIterations, bool reuseLastPressure)
+	// Only fills the report when the tolerance is enabled
+	void compute(ShaderProgram& jacobiProgram, ShaderProgram& blockedJacobiProgram, JacobiResidualReducer& residualReducer, FluidState& fluidState,
+		int jacobiIterations, const JacobiTolerance& tolerance, RelaxationScheme scheme, float sorRelaxation, int iterationsPerDispatch,
+		bool reuseLastPressure, PressureSolveReport& report)
 	{
 		const auto& params = fluidState.grid;
 		Context& context = Context::get();
@@ -398,117 +1059,907 @@ struct FluidSim::PressureStep
 		if (!reuseLastPressure)
 			fluidState.pressure.clear();
 
-		jacobi.init(fluidState.divergenceTex, fluidState.pressure, jacobiIterations);
+		jacobi.init(fluidState.divergenceTex, fluidState.pressure, jacobiIterations, scheme, jacobiSpectralRadius(params.size, 6.f));
+		if (tolerance.tolerance > 0.f)
+			jacobi.enableEarlyStop(residualReducer, tolerance);
+		if (scheme == RelaxationScheme::Jacobi && iterationsPerDispatch > 1)
+			jacobi.enableTemporalBlocking(blockedJacobiProgram, iterationsPerDispatch);
 
 		// Upload solver parameters
+		for (ShaderProgram* program : { &jacobiProgram, &blockedJacobiProgram })
 		{
 			float alpha = -params.cellSize * params.cellSize * fluidState.physics.density;
 			float oneOverBeta = 1.f / 6.f;
-			jacobiProgram.uniform("uAlpha", alpha);
-			jacobiProgram.uniform("uOneOverBeta", oneOverBeta);
-			// jacobiProgram.uniform("uBoundaryCondition", neumannBoundaryCondition);
-			// jacobiProgram.uniform("uFieldStagger", noStagger);
+			program->uniform("uAlpha", alpha);
+			program->uniform("uOneOverBeta", oneOverBeta);
+			program->uniform("uRelaxation", scheme == RelaxationScheme::RedBlackSOR ? sorRelaxation : 1.f);
+			program->uniform("uResidualScale", 1.f / (alpha * oneOverBeta));
+			// TEST: collocated grid
+			program->uniform("uBoundaryCondition", zeroBoundaryCondition);
+			// program->uniform("uBoundaryCondition", neumannBoundaryCondition);
+			// program->uniform("uFieldStagger", noStagger);
+		}
+
+		for (int i = 0; !jacobi.isDone(); i++)
+		{
+			if (i > 0)
+				context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+			jacobi.step(jacobiProgram);
+		}
+
+		jacobi.finish(jacobiProgram);
+
+		if (tolerance.tolerance > 0.f)
+		{
+			report.iterations = jacobi.getIterations();
+			if (jacobi.getLastCheckedIteration() >= 0)
+				report.residual = jacobi.getLastResidual();
+		}
+
+		jacobi.reset();
+
+		fluidState.pressure.swap();
+	}
+
+	JacobiIterator<BufferedScalarField> jacobi;
+};
+
+struct FluidSim::MultigridPressureStep
+{
+	// Coarse grid level, half the size of the level above
+	struct Level
+	{
+		Level(int index, Empty::math::uvec3 size)
+			: size(size)
+			, solution("Multigrid level " + std::to_string(index) + " solution", size)
+			, source("Multigrid level " + std::to_string(index) + " source")
+			, jacobi("Multigrid level " + std::to_string(index) + " jacobi", size)
+			, dispatchBuffer("Multigrid level " + std::to_string(index) + " indirect dispatch args")
+		{
+			source.setStorage(1, size.x, size.y, size.z);
+
+			Empty::math::uvec3 dispatch(size.x / entryPointWorkGroupX, size.y / entryPointWorkGroupY, size.z / entryPointWorkGroupZ);
+			dispatchBuffer.setStorage(sizeof(dispatch), BufferUsage::StaticDraw, dispatch);
+		}
+
+		Empty::math::uvec3 size;
+		BufferedScalarField solution;
+		GPUScalarField source;
+		JacobiIterator<BufferedScalarField> jacobi;
+		Buffer dispatchBuffer;
+	};
+
+	MultigridPressureStep(Shader& entryPointShader, Shader& bricksShader, Shader& ringShader, Empty::math::uvec3 gridSize)
+		: restrictionProgram("Multigrid restriction program")
+		, prolongationProgram("Multigrid prolongation program")
+		, fineJacobi("Multigrid fine jacobi", gridSize)
+		, levels()
+		, unscrolledRingBuffer("Multigrid coarse levels grid ring")
+	{
+		restrictionProgram.attachShader(entryPointShader);
+		restrictionProgram.attachShader(bricksShader);
+		restrictionProgram.attachShader(ringShader);
+		restrictionProgram.attachFile(ShaderType::Compute, "shaders/sim/restriction.glsl", "Multigrid restriction shader");
+		restrictionProgram.build();
+
+		prolongationProgram.attachShader(entryPointShader);
+		prolongationProgram.attachShader(bricksShader);
+		prolongationProgram.attachShader(ringShader);
+		prolongationProgram.attachFile(ShaderType::Compute, "shaders/sim/prolongation.glsl", "Multigrid prolongation shader");
+		prolongationProgram.build();
+
+		// Halve the grid as long as the coarser level is still made of whole work groups
+		Empty::math::uvec3 size = gridSize;
+		while (size.x % (2 * entryPointWorkGroupX) == 0 && size.y % (2 * entryPointWorkGroupY) == 0 && size.z % (2 * entryPointWorkGroupZ) == 0)
+		{
+			size = Empty::math::uvec3(size.x / 2, size.y / 2, size.z / 2);
+			levels.push_back(std::make_unique<Level>(static_cast<int>(levels.size()) + 1, size));
+		}
+
+		// Coarse texels are smaller than the simulation grid, which the ring wraps around
+		FluidGridRing ring{ { 0, 0, 0, 0 }, { (int32_t)gridSize.x, (int32_t)gridSize.y, (int32_t)gridSize.z, 0 } };
+		unscrolledRingBuffer.setStorage(sizeof(ring), BufferUsage::StaticDraw, ring);
+	}
+
+	void compute(ShaderProgram& jacobiProgram, Buffer& fineDispatchBuffer, FluidState& fluidState, int numCycles, int smoothingSteps, MultigridCycle cycle, bool reuseLastPressure)
+	{
+		const auto& params = fluidState.grid;
+		Context& context = Context::get();
+
+		if (!reuseLastPressure)
+			fluidState.pressure.clear();
+
+		// Same laplacian as PressureStep
+		float alpha = -params.cellSize * params.cellSize * fluidState.physics.density;
+		float beta = 6.f;
+
+		for (int i = 0; i < numCycles; i++)
+		{
+			if (i > 0)
+				context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+			visit(jacobiProgram, fineDispatchBuffer, fluidState, 0, alpha, beta, smoothingSteps, static_cast<int>(cycle));
+		}
+
+		// Leave the full grid dispatch and ring bound for the next steps
+		context.bind(fineDispatchBuffer, BufferTarget::DispatchIndirect);
+		bindRing(fluidState, 0);
+	}
+
+	// Only the simulation grid is scrolled
+	void bindRing(FluidState& fluidState, int level)
+	{
+		Context::get().bind(level == 0 ? fluidState.gridRingBuffer : unscrolledRingBuffer, IndexedBufferTarget::Uniform, gridRingBinding);
+	}
+
+	// Recursively solves the Poisson equation on the given level, using the level below
+	// to solve for the low frequencies of the error. Level 0 is the simulation grid.
+	void visit(ShaderProgram& jacobiProgram, Buffer& fineDispatchBuffer, FluidState& fluidState, int level, float alpha, float beta, int smoothingSteps, int coarseVisits)
+	{
+		Context& context = Context::get();
+
+		BufferedScalarField& field = level == 0 ? fluidState.pressure : levels[level - 1]->solution;
+		GPUScalarField& source = level == 0 ? fluidState.divergenceTex : levels[level - 1]->source;
+		JacobiIterator<BufferedScalarField>& jacobi = level == 0 ? fineJacobi : levels[level - 1]->jacobi;
+		Buffer& dispatchBuffer = level == 0 ? fineDispatchBuffer : levels[level - 1]->dispatchBuffer;
+		float boundaryCondition = coarseBoundaryCondition(level);
+
+		context.bind(dispatchBuffer, BufferTarget::DispatchIndirect);
+		bindRing(fluidState, level);
+
+		if (level == static_cast<int>(levels.size()))
+		{
+			smooth(jacobiProgram, jacobi, source, field, alpha, beta, boundaryCondition, multigridCoarsestSteps);
+			return;
 		}
 
+		smooth(jacobiProgram, jacobi, source, field, alpha, beta, boundaryCondition, smoothingSteps);
+
+		// Restrict the residual to the coarser level's source
+		Level& coarse = *levels[level];
+		{
+			context.bind(coarse.dispatchBuffer, BufferTarget::DispatchIndirect);
+
+			auto& solutionTex = field.getInput();
+			restrictionProgram.uniform("uOneOverAlpha", 1.f / alpha);
+			restrictionProgram.uniform("uBeta", beta);
+			restrictionProgram.uniform("uBoundaryCondition", boundaryCondition);
+			restrictionProgram.registerTexture("uFineSource", source, false);
+			restrictionProgram.registerTexture("uFineSolution", solutionTex, false);
+			restrictionProgram.registerTexture("uCoarseSource", coarse.source, false);
+			context.bind(source.getLevel(0), restrictionFineSourceBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
+			context.bind(solutionTex.getLevel(0), restrictionFineSolutionBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
+			context.bind(coarse.source.getLevel(0), restrictionCoarseSourceBinding, AccessPolicy::WriteOnly, GPUScalarField::Format);
+
+			context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+			context.setShaderProgram(restrictionProgram);
+			context.dispatchComputeIndirect();
+		}
+
+		// Solve for the error on the coarser level, starting from 0. The laplacian scales with
+		// the square of the cell size, which doubles.
+		coarse.solution.clear();
+		for (int i = 0; i < coarseVisits; i++)
+		{
+			context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+			visit(jacobiProgram, fineDispatchBuffer, fluidState, level + 1, alpha * 4.f, 6.f + (beta - 6.f) * 4.f, smoothingSteps, coarseVisits);
+		}
+
+		// Interpolate the error back and correct this level's solution with it
+		{
+			context.bind(dispatchBuffer, BufferTarget::DispatchIndirect);
+			bindRing(fluidState, level);
+
+			auto& coarseTex = coarse.solution.getInput();
+			auto& solutionTex = field.getInput();
+			prolongationProgram.registerTexture("uCoarseSolution", coarseTex, false);
+			prolongationProgram.registerTexture("uFineSolution", solutionTex, false);
+			context.bind(coarseTex.getLevel(0), prolongationCoarseSolutionBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
+			context.bind(solutionTex.getLevel(0), prolongationFineSolutionBinding, AccessPolicy::ReadWrite, GPUScalarField::Format);
+
+			context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+			context.setShaderProgram(prolongationProgram);
+			context.dispatchComputeIndirect();
+		}
+
+		context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+		smooth(jacobiProgram, jacobi, source, field, alpha, beta, boundaryCondition, smoothingSteps);
+	}
+
+	void smooth(ShaderProgram& jacobiProgram, JacobiIterator<BufferedScalarField>& jacobi, GPUScalarField& source, BufferedScalarField& field,
+		float alpha, float beta, float boundaryCondition, int steps)
+	{
+		Context& context = Context::get();
+
+		jacobiProgram.uniform("uAlpha", alpha);
+		jacobiProgram.uniform("uOneOverBeta", 1.f / beta);
+		jacobiProgram.uniform("uRelaxation", multigridSmootherRelaxation);
+		jacobiProgram.uniform("uBoundaryCondition", boundaryCondition);
+
 		context.setShaderProgram(jacobiProgram);
 
-		for (int i = 0; i < jacobiIterations; i++)
+		jacobi.init(source, field, steps);
+		for (int i = 0; i < steps; i++)
 		{
 			if (i > 0)
 				context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
 			jacobi.step(jacobiProgram);
 		}
-
 		jacobi.reset();
 
+		field.swap();
+	}
+
+	// The fine grid's field is 0 half a fine texel outside of the grid. Coarse texels are
+	// bigger, so to keep that boundary in the same place, extrapolate linearly from the boundary
+	// texel through 0 at that location, which gives the value in the texel outside.
+	static float coarseBoundaryCondition(int level)
+	{
+		// Distance from the boundary texel's center to the 0 location, in texels
+		float t = 0.5f + std::ldexp(0.5f, -level);
+		return 1.f - 1.f / t;
+	}
+
+	Empty::gl::ShaderProgram restrictionProgram;
+	Empty::gl::ShaderProgram prolongationProgram;
+	JacobiIterator<BufferedScalarField> fineJacobi;
+	std::vector<std::unique_ptr<Level>> levels;
+	Buffer unscrolledRingBuffer;
+};
+
+struct FluidSim::ConjugateGradientPressureStep
+{
+	ConjugateGradientPressureStep(Shader& reductionShader, Shader& ringShader, Empty::math::uvec3 gridSize)
+		: residualTex("PCG residual")
+		, preconditionedTex("PCG preconditioned residual")
+		, directionTex("PCG direction")
+		, laplacianTex("PCG direction laplacian")
+		, scalarsBuffer("PCG scalars")
+		, partialSumsBuffer("PCG partial sums")
+		, residualProgram("PCG residual program")
+		, laplacianProgram("PCG laplacian program")
+		, updateProgram("PCG update program")
+		, preconditionProgram("PCG precondition program")
+		, directionProgram("PCG direction program")
+		, reduceProgram("PCG reduce program")
+		, numWorkGroups((gridSize.x / entryPointWorkGroupX) * (gridSize.y / entryPointWorkGroupY) * (gridSize.z / entryPointWorkGroupZ))
+		, readback("PCG scalars readback", sizeof(PCGScalars))
+	{
+		for (GPUScalarField* tex : { &residualTex, &preconditionedTex, &directionTex, &laplacianTex })
+		{
+			tex->setStorage(1, gridSize.x, gridSize.y, gridSize.z);
+			tex->template clearLevel<DataFormat::Red, DataType::Float>(0);
+		}
+
+		PCGScalars scalars{};
+		scalarsBuffer.setStorage(sizeof(scalars), BufferUsage::DynamicCopy, scalars);
+		std::vector<Empty::math::vec2> partialSums(numWorkGroups, Empty::math::vec2::zero);
+		partialSumsBuffer.setStorage(partialSums.size() * sizeof(Empty::math::vec2), BufferUsage::DynamicCopy, partialSums.data());
+
+		residualProgram.attachShader(ringShader);
+		residualProgram.attachFile(ShaderType::Compute, "shaders/sim/pcg_residual.glsl", "PCG residual shader");
+		residualProgram.build();
+
+		laplacianProgram.attachShader(reductionShader);
+		laplacianProgram.attachShader(ringShader);
+		laplacianProgram.attachFile(ShaderType::Compute, "shaders/sim/pcg_laplacian.glsl", "PCG laplacian shader");
+		laplacianProgram.build();
+
+		updateProgram.attachFile(ShaderType::Compute, "shaders/sim/pcg_update.glsl", "PCG update shader");
+		updateProgram.build();
+
+		preconditionProgram.attachShader(reductionShader);
+		preconditionProgram.attachShader(ringShader);
+		preconditionProgram.attachFile(ShaderType::Compute, "shaders/sim/pcg_precondition.glsl", "PCG precondition shader");
+		preconditionProgram.build();
+
+		directionProgram.attachFile(ShaderType::Compute, "shaders/sim/pcg_direction.glsl", "PCG direction shader");
+		directionProgram.build();
+
+		reduceProgram.attachFile(ShaderType::Compute, "shaders/sim/pcg_reduce.glsl", "PCG reduce shader");
+		reduceProgram.build();
+	}
+
+	// Solves the same Poisson equation as PressureStep, written as Mx = alpha * b with M = beta * I - neighbours
+	// so that M is symmetric positive definite. All scalars live on the GPU, and once the residual is below
+	// the tolerance, the remaining passes return immediately. The report is filled from earlier solves.
+	void compute(FluidState& fluidState, int maxIterations, float tolerance, PCGPreconditioner preconditioner, bool reuseLastPressure,
+		PressureSolveReport& report)
+	{
+		const auto& params = fluidState.grid;
+		Context& context = Context::get();
+
+		// Report on the latest earlier solve the GPU is done with
+		{
+			PCGScalars scalars;
+			while (readback.poll(&scalars))
+			{
+				report.iterations = static_cast<int>(scalars.iterations);
+				report.residual = scalars.residual;
+			}
+		}
+
+		if (!reuseLastPressure)
+			fluidState.pressure.clear();
+
+		// Same laplacian as PressureStep
+		float alpha = -params.cellSize * params.cellSize * fluidState.physics.density;
+		float beta = 6.f;
+		float numTexels = static_cast<float>(params.size.x) * params.size.y * params.size.z;
+
+		laplacianProgram.uniform("uBeta", beta);
+		preconditionProgram.uniform("uOneOverBeta", 1.f / beta);
+		reduceProgram.uniform("uNumPartialSums", numWorkGroups);
+		reduceProgram.uniform("uResidualScale", 1.f / (std::abs(alpha) * std::sqrt(numTexels)));
+		reduceProgram.uniform("uTolerance", tolerance);
+
+		context.bind(scalarsBuffer, IndexedBufferTarget::ShaderStorage, pcgScalarsBinding);
+		context.bind(partialSumsBuffer, IndexedBufferTarget::ShaderStorage, reductionPartialSumsBinding);
+
+		auto& solutionTex = fluidState.pressure.getInput();
+
+		// r = alpha * b - Mx
+		{
+			residualProgram.uniform("uAlpha", alpha);
+			residualProgram.uniform("uBeta", beta);
+			residualProgram.registerTexture("uSource", fluidState.divergenceTex, false);
+			residualProgram.registerTexture("uSolution", solutionTex, false);
+			residualProgram.registerTexture("uResidual", residualTex, false);
+			context.bind(fluidState.divergenceTex.getLevel(0), pcgSourceBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
+			context.bind(solutionTex.getLevel(0), pcgSolutionBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
+			context.bind(residualTex.getLevel(0), pcgResidualBinding, AccessPolicy::WriteOnly, GPUScalarField::Format);
+
+			context.setShaderProgram(residualProgram);
+			context.dispatchComputeIndirect();
+		}
+
+		// z = P^-1 r, d = z
+		barrier(context);
+		precondition(context, preconditioner);
+		barrier(context);
+		reduce(context, pcgReduceInit);
+		barrier(context);
+		updateDirection(context);
+
+		for (int i = 0; i < maxIterations; i++)
+		{
+			// q = Md, alpha = r.z / d.q
+			{
+				laplacianProgram.registerTexture("uDirection", directionTex, false);
+				laplacianProgram.registerTexture("uLaplacian", laplacianTex, false);
+				context.bind(directionTex.getLevel(0), pcgLaplacianDirectionBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
+				context.bind(laplacianTex.getLevel(0), pcgLaplacianOutBinding, AccessPolicy::WriteOnly, GPUScalarField::Format);
+
+				barrier(context);
+				context.setShaderProgram(laplacianProgram);
+				context.dispatchComputeIndirect();
+			}
+			barrier(context);
+			reduce(context, pcgReduceStepSize);
+
+			// x += alpha * d, r -= alpha * q
+			{
+				updateProgram.registerTexture("uSolution", solutionTex, false);
+				updateProgram.registerTexture("uResidual", residualTex, false);
+				updateProgram.registerTexture("uDirection", directionTex, false);
+				updateProgram.registerTexture("uLaplacian", laplacianTex, false);
+				context.bind(solutionTex.getLevel(0), pcgUpdateSolutionBinding, AccessPolicy::ReadWrite, GPUScalarField::Format);
+				context.bind(residualTex.getLevel(0), pcgUpdateResidualBinding, AccessPolicy::ReadWrite, GPUScalarField::Format);
+				context.bind(directionTex.getLevel(0), pcgUpdateDirectionBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
+				context.bind(laplacianTex.getLevel(0), pcgUpdateLaplacianBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
+
+				barrier(context);
+				context.setShaderProgram(updateProgram);
+				context.dispatchComputeIndirect();
+			}
+
+			// z = P^-1 r, beta = new r.z / old r.z, d = z + beta * d
+			barrier(context);
+			precondition(context, preconditioner);
+			barrier(context);
+			reduce(context, pcgReduceDirection);
+			barrier(context);
+			updateDirection(context);
+		}
+
+		readback.request(scalarsBuffer);
+
+		// Leave the solution visible to the next steps
+		barrier(context);
+	}
+
+	void precondition(Context& context, PCGPreconditioner preconditioner)
+	{
+		auto pass = [this, &context](int which, GPUScalarField& fieldIn, GPUScalarField& fieldOut)
+			{
+				preconditionProgram.uniform("uPreconditionPass", which);
+				preconditionProgram.registerTexture("uFieldIn", fieldIn, false);
+				preconditionProgram.registerTexture("uFieldOut", fieldOut, false);
+				preconditionProgram.registerTexture("uResidual", residualTex, false);
+				context.bind(fieldIn.getLevel(0), pcgPreconditionFieldInBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
+				context.bind(fieldOut.getLevel(0), pcgPreconditionFieldOutBinding, AccessPolicy::WriteOnly, GPUScalarField::Format);
+				context.bind(residualTex.getLevel(0), pcgPreconditionResidualBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
+
+				context.setShaderProgram(preconditionProgram);
+				context.dispatchComputeIndirect();
+			};
+
+		switch (preconditioner)
+		{
+		case PCGPreconditioner::Jacobi:
+			pass(pcgPreconditionDiagonal, residualTex, preconditionedTex);
+			break;
+		case PCGPreconditioner::IncompletePoisson:
+			// The laplacian texture is free until the next iteration, use it for the intermediate field
+			pass(pcgPreconditionIncompletePoissonUpper, residualTex, laplacianTex);
+			barrier(context);
+			pass(pcgPreconditionIncompletePoissonLower, laplacianTex, preconditionedTex);
+			break;
+		}
+	}
+
+	void updateDirection(Context& context)
+	{
+		directionProgram.registerTexture("uPreconditioned", preconditionedTex, false);
+		directionProgram.registerTexture("uDirection", directionTex, false);
+		context.bind(preconditionedTex.getLevel(0), pcgDirectionPreconditionedBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
+		context.bind(directionTex.getLevel(0), pcgDirectionBinding, AccessPolicy::ReadWrite, GPUScalarField::Format);
+
+		context.setShaderProgram(directionProgram);
+		context.dispatchComputeIndirect();
+	}
+
+	void reduce(Context& context, int which)
+	{
+		reduceProgram.uniform("uReducePass", which);
+		context.setShaderProgram(reduceProgram);
+		context.dispatchCompute(1, 1, 1);
+	}
+
+	// Passes communicate through both images and storage blocks
+	static void barrier(Context& context)
+	{
+		context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+		context.memoryBarrier(MemoryBarrierType::ShaderStorage);
+	}
+
+	GPUScalarField residualTex;
+	GPUScalarField preconditionedTex;
+	GPUScalarField directionTex;
+	GPUScalarField laplacianTex;
+
+	Empty::gl::Buffer scalarsBuffer;
+	Empty::gl::Buffer partialSumsBuffer;
+
+	Empty::gl::ShaderProgram residualProgram;
+	Empty::gl::ShaderProgram laplacianProgram;
+	Empty::gl::ShaderProgram updateProgram;
+	Empty::gl::ShaderProgram preconditionProgram;
+	Empty::gl::ShaderProgram directionProgram;
+	Empty::gl::ShaderProgram reduceProgram;
+
+	unsigned int numWorkGroups;
+	AsyncReadback readback;
+};
+
+struct FluidSim::PoissonFilterPressureStep
+{
+	PoissonFilterPressureStep(Shader& ringShader, Empty::math::uvec3 gridSize)
+		: filteredXTex("Poisson filter X pass")
+		, filteredYTex("Poisson filter Y pass")
+		, filterProgram("Poisson filter program")
+		, tapsBuffer()
+		, filters()
+	{
+		// Each work group holds a whole line of the grid in shared memory
+		assert(gridSize.x <= poissonFilterMaxLineLength && gridSize.y <= poissonFilterMaxLineLength && gridSize.z <= poissonFilterMaxLineLength);
+
+		filteredXTex.setStorage(1, gridSize.x, gridSize.y, gridSize.z);
+		filteredYTex.setStorage(1, gridSize.x, gridSize.y, gridSize.z);
+
+		filterProgram.attachShader(ringShader);
+		filterProgram.attachFile(ShaderType::Compute, "shaders/sim/poisson_filter.glsl", "Poisson filter shader");
+		filterProgram.build();
+	}
+
+	// Approximates jacobiIterations iterations of PressureStep with 3 separable passes per rank of the filter.
+	// Filters are generated on the CPU whenever the iteration count or the rank changes.
+	void compute(FluidState& fluidState, int jacobiIterations, int rank, bool reuseLastPressure)
+	{
+		const auto& params = fluidState.grid;
+		Context& context = Context::get();
+
+		// Same laplacian as PressureStep
+		float alpha = -params.cellSize * params.cellSize * fluidState.physics.density;
+		float beta = 6.f;
+
+		if (filters.iterations != jacobiIterations || filters.rank != rank)
+		{
+			filters = computePoissonFilters(jacobiIterations, beta, rank);
+			tapsBuffer = std::make_unique<Buffer>("Poisson filter taps");
+			tapsBuffer->setStorage(filters.taps.size() * sizeof(float), BufferUsage::StaticDraw, filters.taps.data());
+		}
+
+		if (!reuseLastPressure)
+			fluidState.pressure.clear();
+
+		auto& initialTex = fluidState.pressure.getInput();
+		auto& solutionTex = fluidState.pressure.getOutput();
+
+		filterProgram.uniform("uAlpha", alpha);
+		filterProgram.uniform("uOneOverBeta", 1.f / beta);
+		filterProgram.uniform("uRadius", filters.radius);
+		filterProgram.registerTexture("uFieldSource", fluidState.divergenceTex, false);
+		context.bind(fluidState.divergenceTex.getLevel(0), poissonFilterSourceBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
+		context.bind(*tapsBuffer, IndexedBufferTarget::ShaderStorage, poissonFilterTapsBinding);
+
+		context.setShaderProgram(filterProgram);
+
+		// xk = x0 + sum of w * (f x f x f) * (x1 - x0)
+		int numTaps = 2 * filters.radius + 1;
+		for (int r = 0; r < filters.rank; r++)
+		{
+			if (r > 0)
+				context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+			filterProgram.uniform("uTapsOffset", r * numTaps);
+			pass(context, params.size, 0, initialTex, filteredXTex, nullptr, 1.f);
+			context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+			pass(context, params.size, 1, filteredXTex, filteredYTex, nullptr, 1.f);
+			context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+			pass(context, params.size, 2, filteredYTex, solutionTex, r == 0 ? &initialTex : &solutionTex, filters.weights[r]);
+		}
+
 		fluidState.pressure.swap();
 	}
 
-	JacobiIterator jacobi;
+	// Filters all lines of the grid along axis. The first pass of a term filters the Jacobi update of fieldIn.
+	void pass(Context& context, Empty::math::uvec3 size, int axis, GPUScalarField& fieldIn, GPUScalarField& fieldOut,
+		GPUScalarField* accumulate, float scale)
+	{
+		filterProgram.uniform("uAxis", axis);
+		filterProgram.uniform("uJacobiUpdateInput", axis == 0);
+		filterProgram.uniform("uAccumulate", accumulate != nullptr);
+		filterProgram.uniform("uScale", scale);
+
+		filterProgram.registerTexture("uFieldIn", fieldIn, false);
+		filterProgram.registerTexture("uFieldOut", fieldOut, false);
+		context.bind(fieldIn.getLevel(0), poissonFilterFieldInBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
+		context.bind(fieldOut.getLevel(0), poissonFilterFieldOutBinding, AccessPolicy::WriteOnly, GPUScalarField::Format);
+		if (accumulate)
+		{
+			filterProgram.registerTexture("uFieldAccumulate", *accumulate, false);
+			context.bind(accumulate->getLevel(0), poissonFilterAccumulateBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
+		}
+
+		// One work group per line
+		unsigned int dims[3] = { size.x, size.y, size.z };
+		context.dispatchCompute(dims[(axis + 1) % 3], dims[(axis + 2) % 3], 1);
+	}
+
+	GPUScalarField filteredXTex;
+	GPUScalarField filteredYTex;
+
+	Empty::gl::ShaderProgram filterProgram;
+	std::unique_ptr<Empty::gl::Buffer> tapsBuffer;
+
+	PoissonFilters filters;
 };
 
 struct FluidSim::ProjectionStep
 {
-	ProjectionStep()
+	ProjectionStep(Shader& bricksShader, Shader& ringShader)
 		: projectionProgram("Projection program")
 	{
-		projectionProgram.attachFile(ShaderType::Compute, "shaders/sim/projection.glsl", "Projection shader");
+		projectionProgram.attachShader(bricksShader);
+		projectionProgram.attachShader(ringShader);
+		attachFieldShader(projectionProgram, "shaders/sim/projection.glsl", "Projection shader");
 		projectionProgram.build();
 	}
 
-	void compute(FluidState& fluidState)
+	// Also computes the divergence of the projected velocity into divergenceCheck if it isn't null
+	void compute(FluidState& fluidState, GPUScalarField* divergenceCheck)
 	{
 		const auto& params = fluidState.grid;
 
 		Context& context = Context::get();
 
-		auto& velocityXTex = fluidState.velocityX.getInput();
-		auto& velocityYTex = fluidState.velocityY.getInput();
-		auto& velocityZTex = fluidState.velocityZ.getInput();
+		auto& velocityTex = fluidState.velocity.getInput();
 		auto& pressureTex = fluidState.pressure.getInput();
 
 		projectionProgram.uniform("uOneOverDx", 1.f / params.cellSize);
-		projectionProgram.registerTexture("uVelocityX", velocityXTex, false);
-		projectionProgram.registerTexture("uVelocityY", velocityYTex, false);
-		projectionProgram.registerTexture("uVelocityZ", velocityZTex, false);
+		projectionProgram.uniform("uComputeDivergence", divergenceCheck != nullptr);
+		projectionProgram.registerTexture("uVelocity", velocityTex, false);
 		projectionProgram.registerTexture("uPressure", pressureTex, false);
-		context.bind(velocityXTex.getLevel(0), allVelocityXBinding, AccessPolicy::ReadWrite, GPUScalarField::Format);
-		context.bind(velocityYTex.getLevel(0), allVelocityYBinding, AccessPolicy::ReadWrite, GPUScalarField::Format);
-		context.bind(velocityZTex.getLevel(0), allVelocityZBinding, AccessPolicy::ReadWrite, GPUScalarField::Format);
+		context.bind(velocityTex.getLevel(0), allVelocityBinding, AccessPolicy::ReadWrite, GPUVelocityField::Format);
 		context.bind(pressureTex.getLevel(0), projectionPressureBinding, AccessPolicy::ReadOnly, GPUScalarField::Format);
 
+		// Work groups need the velocity around them before projection, so don't project in place
+		if (divergenceCheck)
+		{
+			auto& velocityOutTex = fluidState.velocity.getOutput();
+			projectionProgram.registerTexture("uVelocityOut", velocityOutTex, false);
+			projectionProgram.registerTexture("uDivergence", *divergenceCheck, false);
+			context.bind(velocityOutTex.getLevel(0), projectionVelocityOutBinding, AccessPolicy::WriteOnly, GPUVelocityField::Format);
+			context.bind(divergenceCheck->getLevel(0), projectionDivergenceBinding, AccessPolicy::WriteOnly, GPUScalarField::Format);
+		}
+
 		context.setShaderProgram(projectionProgram);
 		context.dispatchComputeIndirect();
 
-		// Don't swap textures since we read from and write to the same textures
+		// Otherwise, don't swap textures since we read from and write to the same textures
+		if (divergenceCheck)
+			fluidState.velocity.swap();
 	}
 
 	Empty::gl::ShaderProgram projectionProgram;
 };
 
+struct FluidSim::ActivityStep
+{
+	ActivityStep(Shader& bricksShader, Shader& ringShader, Empty::math::uvec3 gridSize)
+		: numBricks(gridSize.x / entryPointWorkGroupX, gridSize.y / entryPointWorkGroupY, gridSize.z / entryPointWorkGroupZ)
+		, activityProgram("Brick activity program")
+		, compactProgram("Brick compaction program")
+		, clearProgram("Brick clear program")
+		, activityBuffer("Brick activity")
+		, listedBuffer("Listed bricks")
+		, activeBricksBuffer("Active bricks")
+		, clearedBricksBuffer("Cleared bricks")
+		, dispatchBuffer("Active bricks indirect dispatch args")
+		, clearedDispatchBuffer("Cleared bricks indirect dispatch args")
+		, readback("Active bricks readback", sizeof(Empty::math::uvec3))
+		, numActiveBricks(-1)
+	{
+		assert(numBricks.x <= maxBricksPerAxis && numBricks.y <= maxBricksPerAxis && numBricks.z <= maxBricksPerAxis);
+
+		attachFieldShader(activityProgram, "shaders/sim/brick_activity.glsl", "Brick activity shader");
+		activityProgram.build();
+
+		compactProgram.attachShader(ringShader);
+		compactProgram.attachFile(ShaderType::Compute, "shaders/sim/brick_compact.glsl", "Brick compaction shader");
+		compactProgram.build();
+		compactProgram.uniform("uNumBricks", numBricks);
+
+		clearProgram.attachShader(bricksShader);
+		clearProgram.attachFile(ShaderType::Compute, "shaders/sim/brick_clear.glsl", "Brick clear shader");
+		clearProgram.build();
+		clearProgram.uniform("uSparseBricks", true);
+
+		// Nothing is listed to begin with, fields start cleared
+		std::vector<unsigned int> zeros(static_cast<size_t>(numBricks.x) * numBricks.y * numBricks.z, 0);
+		for (Buffer* buffer : { &activityBuffer, &listedBuffer, &activeBricksBuffer, &clearedBricksBuffer })
+			buffer->setStorage(zeros.size() * sizeof(unsigned int), BufferUsage::DynamicCopy, zeros.data());
+
+		Empty::math::uvec3 dispatch(0, 1, 1);
+		dispatchBuffer.setStorage(sizeof(dispatch), BufferUsage::DynamicCopy, dispatch);
+		clearedDispatchBuffer.setStorage(sizeof(dispatch), BufferUsage::DynamicCopy, dispatch);
+	}
+
+	// Lists the bricks with velocity or ink above threshold and the bricks around them, and clears
+	// the bricks that just left the list in the fields sparse dispatches write to. Expects the whole
+	// grid's indirect dispatch buffer to be bound.
+	void compute(FluidState& fluidState, float threshold, GPUVelocityField* velocityWorkingField)
+	{
+		Context& context = Context::get();
+
+		// Latest count the GPU is done with
+		Empty::math::uvec3 dispatch;
+		while (readback.poll(&dispatch))
+			numActiveBricks = static_cast<int>(dispatch.x);
+
+		auto& velocityTex = fluidState.velocity.getInput();
+		auto& inkTex = fluidState.inkDensity.getInput();
+
+		activityProgram.uniform("uThreshold", threshold);
+		activityProgram.registerTexture("uVelocity", velocityTex, false);
+		activityProgram.registerTexture("uInk", inkTex, false);
+		context.bind(velocityTex.getLevel(0), brickActivityVelocityBinding, AccessPolicy::ReadOnly, GPUVelocityField::Format);
+		context.bind(inkTex.getLevel(0), brickActivityInkBinding, AccessPolicy::ReadOnly, GPUInkField::Format);
+		context.bind(activityBuffer, IndexedBufferTarget::ShaderStorage, brickActivityBinding);
+
+		context.setShaderProgram(activityProgram);
+		context.dispatchComputeIndirect();
+
+		context.bind(listedBuffer, IndexedBufferTarget::ShaderStorage, brickListedBinding);
+		context.bind(activeBricksBuffer, IndexedBufferTarget::ShaderStorage, brickActiveListBinding);
+		context.bind(clearedBricksBuffer, IndexedBufferTarget::ShaderStorage, brickClearedListBinding);
+		context.bind(dispatchBuffer, IndexedBufferTarget::ShaderStorage, brickActiveDispatchBinding);
+		context.bind(clearedDispatchBuffer, IndexedBufferTarget::ShaderStorage, brickClearedDispatchBinding);
+
+		// Dilation goes through the origin of the ring
+		context.bind(fluidState.gridRingBuffer, IndexedBufferTarget::Uniform, gridRingBinding);
+		context.memoryBarrier(MemoryBarrierType::ShaderStorage);
+		context.setShaderProgram(compactProgram);
+		context.dispatchCompute(1, 1, 1);
+
+		readback.request(dispatchBuffer);
+
+		context.memoryBarrier(MemoryBarrierType::ShaderStorage);
+		context.memoryBarrier(MemoryBarrierType::Command);
+
+		// Both buffers, since advection and Jacobi iterations ping-pong between them
+		context.bind(clearedBricksBuffer, IndexedBufferTarget::ShaderStorage, activeBricksBinding);
+		context.bind(clearedDispatchBuffer, BufferTarget::DispatchIndirect);
+		context.setShaderProgram(clearProgram);
+
+		auto clear = [this, &context](auto& field)
+			{
+				using Field = std::remove_reference_t<decltype(field)>;
+				clearProgram.registerTexture("uField", field, false);
+				context.bind(field.getLevel(0), brickClearFieldBinding, AccessPolicy::WriteOnly, Field::Format);
+				context.dispatchComputeIndirect();
+			};
+
+		clear(fluidState.velocity.getInput());
+		clear(fluidState.velocity.getOutput());
+		clear(fluidState.inkDensity.getInput());
+		clear(fluidState.inkDensity.getOutput());
+		if (velocityWorkingField)
+			clear(*velocityWorkingField);
+	}
+
+	Empty::math::uvec3 numBricks;
+
+	Empty::gl::ShaderProgram activityProgram;
+	Empty::gl::ShaderProgram compactProgram;
+	Empty::gl::ShaderProgram clearProgram;
+
+	Empty::gl::Buffer activityBuffer;
+	Empty::gl::Buffer listedBuffer;
+	Empty::gl::Buffer activeBricksBuffer;
+	Empty::gl::Buffer clearedBricksBuffer;
+	Empty::gl::Buffer dispatchBuffer;
+	Empty::gl::Buffer clearedDispatchBuffer;
+
+	AsyncReadback readback;
+	int numActiveBricks;
+};
+
+// Largest velocity magnitude in the grid, for adaptive time steps. Goes through the Jacobi residual
+// reduction, and is read back a frame or two late from a persistently mapped buffer.
+struct FluidSim::MaxVelocityStep
+{
+	MaxVelocityStep(Shader& reductionShader)
+		: maxVelocityProgram("Max velocity program")
+		, readback("Max velocity readback", sizeof(Empty::math::vec2))
+		, maxVelocity(0.f)
+	{
+		maxVelocityProgram.attachShader(reductionShader);
+		attachFieldShader(maxVelocityProgram, "shaders/sim/max_velocity.glsl", "Max velocity shader");
+		maxVelocityProgram.build();
+	}
+
+	// Picks up the last measure if it arrived, and starts a new one unless the last is still in flight.
+	// Expects the whole grid's indirect dispatch buffer to be bound.
+	void compute(FluidState& fluidState, JacobiResidualReducer& residualReducer)
+	{
+		Context& context = Context::get();
+
+		if (auto* result = static_cast<const Empty::math::vec2*>(readback.poll()))
+			maxVelocity = result->y;
+
+		if (readback.isPending())
+			return;
+
+		auto& velocityTex = fluidState.velocity.getInput();
+		maxVelocityProgram.registerTexture("uVelocity", velocityTex, false);
+		context.bind(velocityTex.getLevel(0), maxVelocityBinding, AccessPolicy::ReadOnly, GPUVelocityField::Format);
+		residualReducer.bindPartialSums(context);
+
+		context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+		context.setShaderProgram(maxVelocityProgram);
+		context.dispatchComputeIndirect();
+
+		// Only the maximum is of interest, the sum is 0
+		Empty::math::uvec3 size = fluidState.grid.size;
+		residualReducer.reduce(context, readback.buffer, 0, static_cast<float>(size.x * size.y * size.z));
+		readback.request();
+	}
+
+	Empty::gl::ShaderProgram maxVelocityProgram;
+
+	PersistentReadback readback;
+	// In m/s, 0 until known
+	float maxVelocity;
+};
+
+// Copies a field as it would be stored without scrolling, for use outside of the sim
+struct FluidSim::UnwrapStep
+{
+	UnwrapStep(Shader& ringShader)
+		: unwrapProgram("Unwrap program")
+	{
+		unwrapProgram.attachShader(ringShader);
+		attachFieldShader(unwrapProgram, "shaders/sim/unwrap.glsl", "Unwrap shader");
+		unwrapProgram.build();
+	}
+
+	// Expects the whole grid's indirect dispatch buffer and the ink's grid ring to be bound.
+	// unwrap.glsl declares its image with the ink's format.
+	void compute(GPUInkField& ink, GPUInkField& out)
+	{
+		Context& context = Context::get();
+
+		unwrapProgram.registerTexture("uField", ink, false);
+		unwrapProgram.registerTexture("uFieldOut", out, false);
+		context.bind(ink.getLevel(0), unwrapFieldBinding, AccessPolicy::ReadOnly, GPUInkField::Format);
+		context.bind(out.getLevel(0), unwrapFieldOutBinding, AccessPolicy::WriteOnly, GPUInkField::Format);
+
+		context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+		context.setShaderProgram(unwrapProgram);
+		context.dispatchComputeIndirect();
+	}
+
+	Empty::gl::ShaderProgram unwrapProgram;
+};
+
 // **********************
 // Main fluid sim methods
 // **********************
 
 FluidSim::FluidSim(Empty::math::uvec3 gridSize)
-	: diffusionJacobiSteps(100)
-	, pressureJacobiSteps(100)
-	, reuseLastPressure(true)
-	, runAdvection(true)
-	, runDiffusion(true)
-	, runDivergence(true)
-	, runPressure(true)
-	, runProjection(true)
-	, _hooks()
+	: _hooks()
+	, _hookDiagnostics()
 	, _nextHookId(0)
 	, _entryPointShader(ShaderType::Compute, "Entry point shader")
+	, _reductionShader(ShaderType::Compute, "Reduction shader")
+	, _bricksShader(ShaderType::Compute, "Bricks shader")
+	, _ringShader(ShaderType::Compute, "Ring shader")
 	, _jacobiProgram("Jacobi program")
+	, _blockedJacobiProgram("Blocked Jacobi program")
 	, _entryPointIndirectDispatchBuffer("Entry point indirect dispatch args")
+	, _lastSubsteps(1)
 {
 	if (!_entryPointShader.setSourceFromFile("shaders/sim/entry_point.glsl"))
 		FATAL("Failed to compile entry point shader:\n" << _entryPointShader.getLog());
 
+	if (!_reductionShader.setSourceFromFile("shaders/sim/reduction.glsl"))
+		FATAL("Failed to compile reduction shader:\n" << _reductionShader.getLog());
+
+	if (!_bricksShader.setSourceFromFile("shaders/sim/bricks.glsl"))
+		FATAL("Failed to compile bricks shader:\n" << _bricksShader.getLog());
+
+	if (!_ringShader.setSourceFromFile("shaders/sim/ring.glsl"))
+		FATAL("Failed to compile ring shader:\n" << _ringShader.getLog());
+
 	_jacobiProgram.attachShader(_entryPointShader);
-	_jacobiProgram.attachFile(ShaderType::Compute, "shaders/sim/jacobi.glsl", "Jacobi shader");
+	_jacobiProgram.attachShader(_bricksShader);
+	_jacobiProgram.attachShader(_ringShader);
+	_jacobiProgram.attachShader(_reductionShader);
+	attachFieldShader(_jacobiProgram, "shaders/sim/jacobi.glsl", "Jacobi shader");
 	_jacobiProgram.build();
 
+	_blockedJacobiProgram.attachShader(_bricksShader);
+	_blockedJacobiProgram.attachShader(_ringShader);
+	_blockedJacobiProgram.attachShader(_reductionShader);
+	attachFieldShader(_blockedJacobiProgram, "shaders/sim/jacobi_blocked.glsl", "Blocked Jacobi shader");
+	_blockedJacobiProgram.build();
+
 	Empty::math::uvec3 dispatch(gridSize.x / entryPointWorkGroupX, gridSize.y / entryPointWorkGroupY, gridSize.z / entryPointWorkGroupZ);
 	_entryPointIndirectDispatchBuffer.setStorage(sizeof(dispatch), BufferUsage::StaticDraw, dispatch);
 
-	_gridScrollStep = std::make_unique<GridScrollStep>();
-	_advectionStep = std::make_unique<AdvectionStep>(_entryPointShader);
-	_diffusionStep = std::make_unique<DiffusionStep>(gridSize);
-	_forcesStep = std::make_unique<ForcesStep>(_entryPointShader);
-	_divergenceStep = std::make_unique<DivergenceStep>();
+	_jacobiResidualReducer = std::make_unique<JacobiResidualReducer>(gridSize);
+
+	_gridScrollStep = std::make_unique<GridScrollStep>(_ringShader);
+	_activityStep = std::make_unique<ActivityStep>(_bricksShader, _ringShader, gridSize);
+	_advectionStep = std::make_unique<AdvectionStep>(_entryPointShader, _bricksShader, _ringShader);
+	_diffusionStep = std::make_unique<DiffusionStep>(_ringShader, gridSize);
+	_forcesStep = std::make_unique<ForcesStep>(_entryPointShader, _bricksShader, _ringShader);
+	_divergenceStep = std::make_unique<DivergenceStep>(_ringShader);
 	_pressureStep = std::make_unique<PressureStep>(gridSize);
-	_projectionStep = std::make_unique<ProjectionStep>();
+	_multigridPressureStep = std::make_unique<MultigridPressureStep>(_entryPointShader, _bricksShader, _ringShader, gridSize);
+	_conjugateGradientPressureStep = std::make_unique<ConjugateGradientPressureStep>(_reductionShader, _ringShader, gridSize);
+	_poissonFilterPressureStep = std::make_unique<PoissonFilterPressureStep>(_ringShader, gridSize);
+	_projectionStep = std::make_unique<ProjectionStep>(_bricksShader, _ringShader);
+	_maxVelocityStep = std::make_unique<MaxVelocityStep>(_reductionShader);
+	_unwrapStep = std::make_unique<UnwrapStep>(_ringShader);
 }
 
 FluidSim::~FluidSim() = default;
 
-FluidSimHookId FluidSim::registerHook(FluidSimHook hook, FluidSimHookStage when)
+FluidSimHookId FluidSim::registerHook(FluidSimHook hook, FluidSimHookStage when, FluidSimDiagnostics diagnostics)
 {
 	_hooks[_nextHookId] = std::make_pair(hook, when);
+	_hookDiagnostics[_nextHookId] = diagnostics;
 
 	return _nextHookId++;
 }
@@ -523,37 +1974,143 @@ bool FluidSim::modifyHookStage(FluidSimHookId id, FluidSimHookStage newWhen)
 	return true;
 }
 
+bool FluidSim::modifyHookDiagnostics(FluidSimHookId id, FluidSimDiagnostics diagnostics)
+{
+	if (_hooks.find(id) == _hooks.end())
+		return false;
+
+	_hookDiagnostics[id] = diagnostics;
+
+	return true;
+}
+
 void FluidSim::unregisterHook(FluidSimHookId id)
 {
 	_hooks.erase(id);
+	_hookDiagnostics.erase(id);
+}
+
+void FluidSim::selectBricks(ShaderProgram& program, bool sparse)
+{
+	Context& context = Context::get();
+
+	program.uniform("uSparseBricks", sparse);
+	if (sparse)
+	{
+		context.bind(_activityStep->activeBricksBuffer, IndexedBufferTarget::ShaderStorage, activeBricksBinding);
+		context.bind(_activityStep->dispatchBuffer, BufferTarget::DispatchIndirect);
+	}
+	else
+		context.bind(_entryPointIndirectDispatchBuffer, BufferTarget::DispatchIndirect);
+}
+
+int FluidSim::getActiveBricks() const
+{
+	return _activityStep->numActiveBricks;
+}
+
+FluidSimDiagnostics FluidSim::requestedDiagnostics() const
+{
+	FluidSimDiagnostics diagnostics = viewerDiagnostics;
+	for (auto& pair : _hookDiagnostics)
+		if (_hooks.at(pair.first).second != FluidSimHookStage::Never)
+			diagnostics = diagnostics | pair.second;
+	return diagnostics;
 }
 
 void FluidSim::applyForces(FluidState& fluidState, FluidSimMouseClickImpulse& impulse, bool velocityOnly, float dt)
 {
-	Context::get().bind(_entryPointIndirectDispatchBuffer, BufferTarget::DispatchIndirect);
-	_forcesStep->compute(fluidState, impulse, dt, velocityOnly);
+	applyForces(fluidState, std::vector<FluidSimMouseClickImpulse>{ impulse }, velocityOnly, dt);
+}
+
+void FluidSim::applyForces(FluidState& fluidState, const std::vector<FluidSimMouseClickImpulse>& impulses, bool velocityOnly, float dt)
+{
+	GPUProfiler::Scope scope("Forces");
+	Context::get().bind(fluidState.gridRingBuffer, IndexedBufferTarget::Uniform, gridRingBinding);
+	_forcesStep->compute(fluidState, impulses, dt, velocityOnly);
+}
+
+void FluidSim::unwrapInk(FluidState& fluidState, GPUInkField& out)
+{
+	GPUProfiler::Scope scope("Unwrap ink");
+	Context& context = Context::get();
+	context.bind(_entryPointIndirectDispatchBuffer, BufferTarget::DispatchIndirect);
+	context.bind(fluidState.gridRingBuffer, IndexedBufferTarget::Uniform, gridRingBinding);
+	_unwrapStep->compute(fluidState.inkDensity.getInput(), out);
 }
 
 void FluidSim::scrollGrid(FluidState& fluidState, Empty::math::ivec3 scroll)
 {
-	Context::get().bind(_entryPointIndirectDispatchBuffer, BufferTarget::DispatchIndirect);
+	GPUProfiler::Scope scope("Grid scroll");
 	_gridScrollStep->compute(fluidState, scroll);
 }
 
 void FluidSim::advance(FluidState& fluidState, float dt)
+{
+	_lastSubsteps = 1;
+	if (adaptiveTimeStep)
+	{
+		// Smallest number of substeps keeping the last known velocity under cflNumber cells per substep
+		float cells = _maxVelocityStep->maxVelocity * dt / fluidState.grid.cellSize;
+		_lastSubsteps = std::clamp(static_cast<int>(std::ceil(cells / cflNumber)), 1, std::max(maxSubsteps, 1));
+	}
+
+	float substepDt = dt / _lastSubsteps;
+	for (int i = 0; i < _lastSubsteps; i++)
+	{
+		GPUProfiler::Scope scope("Step");
+		step(fluidState, substepDt);
+	}
+
+	if (adaptiveTimeStep)
+	{
+		GPUProfiler::Scope scope("Max velocity");
+		Context::get().bind(_entryPointIndirectDispatchBuffer, BufferTarget::DispatchIndirect);
+		_maxVelocityStep->compute(fluidState, *_jacobiResidualReducer);
+	}
+}
+
+float FluidSim::getMaxVelocity() const
+{
+	return _maxVelocityStep->maxVelocity;
+}
+
+FluidSimStats FluidSim::getStats() const
+{
+	FluidSimStats stats;
+	stats.pressureSolveReport = _pressureSolveReport;
+	stats.activeBricks = getActiveBricks();
+	stats.lastSubsteps = _lastSubsteps;
+	stats.maxVelocity = getMaxVelocity();
+	return stats;
+}
+
+void FluidSim::step(FluidState& fluidState, float dt)
 {
 	Context& context = Context::get();
 
 	context.bind(_entryPointIndirectDispatchBuffer, BufferTarget::DispatchIndirect);
+	context.bind(fluidState.gridRingBuffer, IndexedBufferTarget::Uniform, gridRingBinding);
 
 	for (auto& pair : _hooks)
 		if (pair.second.second == FluidSimHookStage::Start)
 			pair.second.first(fluidState, dt);
 
+	if (sparseBricks)
+	{
+		GPUProfiler::Scope scope("Brick activity");
+		context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+		_activityStep->compute(fluidState, brickActivityThreshold, _diffusionStep->jacobi.getWorkingField());
+		context.bind(_entryPointIndirectDispatchBuffer, BufferTarget::DispatchIndirect);
+	}
+
 	if (runAdvection)
 	{
+		GPUProfiler::Scope scope("Advection");
 		context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
-		_advectionStep->compute(fluidState, dt);
+		selectBricks(_advectionStep->advectionProgram, sparseBricks);
+		_advectionStep->compute(fluidState, dt, fusedAdvection, advectionInterpolation);
+		selectBricks(_advectionStep->advectionProgram, false);
 	}
 
 	for (auto& pair : _hooks)
@@ -562,8 +2119,24 @@ void FluidSim::advance(FluidState& fluidState, float dt)
 
 	if (runDiffusion)
 	{
+		GPUProfiler::Scope scope("Diffusion");
 		context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
-		_diffusionStep->compute(_jacobiProgram, fluidState, dt, diffusionJacobiSteps);
+		if (diffusionSolver == DiffusionSolver::ADI)
+			_diffusionStep->computeADI(fluidState, dt);
+		else
+		{
+			selectBricks(_jacobiProgram, sparseBricks);
+			selectBricks(_blockedJacobiProgram, sparseBricks);
+			_jacobiResidualReducer->activeBrickDispatchBuffer = sparseBricks ? &_activityStep->dispatchBuffer : nullptr;
+
+			_diffusionStep->compute(_jacobiProgram, _blockedJacobiProgram, *_jacobiResidualReducer, fluidState, dt, diffusionJacobiSteps,
+				diffusionJacobiTolerance, relaxationScheme, diffusionSORRelaxation, jacobiIterationsPerDispatch);
+
+			// The pressure solves share the programs
+			_jacobiResidualReducer->activeBrickDispatchBuffer = nullptr;
+			selectBricks(_blockedJacobiProgram, false);
+			selectBricks(_jacobiProgram, false);
+		}
 	}
 
 	for (auto& pair : _hooks)
@@ -572,6 +2145,7 @@ void FluidSim::advance(FluidState& fluidState, float dt)
 
 	if (runDivergence)
 	{
+		GPUProfiler::Scope scope("Divergence");
 		context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
 		_divergenceStep->compute(fluidState, fluidState.divergenceTex);
 	}
@@ -582,23 +2156,53 @@ void FluidSim::advance(FluidState& fluidState, float dt)
 
 	if (runPressure)
 	{
+		GPUProfiler::Scope scope("Pressure");
 		context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
-		_pressureStep->compute(_jacobiProgram, fluidState, pressureJacobiSteps, reuseLastPressure);
+		switch (pressureSolver)
+		{
+		case PressureSolver::Jacobi:
+			_pressureStep->compute(_jacobiProgram, _blockedJacobiProgram, *_jacobiResidualReducer, fluidState, pressureJacobiSteps,
+				pressureJacobiTolerance, relaxationScheme, pressureSORRelaxation, jacobiIterationsPerDispatch, reuseLastPressure,
+				_pressureSolveReport);
+			break;
+		case PressureSolver::Multigrid:
+			_multigridPressureStep->compute(_jacobiProgram, _entryPointIndirectDispatchBuffer, fluidState,
+				multigridCycles, multigridSmoothingSteps, multigridCycle, reuseLastPressure);
+			break;
+		case PressureSolver::ConjugateGradient:
+			_conjugateGradientPressureStep->compute(fluidState, pcgMaxIterations, pcgTolerance, pcgPreconditioner, reuseLastPressure,
+				_pressureSolveReport);
+			break;
+		case PressureSolver::PoissonFilter:
+			_poissonFilterPressureStep->compute(fluidState, poissonFilterIterations, poissonFilterRank, reuseLastPressure);
+			break;
+		}
 	}
 
 	for (auto& pair : _hooks)
 		if (pair.second.second == FluidSimHookStage::AfterPressure)
 			pair.second.first(fluidState, dt);
 
+	// Re-compute divergence to check that it is in fact 0, if anyone is looking
+	bool checkDivergence = hasDiagnostic(requestedDiagnostics(), FluidSimDiagnostics::DivergenceCheck);
+
 	if (runProjection)
 	{
+		GPUProfiler::Scope scope("Projection");
 		context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
-		_projectionStep->compute(fluidState);
+		// The fused check only covers the active bricks, the others would keep the check of whichever step last covered them
+		if (checkDivergence && sparseBricks)
+			fluidState.divergenceCheckTex.template clearLevel<DataFormat::Red, DataType::Float>(0);
+		selectBricks(_projectionStep->projectionProgram, sparseBricks);
+		_projectionStep->compute(fluidState, checkDivergence ? &fluidState.divergenceCheckTex : nullptr);
+		selectBricks(_projectionStep->projectionProgram, false);
+	}
+	else if (checkDivergence)
+	{
+		GPUProfiler::Scope scope("Divergence check");
+		context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
+		_divergenceStep->compute(fluidState, fluidState.divergenceCheckTex);
 	}
-
-	// Re-compute divergence to check that it is in fact 0
-	context.memoryBarrier(MemoryBarrierType::ShaderImageAccess);
-	_divergenceStep->compute(fluidState, fluidState.divergenceCheckTex);
 
 	for (auto& pair : _hooks)
 		if (pair.second.second == FluidSimHookStage::AfterProjection)
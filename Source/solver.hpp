@@ -1,8 +1,10 @@
 #pragma once
 
 #include <functional>
+#include <memory>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include <Empty/gl/Buffer.h>
 #include <Empty/gl/Shader.h>
@@ -27,54 +29,252 @@ enum struct FluidSimHookStage : int
 	Never,
 };
 
+// Fields the sim only computes for someone to look at
+enum struct FluidSimDiagnostics : unsigned int
+{
+	None = 0,
+	// Divergence left after projection, in FluidState::divergenceCheckTex
+	DivergenceCheck = 1 << 0,
+};
+
+inline FluidSimDiagnostics operator|(FluidSimDiagnostics a, FluidSimDiagnostics b)
+{
+	return static_cast<FluidSimDiagnostics>(static_cast<unsigned int>(a) | static_cast<unsigned int>(b));
+}
+
+inline bool hasDiagnostic(FluidSimDiagnostics diagnostics, FluidSimDiagnostics which)
+{
+	return (static_cast<unsigned int>(diagnostics) & static_cast<unsigned int>(which)) != 0;
+}
+
+enum struct DiffusionSolver : int
+{
+	Jacobi,
+	// Alternating direction implicit : one tridiagonal solve per grid line along each axis
+	ADI,
+};
+
+enum struct PressureSolver : int
+{
+	Jacobi,
+	Multigrid,
+	ConjugateGradient,
+	PoissonFilter,
+};
+
+enum struct PCGPreconditioner : int
+{
+	Jacobi,
+	IncompletePoisson,
+};
+
+// How Jacobi solves update their field
+enum struct RelaxationScheme : int
+{
+	// Ping-pongs between the output field and a working field
+	Jacobi,
+	// Updates the output field in place, one color of a checkerboard at a time
+	RedBlackSOR,
+	// Jacobi with Chebyshev semi-iterative acceleration, same cost per iteration
+	Chebyshev,
+};
+
+// How advection interpolates the fields at the end of backtraces
+enum struct AdvectionInterpolation : int
+{
+	// Fedkiw, Stam and Jensen's monotonic tricubic, over 64 texel fetches
+	MonotonicCubic,
+	// Cubic B-spline over 8 trilinear fetches. Smoother, and may overshoot where fields are sharp.
+	BSpline,
+	// B-spline clamped to the 8 texels around the sample, which are also fetched
+	ClampedBSpline,
+};
+
+enum struct ResidualNorm : int
+{
+	L2,
+	LInfinity,
+};
+
+// Lets a Jacobi solve stop before its iteration count once its residual is small enough.
+// The residual is read back without stalling, so iterations stop a few checks late.
+struct JacobiTolerance
+{
+	// 0 always runs all iterations
+	float tolerance = 0.f;
+	// The residual is computed during one iteration out of checkInterval
+	int checkInterval = 8;
+	ResidualNorm norm = ResidualNorm::L2;
+};
+
+// Outcome of the last pressure solve that reports one. GPU results arrive a frame or two late.
+struct PressureSolveReport
+{
+	int iterations = 0;
+	// Divergence the pressure leaves unaccounted for. Root mean square, except for Jacobi solves
+	// checking the L-infinity norm which report its maximum.
+	float residual = 0.f;
+};
+
+// Number of times each coarse level is visited per visit of the finer level
+enum struct MultigridCycle : int
+{
+	V = 1,
+	W = 2,
+};
+
+// What FluidSim does on each step, which can be copied around and changed at any time between steps
+struct FluidSimSettings
+{
+	// Maximum counts when the matching tolerance is enabled
+	int diffusionJacobiSteps = 100;
+	int pressureJacobiSteps = 100;
+	JacobiTolerance diffusionJacobiTolerance;
+	JacobiTolerance pressureJacobiTolerance;
+	RelaxationScheme relaxationScheme = RelaxationScheme::Jacobi;
+	// Over-relaxation factors for red-black SOR, in ]0, 2[
+	float diffusionSORRelaxation = 1.2f;
+	float pressureSORRelaxation = 1.8f;
+	bool reuseLastPressure = true;
+	// Temporal blocking : Jacobi solves run this many iterations per dispatch in shared memory.
+	// Plain Jacobi relaxation only, capped at 4 for pressure and 2 for velocity.
+	int jacobiIterationsPerDispatch = 1;
+
+	DiffusionSolver diffusionSolver = DiffusionSolver::Jacobi;
+	PressureSolver pressureSolver = PressureSolver::Jacobi;
+	MultigridCycle multigridCycle = MultigridCycle::V;
+	int multigridCycles = 2;
+	int multigridSmoothingSteps = 2;
+
+	PCGPreconditioner pcgPreconditioner = PCGPreconditioner::IncompletePoisson;
+	int pcgMaxIterations = 50;
+	float pcgTolerance = 1e-3f;
+
+	// Number of Jacobi iterations the filters stand for, and number of separable terms
+	int poissonFilterIterations = 100;
+	int poissonFilterRank = 4;
+
+	// Advects all fields in a single dispatch sharing one backtrace per cell
+	bool fusedAdvection = true;
+	AdvectionInterpolation advectionInterpolation = AdvectionInterpolation::MonotonicCubic;
+
+	// Advection, Jacobi diffusion and projection only run on the 8^3 bricks holding velocity or ink
+	// above brickActivityThreshold, and the bricks around them. The other bricks are treated as still
+	// and empty, and cleared when they leave the list. Everything else still covers the whole grid.
+	bool sparseBricks = false;
+	float brickActivityThreshold = 1e-4f;
+
+	// Diagnostics read outside of hooks, after advance returns
+	FluidSimDiagnostics viewerDiagnostics = FluidSimDiagnostics::None;
+
+	bool runAdvection = true;
+	bool runDiffusion = true;
+	bool runDivergence = true;
+	bool runPressure = true;
+	bool runProjection = true;
+
+	// Splits advance's time step into the fewest substeps moving the fastest velocity at most
+	// cflNumber cells each, up to maxSubsteps. The velocity is measured a frame or two late.
+	bool adaptiveTimeStep = false;
+	float cflNumber = 1.f;
+	int maxSubsteps = 4;
+};
+
+// What FluidSim measured on its last steps, see its getters
+struct FluidSimStats
+{
+	PressureSolveReport pressureSolveReport;
+	int activeBricks = -1;
+	int lastSubsteps = 1;
+	float maxVelocity = 0.f;
+};
+
+struct JacobiResidualReducer;
+
 using FluidSimHook = std::function<void(FluidState& fluidState, float dt)>;
 using FluidSimHookId = uint64_t;
 
-struct FluidSim
+struct FluidSim : FluidSimSettings
 {
 	FluidSim(Empty::math::uvec3 gridSize);
 	~FluidSim();
 
-	FluidSimHookId registerHook(FluidSimHook hook, FluidSimHookStage when);
+	// Diagnostics are only computed while a hook that reads them is registered at a stage other than Never
+	FluidSimHookId registerHook(FluidSimHook hook, FluidSimHookStage when, FluidSimDiagnostics diagnostics = FluidSimDiagnostics::None);
 	bool modifyHookStage(FluidSimHookId, FluidSimHookStage newWhen);
+	bool modifyHookDiagnostics(FluidSimHookId, FluidSimDiagnostics diagnostics);
 	void unregisterHook(FluidSimHookId);
 
 	void applyForces(FluidState& fluidState, FluidSimMouseClickImpulse& impulse, bool velocityOnly, float dt);
+	// Applies all impulses at once, only covering the bricks they reach
+	void applyForces(FluidState& fluidState, const std::vector<FluidSimMouseClickImpulse>& impulses, bool velocityOnly, float dt);
+	// Only moves the ring buffer origin of the fields, see FluidState::gridOrigin
 	void scrollGrid(FluidState& fluidState, Empty::math::ivec3 scroll);
+	// Copies the ink field to out as if the grid had never scrolled, so it draws with a grid origin of 0
+	void unwrapInk(FluidState& fluidState, GPUInkField& out);
+	// Runs as many substeps as adaptiveTimeStep asks for
 	void advance(FluidState& fluidState, float dt);
 
-	int diffusionJacobiSteps;
-	int pressureJacobiSteps;
-	bool reuseLastPressure;
-
-	bool runAdvection;
-	bool runDiffusion;
-	bool runDivergence;
-	bool runPressure;
-	bool runProjection;
+	const PressureSolveReport& getPressureSolveReport() const { return _pressureSolveReport; }
+	// Number of active bricks a few frames ago, -1 until known
+	int getActiveBricks() const;
+	int getLastSubsteps() const { return _lastSubsteps; }
+	// In m/s, as of the last measure, only measured with adaptiveTimeStep
+	float getMaxVelocity() const;
+	FluidSimStats getStats() const;
 
 private:
+	FluidSimDiagnostics requestedDiagnostics() const;
+	void step(FluidState& fluidState, float dt);
+	// Dispatches of program cover the active bricks when sparse, the whole grid otherwise
+	void selectBricks(Empty::gl::ShaderProgram& program, bool sparse);
+
 	std::unordered_map<FluidSimHookId, std::pair<FluidSimHook, FluidSimHookStage>> _hooks;
+	std::unordered_map<FluidSimHookId, FluidSimDiagnostics> _hookDiagnostics;
 	FluidSimHookId _nextHookId;
 
 	Empty::gl::Shader _entryPointShader;
+	Empty::gl::Shader _reductionShader;
+	Empty::gl::Shader _bricksShader;
+	Empty::gl::Shader _ringShader;
 	Empty::gl::ShaderProgram _jacobiProgram;
+	Empty::gl::ShaderProgram _blockedJacobiProgram;
 
 	Empty::gl::Buffer _entryPointIndirectDispatchBuffer;
 
+	std::unique_ptr<JacobiResidualReducer> _jacobiResidualReducer;
+
+	struct ActivityStep;
 	struct GridScrollStep;
 	struct AdvectionStep;
 	struct DiffusionStep;
 	struct ForcesStep;
 	struct DivergenceStep;
 	struct PressureStep;
+	struct MultigridPressureStep;
+	struct ConjugateGradientPressureStep;
+	struct PoissonFilterPressureStep;
 	struct ProjectionStep;
+	struct MaxVelocityStep;
+	struct UnwrapStep;
 
+	std::unique_ptr<ActivityStep> _activityStep;
 	std::unique_ptr<GridScrollStep> _gridScrollStep;
 	std::unique_ptr<AdvectionStep> _advectionStep;
 	std::unique_ptr<DiffusionStep> _diffusionStep;
 	std::unique_ptr<ForcesStep> _forcesStep;
 	std::unique_ptr<DivergenceStep> _divergenceStep;
 	std::unique_ptr<PressureStep> _pressureStep;
+	std::unique_ptr<MultigridPressureStep> _multigridPressureStep;
+	std::unique_ptr<ConjugateGradientPressureStep> _conjugateGradientPressureStep;
+	std::unique_ptr<PoissonFilterPressureStep> _poissonFilterPressureStep;
+
+	PressureSolveReport _pressureSolveReport;
 	std::unique_ptr<ProjectionStep> _projectionStep;
+	std::unique_ptr<MaxVelocityStep> _maxVelocityStep;
+	std::unique_ptr<UnwrapStep> _unwrapStep;
+	int _lastSubsteps;
 };
+
+// Work on a sim and its state, run by whichever thread steps them
+using FluidSimCommand = std::function<void(FluidSim& fluidSim, FluidState& fluidState)>;
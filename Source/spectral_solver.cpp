@@ -0,0 +1,387 @@
+#include "spectral_solver.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+using Complex = std::complex<double>;
+
+constexpr double pi = 3.14159265358979323846;
+
+// Lines along Y and Z are gathered by groups of that many neighbouring X coordinates
+constexpr int spectralBlockSize = 16;
+
+// *************************
+// Complex FFT of any length
+// *************************
+
+namespace
+{
+	// Unnormalized forward DFT, in place, for power of two sizes
+	struct Radix2FFT
+	{
+		void init(int n)
+		{
+			size = n;
+			int bits = 0;
+			while ((1 << bits) < n)
+				bits++;
+
+			bitReverse.resize(n);
+			for (int i = 0; i < n; i++)
+			{
+				int reversed = 0;
+				for (int b = 0; b < bits; b++)
+					reversed |= ((i >> b) & 1) << (bits - 1 - b);
+				bitReverse[i] = reversed;
+			}
+
+			twiddles.resize(n / 2);
+			for (int k = 0; k < n / 2; k++)
+				twiddles[k] = std::polar(1., -2. * pi * k / n);
+		}
+
+		void transform(Complex* data) const
+		{
+			for (int i = 0; i < size; i++)
+				if (i < bitReverse[i])
+					std::swap(data[i], data[bitReverse[i]]);
+
+			for (int length = 2; length <= size; length <<= 1)
+			{
+				int half = length / 2, stride = size / length;
+				for (int start = 0; start < size; start += length)
+					for (int k = 0; k < half; k++)
+					{
+						Complex odd = data[start + k + half] * twiddles[k * stride];
+						data[start + k + half] = data[start + k] - odd;
+						data[start + k] += odd;
+					}
+			}
+		}
+
+		int size = 0;
+		std::vector<int> bitReverse;
+		std::vector<Complex> twiddles;
+	};
+
+	// Unnormalized forward DFT, in place. Other sizes than powers of two go through
+	// Bluestein's algorithm, which turns the DFT into a power of two convolution.
+	struct FFT
+	{
+		void init(int n)
+		{
+			size = n;
+			bluestein = (n & (n - 1)) != 0;
+			if (!bluestein)
+			{
+				radix2.init(n);
+				return;
+			}
+
+			int convolutionSize = 1;
+			while (convolutionSize < 2 * n - 1)
+				convolutionSize <<= 1;
+			radix2.init(convolutionSize);
+
+			// w(k) = exp(-i pi k^2 / n), with k^2 taken modulo 2n to keep the angles accurate
+			chirp.resize(n);
+			for (int k = 0; k < n; k++)
+			{
+				long long k2 = (static_cast<long long>(k) * k) % (2ll * n);
+				chirp[k] = std::polar(1., -pi * static_cast<double>(k2) / n);
+			}
+
+			// Spectrum of conj(w(k)) wrapped around
+			chirpSpectrum.assign(convolutionSize, Complex(0.));
+			chirpSpectrum[0] = std::conj(chirp[0]);
+			for (int k = 1; k < n; k++)
+				chirpSpectrum[k] = chirpSpectrum[convolutionSize - k] = std::conj(chirp[k]);
+			radix2.transform(chirpSpectrum.data());
+		}
+
+		size_t scratchSize() const { return bluestein ? radix2.size : 0; }
+
+		void transform(Complex* data, Complex* scratch) const
+		{
+			if (!bluestein)
+			{
+				radix2.transform(data);
+				return;
+			}
+
+			// X(k) = w(k) * sum of x(j) w(j) conj(w(k - j))
+			int convolutionSize = radix2.size;
+			for (int j = 0; j < size; j++)
+				scratch[j] = data[j] * chirp[j];
+			std::fill(scratch + size, scratch + convolutionSize, Complex(0.));
+
+			radix2.transform(scratch);
+			for (int k = 0; k < convolutionSize; k++)
+				scratch[k] = std::conj(scratch[k] * chirpSpectrum[k]);
+			// Inverse transform as the conjugate of the forward transform of the conjugate
+			radix2.transform(scratch);
+
+			double oneOverSize = 1. / convolutionSize;
+			for (int k = 0; k < size; k++)
+				data[k] = std::conj(scratch[k]) * oneOverSize * chirp[k];
+		}
+
+		int size = 0;
+		bool bluestein = false;
+		Radix2FFT radix2;
+		std::vector<Complex> chirp;
+		std::vector<Complex> chirpSpectrum;
+	};
+}
+
+// **********************************************
+// Real transforms diagonalizing the 1D laplacian
+// **********************************************
+
+// DST-I for zero boundaries, going through the DFT of the odd extension of the line,
+// DCT-II for Neumann boundaries, going through the DFT of its even extension.
+// Extensions are real, so their DFT of length 2h is computed with a complex DFT of length h.
+struct SpectralPoissonSolver::Plan
+{
+	Plan(int length, SpectralBoundary boundary)
+		: length(length)
+		, boundary(boundary)
+		, extendedLength(boundary == SpectralBoundary::Zero ? 2 * (length + 1) : 2 * length)
+		, fft()
+		, twiddles(extendedLength / 2)
+		, eigenvalues(length)
+		, shifts()
+	{
+		int half = extendedLength / 2;
+		fft.init(half);
+		for (int k = 0; k < half; k++)
+			twiddles[k] = std::polar(1., -2. * pi * k / extendedLength);
+
+		if (boundary == SpectralBoundary::Zero)
+		{
+			// Eigenvalues of the sum of both neighbours along the axis
+			for (int k = 0; k < length; k++)
+				eigenvalues[k] = 2. * std::cos(pi * (k + 1) / (length + 1));
+		}
+		else
+		{
+			shifts.resize(length);
+			for (int k = 0; k < length; k++)
+			{
+				eigenvalues[k] = 2. * std::cos(pi * k / length);
+				shifts[k] = std::polar(1., pi * k / (2. * length));
+			}
+		}
+	}
+
+	size_t scratchSize() const { return extendedLength / 2 + fft.scratchSize(); }
+
+	void forward(double* line, Complex* scratch) const
+	{
+		Complex* packed = scratch;
+		Complex* fftScratch = scratch + extendedLength / 2;
+		int n = length, half = extendedLength / 2;
+
+		// Zero : [0, x, 0, -reversed x], whose DFT is -2i times the DST-I of x
+		// Neumann : [x, reversed x], whose DFT is 2 exp(i pi k / 2n) times the DCT-II of x
+		auto extended = [this, line, n](int m)
+			{
+				if (boundary == SpectralBoundary::Neumann)
+					return m < n ? line[m] : line[extendedLength - 1 - m];
+				if (m == 0 || m == n + 1)
+					return 0.;
+				return m <= n ? line[m - 1] : -line[extendedLength - 1 - m];
+			};
+
+		// Even samples in the real part, odd samples in the imaginary part
+		for (int j = 0; j < half; j++)
+			packed[j] = Complex(extended(2 * j), extended(2 * j + 1));
+		fft.transform(packed, fftScratch);
+
+		// DFT of the extension from the DFTs of its even and odd samples
+		auto extendedSpectrum = [packed, half, this](int k)
+			{
+				Complex a = packed[k], b = std::conj(packed[(half - k) % half]);
+				return 0.5 * (a + b) + twiddles[k] * (a - b) * Complex(0., -0.5);
+			};
+
+		if (boundary == SpectralBoundary::Zero)
+		{
+			for (int k = 0; k < n; k++)
+				line[k] = -0.5 * extendedSpectrum(k + 1).imag();
+		}
+		else
+		{
+			for (int k = 0; k < n; k++)
+				line[k] = 0.5 * (extendedSpectrum(k) * std::conj(shifts[k])).real();
+		}
+	}
+
+	// Exact inverse of forward, rebuilding the DFT of the extended line and transforming it back
+	void inverse(double* line, Complex* scratch) const
+	{
+		Complex* packed = scratch;
+		Complex* fftScratch = scratch + extendedLength / 2;
+		int n = length, half = extendedLength / 2;
+
+		auto extendedSpectrum = [this, line, n](int k)
+			{
+				if (boundary == SpectralBoundary::Zero)
+				{
+					if (k == 0 || k == n + 1)
+						return Complex(0.);
+					return k <= n ? Complex(0., -2. * line[k - 1]) : Complex(0., 2. * line[extendedLength - 1 - k]);
+				}
+				if (k == n)
+					return Complex(0.);
+				return k < n ? 2. * line[k] * shifts[k] : std::conj(2. * line[extendedLength - k] * shifts[extendedLength - k]);
+			};
+
+		// DFTs of the even and odd samples, packed the same way as in forward
+		for (int k = 0; k < half; k++)
+		{
+			Complex a = extendedSpectrum(k), b = extendedSpectrum(k + half);
+			Complex even = 0.5 * (a + b), odd = 0.5 * (a - b) * std::conj(twiddles[k]);
+			// Inverse DFT as the conjugate of the forward DFT of the conjugate
+			packed[k] = std::conj(even + Complex(0., 1.) * odd);
+		}
+		fft.transform(packed, fftScratch);
+
+		double oneOverHalf = 1. / half;
+		int offset = boundary == SpectralBoundary::Zero ? 1 : 0;
+		for (int j = 0; j < n; j++)
+		{
+			int m = j + offset;
+			Complex sample = std::conj(packed[m / 2]) * oneOverHalf;
+			line[j] = (m & 1) ? sample.imag() : sample.real();
+		}
+	}
+
+	int length;
+	SpectralBoundary boundary;
+	int extendedLength;
+	FFT fft;
+	// exp(-2i pi k / extendedLength)
+	std::vector<Complex> twiddles;
+	std::vector<double> eigenvalues;
+	// exp(i pi k / 2n), for the DCT-II only
+	std::vector<Complex> shifts;
+};
+
+// ***************************
+// Spectral solver entry point
+// ***************************
+
+SpectralPoissonSolver::SpectralPoissonSolver(ThreadPool& threadPool)
+	: _threadPool(threadPool)
+	, _plans()
+	, _spectrum()
+{ }
+
+SpectralPoissonSolver::~SpectralPoissonSolver() = default;
+
+const SpectralPoissonSolver::Plan& SpectralPoissonSolver::getPlan(int length, SpectralBoundary boundary)
+{
+	auto& plan = _plans[std::make_pair(length, boundary)];
+	if (!plan)
+		plan = std::make_unique<Plan>(length, boundary);
+	return *plan;
+}
+
+void SpectralPoissonSolver::transformAxis(Empty::math::uvec3 size, int axis, const Plan& plan, bool forward)
+{
+	const int sx = size.x, sy = size.y, sz = size.z;
+	const size_t strideY = sx, strideZ = static_cast<size_t>(sx) * sy;
+	double* data = _spectrum.data();
+
+	auto transformLine = [&plan, forward](double* line, Complex* scratch)
+		{
+			if (forward)
+				plan.forward(line, scratch);
+			else
+				plan.inverse(line, scratch);
+		};
+
+	if (axis == 0)
+	{
+		// Lines are contiguous already
+		_threadPool.parallelFor(sy * sz, [&](int begin, int end)
+			{
+				std::vector<Complex> scratch(plan.scratchSize());
+				for (int line = begin; line < end; line++)
+					transformLine(data + line * strideY, scratch.data());
+			});
+		return;
+	}
+
+	// Lines along Y or Z, gathered by blocks of neighbouring X coordinates
+	const int length = axis == 1 ? sy : sz;
+	const int other = axis == 1 ? sz : sy;
+	const size_t lineStride = axis == 1 ? strideY : strideZ;
+	const size_t otherStride = axis == 1 ? strideZ : strideY;
+	const int numBlocks = (sx + spectralBlockSize - 1) / spectralBlockSize;
+
+	_threadPool.parallelFor(numBlocks * other, [&](int begin, int end)
+		{
+			std::vector<Complex> scratch(plan.scratchSize());
+			std::vector<double> block(static_cast<size_t>(spectralBlockSize) * length);
+
+			for (int item = begin; item < end; item++)
+			{
+				int x0 = (item % numBlocks) * spectralBlockSize;
+				int width = std::min(spectralBlockSize, sx - x0);
+				double* base = data + x0 + (item / numBlocks) * otherStride;
+
+				for (int i = 0; i < length; i++)
+					for (int b = 0; b < width; b++)
+						block[b * length + i] = base[i * lineStride + b];
+
+				for (int b = 0; b < width; b++)
+					transformLine(block.data() + b * length, scratch.data());
+
+				for (int i = 0; i < length; i++)
+					for (int b = 0; b < width; b++)
+						base[i * lineStride + b] = block[b * length + i];
+			}
+		});
+}
+
+void SpectralPoissonSolver::solve(const CPUScalarField& source, CPUScalarField& solution, float alpha, float beta, SpectralBoundary boundary)
+{
+	const Empty::math::uvec3 size = source.size;
+	assert(solution.size.x == size.x && solution.size.y == size.y && solution.size.z == size.z);
+
+	const Plan& planX = getPlan(size.x, boundary);
+	const Plan& planY = getPlan(size.y, boundary);
+	const Plan& planZ = getPlan(size.z, boundary);
+
+	_spectrum.assign(source.data.begin(), source.data.end());
+
+	transformAxis(size, 0, planX, true);
+	transformAxis(size, 1, planY, true);
+	transformAxis(size, 2, planZ, true);
+
+	// The stencil is diagonal in that basis
+	_threadPool.parallelFor(size.z, [&](int zBegin, int zEnd)
+		{
+			for (int z = zBegin; z < zEnd; z++)
+				for (int y = 0; y < (int)size.y; y++)
+				{
+					double* line = _spectrum.data() + source.index(0, y, z);
+					double eigenvalueYZ = planY.eigenvalues[y] + planZ.eigenvalues[z];
+					for (int x = 0; x < (int)size.x; x++)
+					{
+						double denominator = beta - planX.eigenvalues[x] - eigenvalueYZ;
+						// Only the constant mode of a pure Neumann problem, which we want at 0
+						line[x] = std::abs(denominator) > 1e-9 * beta ? alpha * line[x] / denominator : 0.;
+					}
+				}
+		});
+
+	transformAxis(size, 0, planX, false);
+	transformAxis(size, 1, planY, false);
+	transformAxis(size, 2, planZ, false);
+
+	std::transform(_spectrum.begin(), _spectrum.end(), solution.data.begin(), [](double value) { return static_cast<float>(value); });
+}
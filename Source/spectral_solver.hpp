@@ -0,0 +1,50 @@
+#pragma once
+
+#include <complex>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "cpu_fields.hpp"
+#include "thread_pool.hpp"
+
+// ***********************************************************
+// Direct Poisson solver for box domains using fast transforms
+// ***********************************************************
+
+enum struct SpectralBoundary : int
+{
+	// Field is 0 outside of the grid, like the Jacobi pressure solve. Diagonalized by the DST-I.
+	Zero,
+	// Field is extended by its boundary values, walls in the usual sense. Diagonalized by the DCT-II.
+	// Solutions are defined up to a constant, which is chosen to give them a zero mean.
+	Neumann,
+};
+
+// Solves beta * x - sum of neighbours of x = alpha * source exactly, for the same 7-point stencil as the
+// Jacobi solves, by transforming along each axis in O(N log N). Any grid size works. Transforms of a
+// given length are planned once and cached. Lines along Y and Z are transformed in blocks of neighbouring
+// lines so memory is still read contiguously.
+struct SpectralPoissonSolver
+{
+	explicit SpectralPoissonSolver(ThreadPool& threadPool);
+	~SpectralPoissonSolver();
+
+	SpectralPoissonSolver(const SpectralPoissonSolver&) = delete;
+	SpectralPoissonSolver& operator=(const SpectralPoissonSolver&) = delete;
+
+	void solve(const CPUScalarField& source, CPUScalarField& solution, float alpha, float beta, SpectralBoundary boundary);
+
+	struct Plan;
+
+private:
+	const Plan& getPlan(int length, SpectralBoundary boundary);
+	void transformAxis(Empty::math::uvec3 size, int axis, const Plan& plan, bool forward);
+
+	ThreadPool& _threadPool;
+	std::map<std::pair<int, SpectralBoundary>, std::unique_ptr<Plan>> _plans;
+
+	// Coefficients are kept in double precision between passes
+	std::vector<double> _spectrum;
+};
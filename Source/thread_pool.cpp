@@ -0,0 +1,94 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned int numThreads)
+	: _workers()
+	, _task(nullptr)
+	, _count(0)
+	, _generation(0)
+	, _pendingWorkers(0)
+	, _stop(false)
+{
+	if (numThreads == 0)
+		numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+	_workers.reserve(numThreads - 1);
+	for (unsigned int i = 1; i < numThreads; i++)
+		_workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+	_wakeCondition.notify_all();
+
+	for (auto& worker : _workers)
+		worker.join();
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int begin, int end)>& task)
+{
+	if (count <= 0)
+		return;
+
+	// Not worth waking anyone up
+	if (_workers.empty() || count == 1)
+	{
+		task(0, count);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_task = &task;
+		_count = count;
+		_pendingWorkers = static_cast<unsigned int>(_workers.size());
+		++_generation;
+	}
+	_wakeCondition.notify_all();
+
+	runChunk(0);
+
+	std::unique_lock<std::mutex> lock(_mutex);
+	_doneCondition.wait(lock, [this]() { return _pendingWorkers == 0; });
+	_task = nullptr;
+}
+
+void ThreadPool::workerLoop(unsigned int index)
+{
+	uint64_t seenGeneration = 0;
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_wakeCondition.wait(lock, [this, seenGeneration]() { return _stop || _generation != seenGeneration; });
+			if (_stop)
+				return;
+			seenGeneration = _generation;
+		}
+
+		runChunk(index);
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			--_pendingWorkers;
+		}
+		_doneCondition.notify_one();
+	}
+}
+
+void ThreadPool::runChunk(unsigned int index)
+{
+	// Static partitioning : grid passes have a uniform cost per slice
+	int numThreads = static_cast<int>(size());
+	int chunkSize = (_count + numThreads - 1) / numThreads;
+	int begin = std::min(_count, static_cast<int>(index) * chunkSize);
+	int end = std::min(_count, begin + chunkSize);
+	if (begin < end)
+		(*_task)(begin, end);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// *****************************************************
+// Fixed-size worker pool splitting loops across threads
+// *****************************************************
+
+struct ThreadPool
+{
+	// 0 means one thread per hardware core. The calling thread always takes part
+	// in the work, so a pool of size 1 doesn't spawn any worker.
+	explicit ThreadPool(unsigned int numThreads = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	unsigned int size() const { return static_cast<unsigned int>(_workers.size()) + 1; }
+
+	// Calls task(begin, end) on disjoint contiguous ranges covering [0, count),
+	// one per thread, and returns once all of them are done.
+	void parallelFor(int count, const std::function<void(int begin, int end)>& task);
+
+private:
+	void workerLoop(unsigned int index);
+	void runChunk(unsigned int index);
+
+	std::vector<std::thread> _workers;
+	std::mutex _mutex;
+	std::condition_variable _wakeCondition;
+	std::condition_variable _doneCondition;
+
+	const std::function<void(int, int)>* _task;
+	int _count;
+	uint64_t _generation;
+	unsigned int _pendingWorkers;
+	bool _stop;
+};
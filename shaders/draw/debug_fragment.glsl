@@ -1,9 +1,11 @@
 #version 450
 
-uniform sampler2DArray uTexture;
+uniform sampler3D uTexture;
 uniform usampler2DArray uIntTexture;
 
 uniform bool uUseIntTexture;
+// Component of uTexture to display
+uniform int uChannel;
 uniform float uColorScale;
 
 in vec3 vUV;
@@ -11,15 +13,12 @@ out vec4 fFragColor;
 
 vec4 colors[4] = { vec4(0., 0., 0., 1.), vec4(1., 1., 1., 1.), vec4(0., 1., 0., 1.), vec4(1., 0., 0., 1.) };
 
-float sampleTex(sampler2DArray tex, vec3 uv)
-{
-	vec3 size = textureSize(tex, 0);
-	uv.z = uv.z * size.z - 0.5;
-
-	float down = texture(tex, uv + vec3(0, 0, -0.5)).r;
-	float up = texture(tex, uv + vec3(0, 0, 0.5)).r;
+// Linked from ring.glsl, simulation fields are stored as ring buffers
+vec4 sampleRing(sampler3D tex, vec3 uv);
 
-	return mix(down, up, fract(uv.z));
+float sampleTex(sampler3D tex, vec3 uv)
+{
+	return sampleRing(tex, uv)[uChannel];
 }
 
 void main()
@@ -1,68 +1,114 @@
 #version 450
 
 #define RAY_SAMPLES 128
+// Must match ink_occupancy.glsl
+#define OCCUPANCY_BRICK_SIZE 8
+// Bricks adding less than this to the opacity are skipped
+#define EMPTY_BRICK_ALPHA (1. / 256.)
 
 uniform mat4 uCameraToFluidSim;
-uniform sampler2DArray uInkDensity;
+uniform sampler3D uInkDensity;
+// Largest density samples can see in each brick, see ink_occupancy.glsl
+uniform sampler3D uOccupancy;
 uniform vec3 uInkColor;
 uniform float uInkMultiplier;
 
+// Renders to a reduced resolution target instead, see FluidSimRenderParameters::resolutionDivisor
+uniform bool uLowResolution;
+// Fraction of a step the samples are offset by, jittered every frame when accumulating
+uniform float uRayOffset;
+// Blends with last frame's target, reprojected with the ink's depth
+uniform bool uTemporalAccumulation;
+uniform float uTemporalBlend;
+uniform mat4 uFluidSimToPreviousClip;
+uniform sampler2D uHistory;
+
 in vec4 vPosition;
 out vec4 fFragColor;
 
+// Linked from ring.glsl, simulation fields are stored as ring buffers
+vec4 sampleRing(sampler3D tex, vec3 uv);
+
 float sampleFluid(vec3 p)
 {
-    vec3 uv = p * 0.5 + 0.5;
-    
-    vec3 size = textureSize(uInkDensity, 0);
-	uv.z = uv.z * size.z - 0.5;
-
-	float down = texture(uInkDensity, uv + vec3(0, 0, -0.5)).r;
-	float up = texture(uInkDensity, uv + vec3(0, 0, 0.5)).r;
-
-	return mix(down, up, fract(uv.z));
+	return sampleRing(uInkDensity, p * 0.5 + 0.5).r;
 }
 
-// All calculations take place in fluid sim space, ie the
-// centered unit cube [-1; 1]. It then becomes easy to intersect
-// with it.
-
-// Adapted from https://iquilezles.org/articles/intersectors/
-// Intersection with centered unit cube
-float boxIntersection( in vec3 rayOrigin, in vec3 rayDirection) 
-{
-    vec3 m = 1.0/rayDirection;
-    vec3 n = m*rayOrigin;
-    vec3 k = abs(m)*2.; // boxSize = vec3(2.) for the centered unit cube
-    vec3 t1 = -n - k;
-    // vec3 t2 = -n + k;
-    float tN = max( max( t1.x, t1.y ), t1.z );
-    // float tF = min( min( t2.x, t2.y ), t2.z ); // tF comes for free in the form of vPosition
-    // if( tN>tF || tF<0.0) return -1.0; // in our case, there is always an intersection
-    return tN;
-}
+// Linked from fluid_ray.glsl
+vec3 rayEntry(vec3 rayOrigin, vec3 rayEnd);
 
 void main()
 {
 	vec3 rayOrigin = uCameraToFluidSim[3].xyz;
 	vec3 rayEnd = (uCameraToFluidSim * vPosition).xyz;
-    vec3 rayDirection = rayEnd - rayOrigin;
-    float t = boxIntersection(rayOrigin, rayDirection);
-    // t is negative if the entry point of the ray into the cube is behind the camera.
-    // In this case, just use the camera position.
-    vec3 intersectionStart = max(0., t) * rayDirection + rayOrigin;
+    vec3 intersectionStart = rayEntry(rayOrigin, rayEnd);
 
     float density = 0.;
+    // Density-weighted sum of the samples' distance to the camera
+    float depthSum = 0.;
     vec3 rayStep = (rayEnd - intersectionStart) / RAY_SAMPLES;
     float weight = length(rayStep);
     float weightsSum = distance(rayEnd, intersectionStart);
-    vec3 rayPosition = intersectionStart;
 
-    for (int i = 0; i < RAY_SAMPLES; i++)
+    // Position in bricks is (p + 1) * brickScale
+    vec3 brickScale = vec3(textureSize(uInkDensity, 0)) / (2. * OCCUPANCY_BRICK_SIZE);
+    ivec3 numBricks = textureSize(uOccupancy, 0);
+    vec3 brickStep = rayStep * brickScale;
+    // Steps to cross one brick along each axis, huge along the axes the ray doesn't move on
+    vec3 stepsPerBrick = 1. / max(abs(brickStep), vec3(1e-8));
+
+    int i = 0;
+    while (i < RAY_SAMPLES)
     {
-        density += sampleFluid(rayPosition) * weight;
-        rayPosition += rayStep;
+        vec3 rayPosition = intersectionStart + (i + uRayOffset) * rayStep;
+        vec3 brickPosition = (rayPosition + 1.) * brickScale;
+        ivec3 brick = clamp(ivec3(floor(brickPosition)), ivec3(0), numBricks - 1);
+
+        // Jump to the first sample past an empty brick, the samples in it would add next to nothing
+        if (uInkMultiplier * texelFetch(uOccupancy, brick, 0).r < EMPTY_BRICK_ALPHA)
+        {
+            vec3 toExit = mix(brickPosition - vec3(brick), vec3(brick + 1) - brickPosition, greaterThan(brickStep, vec3(0.)));
+            vec3 exitSteps = toExit * stepsPerBrick;
+            i += max(int(floor(min(min(exitSteps.x, exitSteps.y), exitSteps.z))) + 1, 1);
+            continue;
+        }
+
+        float sampleDensity = sampleFluid(rayPosition) * weight;
+        density += sampleDensity;
+        depthSum += sampleDensity * distance(rayPosition, rayOrigin);
+        // Opacity can only grow, and saturates here
+        if (uInkMultiplier * density >= weightsSum)
+            break;
+        i++;
+    }
+
+    float alpha = min(uInkMultiplier * density / weightsSum, 1.);
+
+    if (!uLowResolution)
+    {
+        fFragColor = vec4(uInkColor, alpha);
+        return;
+    }
+
+    // Opacity, depth guiding the upsample, depth of the ink and coverage, see fluid_upsample_fragment.glsl
+    float entryDepth = distance(intersectionStart, rayOrigin);
+    float inkDepth = density > 0. ? depthSum / density : entryDepth;
+
+    if (uTemporalAccumulation)
+    {
+        // Where the ink was seen from last frame's camera
+        vec3 inkPosition = rayOrigin + normalize(rayEnd - rayOrigin) * inkDepth;
+        vec4 previousClip = uFluidSimToPreviousClip * vec4(inkPosition, 1.);
+        vec2 previousUV = previousClip.xy / previousClip.w * 0.5 + 0.5;
+
+        if (previousClip.w > 0. && all(greaterThanEqual(previousUV, vec2(0.))) && all(lessThan(previousUV, vec2(1.))))
+        {
+            vec4 history = texelFetch(uHistory, ivec2(previousUV * textureSize(uHistory, 0)), 0);
+            // Texels outside of the cube last frame have no history
+            if (history.a > 0.)
+                alpha = mix(history.r, alpha, uTemporalBlend);
+        }
     }
 
-    fFragColor = vec4(uInkColor, uInkMultiplier * density / weightsSum);
+    fFragColor = vec4(alpha, entryDepth, inkDepth, 1.);
 }
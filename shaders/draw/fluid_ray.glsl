@@ -0,0 +1,31 @@
+#version 450
+
+// All calculations take place in fluid sim space, ie the
+// centered unit cube [-1; 1]^3. It then becomes easy to intersect
+// with it.
+
+// Adapted from https://iquilezles.org/articles/intersectors/
+// Intersection with centered unit cube
+float boxIntersection( in vec3 rayOrigin, in vec3 rayDirection) 
+{
+    vec3 m = 1.0/rayDirection;
+    vec3 n = m*rayOrigin;
+    vec3 k = abs(m)*2.; // boxSize = vec3(2.) for the centered unit cube
+    vec3 t1 = -n - k;
+    // vec3 t2 = -n + k;
+    float tN = max( max( t1.x, t1.y ), t1.z );
+    // float tF = min( min( t2.x, t2.y ), t2.z ); // tF comes for free in the form of vPosition
+    // if( tN>tF || tF<0.0) return -1.0; // in our case, there is always an intersection
+    return tN;
+}
+
+// Where the ray from rayOrigin to rayEnd, on the far side of the cube, enters it.
+// The camera position if it is inside of the cube.
+vec3 rayEntry(vec3 rayOrigin, vec3 rayEnd)
+{
+    vec3 rayDirection = rayEnd - rayOrigin;
+    float t = boxIntersection(rayOrigin, rayDirection);
+    // t is negative if the entry point of the ray into the cube is behind the camera.
+    // In this case, just use the camera position.
+    return max(0., t) * rayDirection + rayOrigin;
+}
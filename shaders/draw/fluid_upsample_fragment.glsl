@@ -0,0 +1,53 @@
+#version 450
+
+uniform mat4 uCameraToFluidSim;
+uniform vec3 uInkColor;
+// Reduced resolution render of the fluid, see fluid_fragment.glsl
+uniform sampler2D uLowResolution;
+uniform int uResolutionDivisor;
+// How fast low resolution texels lose weight as their depth differs from the pixel's
+uniform float uDepthSharpness;
+
+in vec4 vPosition;
+out vec4 fFragColor;
+
+// Linked from fluid_ray.glsl
+vec3 rayEntry(vec3 rayOrigin, vec3 rayEnd);
+
+// Joint bilateral upsample : the 4 nearest low resolution texels are weighted bilinearly, and by how close
+// the depth they entered the cube at is to this pixel's. The cube's silhouette doesn't bleed that way.
+void main()
+{
+	vec3 rayOrigin = uCameraToFluidSim[3].xyz;
+	vec3 rayEnd = (uCameraToFluidSim * vPosition).xyz;
+	float depth = distance(rayEntry(rayOrigin, rayEnd), rayOrigin);
+
+	ivec2 size = textureSize(uLowResolution, 0);
+	vec2 lowResolutionPosition = gl_FragCoord.xy / uResolutionDivisor - 0.5;
+	ivec2 corner = ivec2(floor(lowResolutionPosition));
+	vec2 t = lowResolutionPosition - vec2(corner);
+
+	float alpha = 0., weightsSum = 0., nearestAlpha = 0., nearestDistance = 1e30;
+	for (int i = 0; i < 4; i++)
+	{
+		ivec2 offset = ivec2(i & 1, i >> 1);
+		vec4 lowResolution = texelFetch(uLowResolution, clamp(corner + offset, ivec2(0), size - 1), 0);
+
+		vec2 bilinear = mix(1. - t, t, vec2(offset));
+		float depthDistance = abs(lowResolution.g - depth);
+		// Texels outside of the cube have no coverage
+		float weight = bilinear.x * bilinear.y * lowResolution.a * exp(-depthDistance * uDepthSharpness);
+
+		alpha += lowResolution.r * weight;
+		weightsSum += weight;
+
+		if (lowResolution.a > 0. && depthDistance < nearestDistance)
+		{
+			nearestAlpha = lowResolution.r;
+			nearestDistance = depthDistance;
+		}
+	}
+
+	// All 4 texels too far in depth, fall back to the closest one
+	fFragColor = vec4(uInkColor, weightsSum > 1e-4 ? alpha / weightsSum : nearestAlpha);
+}
@@ -0,0 +1,38 @@
+#version 450
+
+#define BRICK_SIZE 8
+
+layout(local_size_x = BRICK_SIZE, local_size_y = BRICK_SIZE, local_size_z = BRICK_SIZE) in;
+
+uniform sampler3D uInkDensity;
+layout(binding = 0, r32f) uniform writeonly image3D uOccupancy;
+
+shared uint sMaxDensity;
+
+// Linked from ring.glsl, fetches logical texels and returns 0 outside of the grid
+vec4 fetchRing(sampler3D tex, ivec3 texel);
+
+// Largest ink density a sample inside of each brick can see, one work group per brick. Interpolated samples
+// reach one texel past the brick, so texels around it count too.
+void main()
+{
+	if (gl_LocalInvocationIndex == 0)
+		sMaxDensity = 0;
+	barrier();
+
+	const int side = BRICK_SIZE + 2;
+	ivec3 origin = ivec3(gl_WorkGroupID) * BRICK_SIZE - 1;
+	float maxDensity = 0.;
+	for (int i = int(gl_LocalInvocationIndex); i < side * side * side; i += BRICK_SIZE * BRICK_SIZE * BRICK_SIZE)
+	{
+		ivec3 texel = origin + ivec3(i % side, (i / side) % side, i / (side * side));
+		maxDensity = max(maxDensity, abs(fetchRing(uInkDensity, texel).r));
+	}
+
+	// Non-negative floats order like their bits
+	atomicMax(sMaxDensity, floatBitsToUint(maxDensity));
+	barrier();
+
+	if (gl_LocalInvocationIndex == 0)
+		imageStore(uOccupancy, ivec3(gl_WorkGroupID), vec4(uintBitsToFloat(sMaxDensity)));
+}
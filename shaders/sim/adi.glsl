@@ -0,0 +1,73 @@
+#version 450
+
+#define LINE_WORK_GROUP_SIZE 64
+#define MAX_LINE_LENGTH 1024
+
+layout(local_size_x = LINE_WORK_GROUP_SIZE) in;
+
+// One invocation per line of the grid along uAxis
+uniform int uAxis;
+uniform float uAlpha;
+
+// Vector fields, all components are solved at once
+layout(binding = 0, VELOCITY_FORMAT) uniform readonly image3D uFieldIn;
+// Not restrict, passes after the first one solve in place
+layout(binding = 1, VELOCITY_FORMAT) uniform image3D uFieldOut;
+
+// Thomas algorithm coefficients only depend on the position along the line
+shared float sUpper[MAX_LINE_LENGTH];
+shared float sOneOverPivot[MAX_LINE_LENGTH];
+
+// Linked from ring.glsl, lines are logical
+ivec3 ringTexel(ivec3 texel);
+
+// Solves (alpha + 2) x(i) - x(i - 1) - x(i + 1) = alpha * b(i) along a line, with x = 0 outside
+// of the grid. This is implicit diffusion along a single axis, the same equation as the Jacobi
+// diffusion solve restricted to one dimension.
+void main()
+{
+	ivec3 size = imageSize(uFieldOut);
+	int length = size[uAxis];
+	int sizeA = size[(uAxis + 1) % 3];
+	int sizeB = size[(uAxis + 2) % 3];
+
+	if (gl_LocalInvocationIndex == 0)
+	{
+		float upper = 0.;
+		for (int i = 0; i < length; i++)
+		{
+			float oneOverPivot = 1. / (uAlpha + 2. + upper);
+			upper = -oneOverPivot;
+			sUpper[i] = upper;
+			sOneOverPivot[i] = oneOverPivot;
+		}
+	}
+	memoryBarrierShared();
+	barrier();
+
+	int line = int(gl_GlobalInvocationID.x);
+	if (line >= sizeA * sizeB)
+		return;
+
+	ivec3 texel;
+	texel[(uAxis + 1) % 3] = line % sizeA;
+	texel[(uAxis + 2) % 3] = line / sizeA;
+
+	// Forward elimination, storing the modified right-hand side in the output
+	vec3 previous = vec3(0);
+	for (int i = 0; i < length; i++)
+	{
+		texel[uAxis] = i;
+		previous = (uAlpha * imageLoad(uFieldIn, ringTexel(texel)).xyz + previous) * sOneOverPivot[i];
+		imageStore(uFieldOut, ringTexel(texel), vec4(previous, 0));
+	}
+
+	// Back substitution
+	vec3 next = previous;
+	for (int i = length - 2; i >= 0; i--)
+	{
+		texel[uAxis] = i;
+		next = imageLoad(uFieldOut, ringTexel(texel)).xyz - sUpper[i] * next;
+		imageStore(uFieldOut, ringTexel(texel), vec4(next, 0));
+	}
+}
@@ -11,18 +11,24 @@ uniform GridParams uGridParams;
 uniform float udt;
 uniform float uBoundaryCondition;
 uniform bvec3 uFieldStagger;
-
-layout(binding = 0) uniform sampler2DArray uVelocityX;
-layout(binding = 1) uniform sampler2DArray uVelocityY;
-layout(binding = 2) uniform sampler2DArray uVelocityZ;
-layout(binding = 3) uniform sampler2DArray uFieldIn;
-layout(binding = 4) uniform restrict writeonly image2DArray uFieldOut;
-
-// Velocity X is staggered by velocityStagger.xyy
-// Velocity Y is staggered by velocityStagger.yxy
-// Velocity Z is staggered by velocityStagger.yyx
+// Fields advected by the dispatch. Advecting both reuses the same backtrace,
+// which is only valid when uFieldIn has the same stagger as the velocity.
+uniform bool uAdvectVelocity;
+uniform bool uAdvectField;
+// One of AdvectionInterpolation
+uniform int uInterpolation;
+const int interpolationMonotonicCubic = 0;
+const int interpolationBSpline = 1;
+const int interpolationClampedBSpline = 2;
+
+layout(binding = 0) uniform sampler3D uVelocity;
+layout(binding = 3) uniform sampler3D uFieldIn;
+layout(binding = 4) uniform restrict writeonly image3D uFieldOut;
+layout(binding = 5) uniform restrict writeonly image3D uVelocityOut;
+
+// Velocity components are packed in a single texture, so they share the same stagger
 // TEST: collocated grid
-const vec2 velocityStagger = vec2(0, 0);
+const vec3 velocityStagger = vec3(0, 0, 0);
 
 vec3 texelSpaceToGridSpace(ivec3 p, vec3 stagger)
 {
@@ -34,24 +40,19 @@ vec3 gridSpaceToUV(vec3 p, vec3 stagger)
 	return (p * uGridParams.oneOverDx + stagger) * uGridParams.oneOverGridSize;
 }
 
-float sampleTex(sampler2DArray tex, vec3 uv)
-{
-	ivec3 size = textureSize(tex, 0);
-	uv.z = uv.z * size.z - 0.5;
-
-	float down = texture(tex, uv + vec3(0, 0, -0.5)).r;
-	float up = texture(tex, uv + vec3(0, 0, 0.5)).r;
+// Linked from ring.glsl
+ivec3 ringTexel(ivec3 texel);
+vec4 fetchRing(sampler3D tex, ivec3 texel);
+vec4 sampleRing(sampler3D tex, vec3 uv);
 
-	return mix(uv.z < 0. ? 0 : down, uv.z >= size.z - 1. ? 0 : up, fract(uv.z));
+vec4 sampleTex(sampler3D tex, vec3 uv)
+{
+	return sampleRing(tex, uv);
 }
 
 vec3 bilerpVelocity(vec3 position)
 {
-	vec3 velocity;
-	velocity.x = sampleTex(uVelocityX, gridSpaceToUV(position, velocityStagger.xyy));
-	velocity.y = sampleTex(uVelocityY, gridSpaceToUV(position, velocityStagger.yxy));
-	velocity.z = sampleTex(uVelocityZ, gridSpaceToUV(position, velocityStagger.yyx));
-	return velocity;
+	return sampleTex(uVelocity, gridSpaceToUV(position, velocityStagger)).xyz;
 }
 
 // Semi-lagrangian advection via 3rd-order Runge-Kutta time integration
@@ -90,51 +91,134 @@ float monotonicCubicInterpolation(float qprev, float q0, float q1, float qnext,
 	return ((a3 * t + a2) * t + a1) * t + a0;
 }
 
-// Monotonic tricubic interpolation
-float interpolateField(vec3 uv)
+// Monotonic tricubic interpolation, of the first component only unless vectorField is set.
+// There are no gathers from 3D textures, each of the 4x4x4 texels is fetched once with all of its components.
+vec3 interpolateField(sampler3D field, vec3 uv, bool vectorField)
 {
-	ivec3 size = textureSize(uFieldIn, 0);
+	ivec3 size = textureSize(field, 0);
 
-	// Gather exactly in the corner of the texel so the correct texels are always fetched.
-	// Not doing this introduces irregularities on texel boundaries.
 	vec3 realTexelSample = uv * size - 0.5;
 	vec3 cornerTexelSample = floor(realTexelSample);
-	vec3 gatherUV = (cornerTexelSample + 1.) * vec3(uGridParams.oneOverGridSize.xy, 1);
+	ivec3 corner = ivec3(cornerTexelSample) - 1;
+	int numComponents = vectorField ? 3 : 1;
 
 	// Interpolation coefficients
 	vec3 t = realTexelSample - cornerTexelSample;
 
+	// Footprints inside of the grid are fetched from their stored texels without testing each one against the
+	// edges of the grid. They are at most 3 texels past the corner, so one subtraction wraps them around.
+	bool insideGrid = all(greaterThanEqual(corner, ivec3(0))) && all(lessThan(corner + 3, size));
+	ivec3 storedCorner = ringTexel(corner);
+
 	// Interpolate along X then Y then Z
-	vec4 zValues = vec4(0);
-	gatherUV.z -= 2.;
-	for (int i = 0; i < 4; i++, gatherUV.z += 1.)
+	vec3 zValues[4];
+	for (int z = 0; z < 4; z++)
+	{
+		vec3 yValues[4];
+		for (int y = 0; y < 4; y++)
+		{
+			// Texels outside of the grid are 0
+			vec3 xValues[4];
+			for (int x = 0; x < 4; x++)
+			{
+				ivec3 stored = storedCorner + ivec3(x, y, z);
+				stored -= size * ivec3(greaterThanEqual(stored, size));
+				xValues[x] = (insideGrid ? texelFetch(field, stored, 0) : fetchRing(field, corner + ivec3(x, y, z))).xyz;
+			}
+
+			for (int c = 0; c < numComponents; c++)
+				yValues[y][c] = monotonicCubicInterpolation(xValues[0][c], xValues[1][c], xValues[2][c], xValues[3][c], t.x);
+		}
+
+		for (int c = 0; c < numComponents; c++)
+			zValues[z][c] = monotonicCubicInterpolation(yValues[0][c], yValues[1][c], yValues[2][c], yValues[3][c], t.y);
+	}
+
+	vec3 value = vec3(0);
+	for (int c = 0; c < numComponents; c++)
+		value[c] = monotonicCubicInterpolation(zValues[0][c], zValues[1][c], zValues[2][c], zValues[3][c], t.z);
+	return value;
+}
+
+// Cubic B-spline interpolation from 8 trilinear samples instead of 64 fetches, of the first component only unless vectorField is set
+// GPU Gems 2, Chapter 20. Fast Third-Order Texture Filtering, Christian Sigg and Markus Hadwiger
+// B-splines approximate rather than interpolate, so fields come out a little smoothed. Clamping bounds the result
+// by the 8 texels around the sample, which keeps it from overshooting like the monotonic cubic.
+vec3 interpolateFieldBSpline(sampler3D field, vec3 uv, bool vectorField, bool clampToNeighbours)
+{
+	vec3 size = vec3(textureSize(field, 0));
+
+	vec3 realTexelSample = uv * size - 0.5;
+	vec3 cornerTexelSample = floor(realTexelSample);
+	vec3 t = realTexelSample - cornerTexelSample;
+	vec3 oneMinusT = 1. - t;
+
+	// B-spline weights of the 4 texels along each axis
+	vec3 w0 = oneMinusT * oneMinusT * oneMinusT / 6.;
+	vec3 w1 = 2. / 3. - 0.5 * t * t * (2. - t);
+	vec3 w2 = 2. / 3. - 0.5 * oneMinusT * oneMinusT * (2. - oneMinusT);
+	vec3 w3 = t * t * t / 6.;
+
+	// Pairs of texels blended by one linear sample each, at texel centers offset by the relative weight of the second one
+	vec3 g0 = w0 + w1;
+	vec3 g1 = w2 + w3;
+	vec3 uv0 = (cornerTexelSample - 0.5 + w1 / g0) / size;
+	vec3 uv1 = (cornerTexelSample + 1.5 + w3 / g1) / size;
+
+	vec3 value = vec3(0);
+	for (int z = 0; z < 2; z++)
+		for (int y = 0; y < 2; y++)
+			for (int x = 0; x < 2; x++)
+			{
+				bvec3 second = bvec3(x, y, z);
+				vec3 g = mix(g0, g1, second);
+				value += g.x * g.y * g.z * sampleTex(field, mix(uv0, uv1, second)).xyz;
+			}
+
+	if (clampToNeighbours)
 	{
-		if (gatherUV.z < 0 || gatherUV.z >= size.z)
-			continue;
-
-		vec4 topLeftBlock = textureGatherOffset(uFieldIn, gatherUV, ivec2(-1, 1));
-		vec4 topRightBlock = textureGatherOffset(uFieldIn, gatherUV, ivec2(1, 1));
-		vec4 bottomLeftBlock = textureGatherOffset(uFieldIn, gatherUV, ivec2(-1, -1));
-		vec4 bottomRightBlock = textureGatherOffset(uFieldIn, gatherUV, ivec2(1, -1));
-	
-		// Y goes up
-		float q0 = monotonicCubicInterpolation(bottomLeftBlock.w, bottomLeftBlock.z, bottomRightBlock.w, bottomRightBlock.z, t.x);
-		float q1 = monotonicCubicInterpolation(bottomLeftBlock.x, bottomLeftBlock.y, bottomRightBlock.x, bottomRightBlock.y, t.x);
-		float q2 = monotonicCubicInterpolation(topLeftBlock.w, topLeftBlock.z, topRightBlock.w, topRightBlock.z, t.x);
-		float q3 = monotonicCubicInterpolation(topLeftBlock.x, topLeftBlock.y, topRightBlock.x, topRightBlock.y, t.x);
-
-		zValues[i] = monotonicCubicInterpolation(q0, q1, q2, q3, t.y);
+		// Texels outside of the grid are 0, as with the other interpolations
+		ivec3 corner = ivec3(cornerTexelSample);
+		vec3 minValue = fetchRing(field, corner).xyz;
+		vec3 maxValue = minValue;
+		for (int z = 0; z < 2; z++)
+			for (int y = 0; y < 2; y++)
+				for (int x = 0; x < 2; x++)
+				{
+					vec3 neighbour = fetchRing(field, corner + ivec3(x, y, z)).xyz;
+					minValue = min(minValue, neighbour);
+					maxValue = max(maxValue, neighbour);
+				}
+		value = clamp(value, minValue, maxValue);
 	}
 
-	return monotonicCubicInterpolation(zValues[0], zValues[1], zValues[2], zValues[3], t.z);
+	return vectorField ? value : vec3(value.x, 0, 0);
+}
+
+vec3 interpolate(sampler3D field, vec3 uv, bool vectorField)
+{
+	if (uInterpolation == interpolationMonotonicCubic)
+		return interpolateField(field, uv, vectorField);
+	return interpolateFieldBSpline(field, uv, vectorField, uInterpolation == interpolationClampedBSpline);
 }
 
 void compute(ivec3 texel, ivec3 outputTexel, bool boundaryTexel, bool unused)
 {
 	vec3 fieldStagger = ivec3(uFieldStagger) * 0.5;
 	vec3 samplePosition = texelSpaceToGridSpace(texel, fieldStagger);
-	float newValue = interpolateField(gridSpaceToUV(traceBack(samplePosition), fieldStagger));
+	vec3 originUV = gridSpaceToUV(traceBack(samplePosition), fieldStagger);
+
+	if (uAdvectVelocity)
+	{
+		vec3 newVelocity = interpolate(uVelocity, originUV, true);
+		// TEST: collocated grid
+		imageStore(uVelocityOut, outputTexel, vec4(newVelocity, 0));
+	}
 
-	// TEST: collocated grid
-	imageStore(uFieldOut, outputTexel, vec4(/*unused ? 0 : boundaryTexel ? uBoundaryCondition * newValue :*/ newValue));
+	if (uAdvectField)
+	{
+		float newValue = interpolate(uFieldIn, originUV, false).x;
+		// TEST: collocated grid
+		imageStore(uFieldOut, outputTexel, vec4(/*unused ? 0 : boundaryTexel ? uBoundaryCondition * newValue :*/ newValue));
+	}
 }
@@ -0,0 +1,39 @@
+#version 450
+
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
+
+uniform float uThreshold;
+
+layout(binding = 0, VELOCITY_FORMAT) uniform restrict readonly image3D uVelocity;
+layout(binding = 1, INK_FORMAT) uniform restrict readonly image3D uInk;
+
+layout(std430, binding = 0) restrict writeonly buffer BrickActivity
+{
+	uint uBrickActivity[];
+};
+
+shared uint sActive;
+
+// Flags the bricks holding velocity or ink above uThreshold, one work group per brick
+void main()
+{
+	ivec3 texel = ivec3(gl_GlobalInvocationID);
+
+	if (gl_LocalInvocationIndex == 0)
+		sActive = 0u;
+	memoryBarrierShared();
+	barrier();
+
+	float magnitude = max(length(imageLoad(uVelocity, texel).xyz), abs(imageLoad(uInk, texel).r));
+	if (magnitude > uThreshold)
+		atomicOr(sActive, 1u);
+	memoryBarrierShared();
+	barrier();
+
+	if (gl_LocalInvocationIndex == 0)
+	{
+		uvec3 brick = gl_WorkGroupID;
+		uvec3 count = gl_NumWorkGroups;
+		uBrickActivity[brick.x + count.x * (brick.y + count.y * brick.z)] = sActive;
+	}
+}
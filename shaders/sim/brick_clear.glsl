@@ -0,0 +1,13 @@
+#version 450
+
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
+
+layout(binding = 0) uniform writeonly image3D uField;
+
+ivec3 globalTexel();
+
+// Zeroes the bricks listed in uActiveBricks, see bricks.glsl
+void main()
+{
+	imageStore(uField, globalTexel(), vec4(0));
+}
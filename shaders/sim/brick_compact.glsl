@@ -0,0 +1,120 @@
+#version 450
+
+#define WORK_GROUP_SIZE 512
+
+layout(local_size_x = WORK_GROUP_SIZE) in;
+
+uniform uvec3 uNumBricks;
+
+layout(std430, binding = 0) restrict readonly buffer BrickActivity
+{
+	uint uBrickActivity[];
+};
+
+// Whether each brick was in the active list built last time
+layout(std430, binding = 1) restrict buffer BrickListed
+{
+	uint uBrickListed[];
+};
+
+layout(std430, binding = 2) restrict writeonly buffer ActiveBricks
+{
+	uint uActiveBricks[];
+};
+
+layout(std430, binding = 3) restrict writeonly buffer ClearedBricks
+{
+	uint uClearedBricks[];
+};
+
+// Indirect dispatch arguments for both lists
+layout(std430, binding = 4) restrict writeonly buffer ActiveDispatch
+{
+	uint uActiveDispatch[3];
+};
+
+layout(std430, binding = 5) restrict writeonly buffer ClearedDispatch
+{
+	uint uClearedDispatch[3];
+};
+
+shared uint sNumActive;
+shared uint sNumCleared;
+
+// 10 bits per axis, unpacked by workGroupBrick in bricks.glsl
+uint packBrick(ivec3 brick)
+{
+	return uint(brick.x) | (uint(brick.y) << 10) | (uint(brick.z) << 20);
+}
+
+// Same as bricks.glsl
+const int brickSize = 8;
+
+// Linked from ring.glsl
+ivec3 logicalTexel(ivec3 storedTexel);
+
+// Bricks are stored bricks, which wrap around along with the fields. The logical grid doesn't, so
+// a neighbour only counts if it covers some of it once moved through the origin of the ring.
+bool isFlaggedNeighbour(ivec3 brick, ivec3 offset)
+{
+	ivec3 size = ivec3(uNumBricks);
+	ivec3 gridSize = size * brickSize;
+	ivec3 first = logicalTexel(brick * brickSize);
+	for (int i = 0; i < 3; i++)
+	{
+		// Bricks straddling the edge of the grid when the origin isn't on a brick have logical neighbours on both sides
+		bool straddlesEdge = first[i] + brickSize > gridSize[i];
+		int neighbourFirst = first[i] + offset[i] * brickSize;
+		if (!straddlesEdge && (neighbourFirst >= gridSize[i] || neighbourFirst + brickSize <= 0))
+			return false;
+	}
+
+	ivec3 neighbour = (brick + offset + size) % size;
+	return uBrickActivity[neighbour.x + size.x * (neighbour.y + size.y * neighbour.z)] != 0u;
+}
+
+// Single work group listing the bricks flagged by brick_activity.glsl and the bricks around them,
+// which is as far as anything travels in one step. Also lists the bricks that just left the active
+// list, so they can be cleared instead of keeping whatever they held last.
+void main()
+{
+	if (gl_LocalInvocationIndex == 0)
+	{
+		sNumActive = 0u;
+		sNumCleared = 0u;
+	}
+	memoryBarrierShared();
+	barrier();
+
+	uint numBricks = uNumBricks.x * uNumBricks.y * uNumBricks.z;
+	for (uint i = gl_LocalInvocationIndex; i < numBricks; i += WORK_GROUP_SIZE)
+	{
+		ivec3 brick = ivec3(i % uNumBricks.x, (i / uNumBricks.x) % uNumBricks.y, i / (uNumBricks.x * uNumBricks.y));
+
+		bool active = false;
+		for (int z = -1; z <= 1; z++)
+			for (int y = -1; y <= 1; y++)
+				for (int x = -1; x <= 1; x++)
+					active = active || isFlaggedNeighbour(brick, ivec3(x, y, z));
+
+		if (active)
+			uActiveBricks[atomicAdd(sNumActive, 1u)] = packBrick(brick);
+		else if (uBrickListed[i] != 0u)
+			uClearedBricks[atomicAdd(sNumCleared, 1u)] = packBrick(brick);
+
+		uBrickListed[i] = active ? 1u : 0u;
+	}
+
+	memoryBarrierShared();
+	barrier();
+
+	if (gl_LocalInvocationIndex == 0)
+	{
+		uActiveDispatch[0] = sNumActive;
+		uActiveDispatch[1] = 1u;
+		uActiveDispatch[2] = 1u;
+		uClearedDispatch[0] = sNumCleared;
+		uClearedDispatch[1] = 1u;
+		uClearedDispatch[2] = 1u;
+	}
+}
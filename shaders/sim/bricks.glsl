@@ -0,0 +1,29 @@
+#version 450
+
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
+
+// Dispatches only cover the bricks listed in uActiveBricks, one work group per 8^3 brick,
+// instead of the whole grid
+uniform bool uSparseBricks;
+
+layout(std430, binding = 3) restrict readonly buffer ActiveBricks
+{
+	uint uActiveBricks[];
+};
+
+// Coordinates of the brick the work group covers, in work groups. Brick coordinates are packed
+// 10 bits per axis, see brick_compact.glsl.
+uvec3 workGroupBrick()
+{
+	if (!uSparseBricks)
+		return gl_WorkGroupID;
+
+	uint brick = uActiveBricks[gl_WorkGroupID.x];
+	return uvec3(brick & 1023u, (brick >> 10) & 1023u, brick >> 20);
+}
+
+// Replaces gl_GlobalInvocationID
+ivec3 globalTexel()
+{
+	return ivec3(workGroupBrick() * gl_WorkGroupSize + gl_LocalInvocationID);
+}
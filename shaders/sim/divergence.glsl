@@ -4,32 +4,35 @@ layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
 
 uniform float uOneOverDx;
 
-layout(binding = 0, r32f) uniform restrict readonly image2DArray uVelocityX;
-layout(binding = 1, r32f) uniform restrict readonly image2DArray uVelocityY;
-layout(binding = 2, r32f) uniform restrict readonly image2DArray uVelocityZ;
-layout(binding = 3, r32f) uniform restrict writeonly image2DArray uDivergence;
+layout(binding = 0, VELOCITY_FORMAT) uniform restrict readonly image3D uVelocity;
+layout(binding = 3, r32f) uniform restrict writeonly image3D uDivergence;
 
 // Velocity textures are staggered, and the divergence texture is centered.
 // This means that divergence samples are in the middle of velocity samples,
 // which allows for quick and accurate finite difference derivatives.
 
+// Linked from ring.glsl
+ivec3 ringTexel(ivec3 texel);
+ivec3 logicalTexel(ivec3 storedTexel);
+
 void main()
 {
-	ivec3 texel = ivec3(gl_GlobalInvocationID);
-	ivec3 size = imageSize(uVelocityX) - 1;
+	ivec3 storedTexel = ivec3(gl_GlobalInvocationID);
+	ivec3 texel = logicalTexel(storedTexel);
+	ivec3 size = imageSize(uVelocity) - 1;
 	ivec2 s = ivec2(1, 0);
 	ivec3 zero = ivec3(0);
 
 	// Clamp coordinates so gradients are 0 on the boundary
 	// TEST: collocated grid
-	float xleft = imageLoad(uVelocityX, max(zero, texel - s.xyy)).r,
-		 xright = imageLoad(uVelocityX, min(size, texel + s.xyy)).r,
-		    yup = imageLoad(uVelocityY, min(size, texel + s.yxy)).r,
-		  ydown = imageLoad(uVelocityY, max(zero, texel - s.yxy)).r,
-		 zfront = imageLoad(uVelocityZ, min(size, texel + s.yyx)).r,
-		  zback = imageLoad(uVelocityZ, max(zero, texel - s.yyx)).r;
+	float xleft = imageLoad(uVelocity, ringTexel(max(zero, texel - s.xyy))).x,
+		 xright = imageLoad(uVelocity, ringTexel(min(size, texel + s.xyy))).x,
+		    yup = imageLoad(uVelocity, ringTexel(min(size, texel + s.yxy))).y,
+		  ydown = imageLoad(uVelocity, ringTexel(max(zero, texel - s.yxy))).y,
+		 zfront = imageLoad(uVelocity, ringTexel(min(size, texel + s.yyx))).z,
+		  zback = imageLoad(uVelocity, ringTexel(max(zero, texel - s.yyx))).z;
 
 	// TEST: collocated grid
 	float divergence = (xright - xleft + yup - ydown + zfront - zback) * uOneOverDx * 0.5;
-	imageStore(uDivergence, texel, vec4(divergence));
+	imageStore(uDivergence, storedTexel, vec4(divergence));
 }
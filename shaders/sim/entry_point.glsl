@@ -7,9 +7,16 @@ uniform bvec3 uFieldStagger;
 // Unify computations and boundary condition enforcement
 void compute(ivec3 inputTexel, ivec3 outputTexel, bool boundaryTexel, bool unused);
 
+// Linked from bricks.glsl and ring.glsl
+ivec3 globalTexel();
+ivec3 logicalTexel(ivec3 storedTexel);
+
 void main()
 {
-	ivec3 texel = ivec3(gl_GlobalInvocationID);
+	// Dispatches cover the texels as they are stored, outputs go where they are.
+	// Computations use the logical texel, and load through ringTexel.
+	ivec3 storedTexel = globalTexel();
+	ivec3 texel = logicalTexel(storedTexel);
 	
 	uvec3 size = gl_WorkGroupSize * gl_NumWorkGroups;
 
@@ -25,5 +32,5 @@ void main()
 	bool unused = any(lessThan(texel, ivec3(uFieldStagger)));*/
 
 	// TEST: collocated grid
-	compute(texel, texel, false, false);
+	compute(texel, storedTexel, false, false);
 }
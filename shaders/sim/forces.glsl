@@ -1,22 +1,51 @@
 #version 450
 
-uniform vec3 uForceCenter;
-uniform float uOneOverForceRadius;
+struct Impulse
+{
+	// Gaussian center in logical texels, and 1 / radius
+	vec4 centerAndOneOverRadius;
+	// Velocity added at the center, and ink added at the center
+	vec4 forceAndInk;
+};
+
+layout(std430, binding = 0) restrict readonly buffer Impulses
+{
+	Impulse uImpulses[];
+};
+uniform int uNumImpulses;
 
-uniform float uForceMagnitude;
+// Applies the impulses' force to uVelocity instead of their ink to uField
+uniform bool uVectorField;
 uniform float uBoundaryCondition;
 uniform bvec3 uFieldStagger;
 
-layout(binding = 0, r32f) uniform restrict image2DArray uField;
+layout(binding = 0, INK_FORMAT) uniform restrict image3D uField;
+layout(binding = 1, VELOCITY_FORMAT) uniform restrict image3D uVelocity;
 
+// Dispatches only cover the bricks around the impulses, see FluidSim::ForcesStep
 void compute(ivec3 texel, ivec3 outputTexel, bool boundaryTexel, bool unused)
 {
 	vec3 fieldStagger = ivec3(uFieldStagger) * 0.5;
 
-	vec3 vector = vec3(texel) - fieldStagger + 0.5 - uForceCenter;
-	float factor = exp2(-dot(vector, vector) * uOneOverForceRadius);
+	// Impulses are centered in logical space, and the texel is loaded from where it is stored
+	vec3 position = vec3(texel) - fieldStagger + 0.5;
+	vec4 sum = vec4(0);
+	for (int i = 0; i < uNumImpulses; i++)
+	{
+		Impulse impulse = uImpulses[i];
+		vec3 vector = position - impulse.centerAndOneOverRadius.xyz;
+		sum += impulse.forceAndInk * exp2(-dot(vector, vector) * impulse.centerAndOneOverRadius.w);
+	}
+
+	if (uVectorField)
+	{
+		vec3 newVelocity = sum.xyz + imageLoad(uVelocity, outputTexel).xyz;
+		// TEST: collocated grid
+		imageStore(uVelocity, outputTexel, vec4(newVelocity, 0));
+		return;
+	}
 
-	float newValue = uForceMagnitude * factor + imageLoad(uField, texel).r;
+	float newValue = sum.w + imageLoad(uField, outputTexel).r;
 	// TEST: collocated grid
 	imageStore(uField, outputTexel, vec4(/*unused ? 0 : boundaryTexel ? uBoundaryCondition * newValue :*/ newValue));
 }
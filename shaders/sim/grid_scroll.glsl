@@ -1,22 +1,25 @@
 #version 450
 
-uniform ivec3 uTexelScroll;
+// Logical texels of the slab exposed by a scroll, the grid itself doesn't move, see FluidSim::scrollGrid
+uniform ivec3 uSlabOrigin;
+uniform ivec3 uSlabSize;
 
-layout(r32f) uniform readonly restrict image2DArray uFieldIn;
-layout(r32f) uniform writeonly restrict image2DArray uFieldOut;
+layout(binding = 0) uniform writeonly restrict image3D uPressure;
+layout(binding = 1) uniform writeonly restrict image3D uInk;
+layout(binding = 2) uniform writeonly restrict image3D uVelocity;
+
+// Linked from ring.glsl
+ivec3 ringTexel(ivec3 texel);
 
 layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
 void main()
 {
 	ivec3 texel = ivec3(gl_GlobalInvocationID);
-	ivec3 size = imageSize(uFieldIn);
-	ivec3 zero = ivec3(0);
-	ivec3 source = texel - uTexelScroll;
-
-	vec4 value = vec4(0);
-
-	if (all(greaterThanEqual(texel, zero)) && all(lessThan(texel, size)))
-		value = imageLoad(uFieldIn, source);
+	if (any(greaterThanEqual(texel, uSlabSize)))
+		return;
 
-	imageStore(uFieldOut, texel, value);
+	ivec3 storedTexel = ringTexel(uSlabOrigin + texel);
+	imageStore(uPressure, storedTexel, vec4(0));
+	imageStore(uInk, storedTexel, vec4(0));
+	imageStore(uVelocity, storedTexel, vec4(0));
 }
@@ -3,12 +3,76 @@
 uniform float uAlpha;
 uniform float uOneOverBeta;
 uniform float uBoundaryCondition;
+uniform float uRelaxation;
+// Converts the Jacobi update into the residual b - Lx of the input field
+uniform float uResidualScale;
+uniform bool uComputeResidual;
 
-layout(binding = 0, r32f) uniform readonly image2DArray uFieldSource;
-layout(binding = 1, r32f) uniform readonly image2DArray uFieldIn;
-layout(binding = 2, r32f) uniform writeonly restrict image2DArray uFieldOut;
+#define RED_BLACK_NONE 0
+#define RED_BLACK_RED 1
+#define RED_BLACK_BLACK 2
 
-// Performs one Jacobi iteration to solve a Poisson equation
+// Red-black passes update the cells of one color of the checkerboard in place
+uniform int uRedBlackPass;
+// Has the other color copied over, for the first pass of an in place solve starting from another field
+uniform bool uCopyOtherColor;
+// Chebyshev acceleration relaxes from the iterate before the input one rather than from the input one
+uniform bool uRelaxFromPrevious;
+
+layout(binding = 0, r32f) uniform readonly image3D uFieldSource;
+layout(binding = 1, r32f) uniform readonly image3D uFieldIn;
+// Not restrict, red-black passes bind the same image as uFieldIn
+layout(binding = 2, r32f) uniform writeonly image3D uFieldOut;
+// Usually the same image as uFieldOut, about to be overwritten
+layout(binding = 3, r32f) uniform readonly image3D uFieldPrevious;
+
+// Solves for the 3 components of a packed vector field at once, using the images below instead
+uniform bool uVectorField;
+
+layout(binding = 4, VELOCITY_FORMAT) uniform readonly image3D uVectorFieldSource;
+layout(binding = 5, VELOCITY_FORMAT) uniform readonly image3D uVectorFieldIn;
+layout(binding = 6) uniform writeonly image3D uVectorFieldOut;
+layout(binding = 7, VELOCITY_FORMAT) uniform readonly image3D uVectorFieldPrevious;
+
+void storeWorkGroupSumAndMax(float sumValue, float maxValue);
+ivec3 ringTexel(ivec3 texel);
+
+// Scalar fields only use the first component. Loads take logical texels.
+vec3 loadSource(ivec3 texel)
+{
+	texel = ringTexel(texel);
+	return uVectorField ? imageLoad(uVectorFieldSource, texel).xyz : vec3(imageLoad(uFieldSource, texel).r, 0, 0);
+}
+
+vec3 loadIn(ivec3 texel)
+{
+	texel = ringTexel(texel);
+	return uVectorField ? imageLoad(uVectorFieldIn, texel).xyz : vec3(imageLoad(uFieldIn, texel).r, 0, 0);
+}
+
+vec3 loadPrevious(ivec3 texel)
+{
+	texel = ringTexel(texel);
+	return uVectorField ? imageLoad(uVectorFieldPrevious, texel).xyz : vec3(imageLoad(uFieldPrevious, texel).r, 0, 0);
+}
+
+void storeOut(ivec3 texel, vec3 value)
+{
+	if (uVectorField)
+		imageStore(uVectorFieldOut, texel, vec4(value, 0));
+	else
+		imageStore(uFieldOut, texel, vec4(value.x));
+}
+
+// Outside of the texture, the field is uBoundaryCondition times the boundary texel's value
+vec3 loadNeighbour(ivec3 texel, ivec3 size, vec3 center)
+{
+	bool inside = all(greaterThanEqual(texel, ivec3(0))) && all(lessThan(texel, size));
+	return inside ? loadIn(texel) : uBoundaryCondition * center;
+}
+
+// Performs one Jacobi or Chebyshev-accelerated Jacobi iteration, or half a red-black SOR sweep,
+// to solve a Poisson equation
 // Lx = b
 // Where L is a laplacian operator defined by alpha and beta.
 // b is the source field.
@@ -17,17 +81,36 @@ layout(binding = 2, r32f) uniform writeonly restrict image2DArray uFieldOut;
 // https://dl.acm.org/action/downloadSupplement?doi=10.1145%2F3528233.3530737&file=supplementary.pdf
 void compute(ivec3 texel, ivec3 outputTexel, bool boundaryTexel, bool unused)
 {
-	// Field is 0 outside of the texture
-	float left = imageLoad(uFieldIn, texel + ivec3(-1,  0,  0)).r,
-	     right = imageLoad(uFieldIn, texel + ivec3( 1,  0,  0)).r,
-		    up = imageLoad(uFieldIn, texel + ivec3( 0,  1,  0)).r,
-		  down = imageLoad(uFieldIn, texel + ivec3( 0, -1,  0)).r,
-		 front = imageLoad(uFieldIn, texel + ivec3( 0,  0,  1)).r,
-		  back = imageLoad(uFieldIn, texel + ivec3( 0,  0, -1)).r,
-		source = imageLoad(uFieldSource, texel).r;
-	
-	float value = (left + right + up + down + front + back + uAlpha * source) * uOneOverBeta;
+	ivec3 size = uVectorField ? imageSize(uVectorFieldIn) : imageSize(uFieldIn);
+	vec3 center = loadIn(texel);
+
+	bool active = uRedBlackPass == RED_BLACK_NONE || ((texel.x + texel.y + texel.z) & 1) == uRedBlackPass - RED_BLACK_RED;
+
+	vec3 value = center;
+	vec3 residual = vec3(0);
+	if (active)
+	{
+		vec3 left = loadNeighbour(texel + ivec3(-1,  0,  0), size, center),
+		     right = loadNeighbour(texel + ivec3( 1,  0,  0), size, center),
+			    up = loadNeighbour(texel + ivec3( 0,  1,  0), size, center),
+			  down = loadNeighbour(texel + ivec3( 0, -1,  0), size, center),
+			 front = loadNeighbour(texel + ivec3( 0,  0,  1), size, center),
+			  back = loadNeighbour(texel + ivec3( 0,  0, -1), size, center),
+			source = loadSource(texel);
+
+		value = (left + right + up + down + front + back + uAlpha * source) * uOneOverBeta;
+		// The residual comes for free from the plain Jacobi update
+		residual = (value - center) * uResidualScale;
+		// Weighted Jacobi, or SOR for red-black passes. A relaxation of 1 is the plain iteration.
+		vec3 relaxFrom = uRelaxFromPrevious ? loadPrevious(texel) : center;
+		value = mix(relaxFrom, value, uRelaxation);
+	}
+
+	// Same value for the whole dispatch, so the reduction runs from uniform control flow
+	if (uComputeResidual)
+		storeWorkGroupSumAndMax(dot(residual, residual), length(residual));
 
 	// TEST: collocated grid
-	imageStore(uFieldOut, outputTexel, vec4(/*unused ? 0 : boundaryTexel ? uBoundaryCondition * value :*/ value));
+	if (active || uCopyOtherColor)
+		storeOut(outputTexel, /*unused ? 0 : boundaryTexel ? uBoundaryCondition * value :*/ value);
 }
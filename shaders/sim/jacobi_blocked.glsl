@@ -0,0 +1,184 @@
+#version 450
+
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
+
+#define TILE_SIZE 8
+#define WORK_GROUP_SIZE 512
+// Every iteration in shared memory invalidates one more layer of the halo
+#define MAX_SCALAR_ITERATIONS 4
+#define MAX_VECTOR_ITERATIONS 2
+// Enough for a 16^3 scalar tile or a 12^3 vector tile
+#define MAX_TILE_FLOATS 5184
+#define MAX_CELLS_PER_INVOCATION 8
+
+uniform float uAlpha;
+uniform float uOneOverBeta;
+uniform float uBoundaryCondition;
+// Weighted Jacobi, 1 is the plain iteration
+uniform float uRelaxation;
+// Converts the Jacobi update into the residual b - Lx of the input field
+uniform float uResidualScale;
+uniform bool uComputeResidual;
+// Iterations to run in shared memory before writing back, at most MAX_SCALAR_ITERATIONS
+// or MAX_VECTOR_ITERATIONS. Also the width of the halo.
+uniform int uIterations;
+
+// Same bindings as jacobi.glsl
+layout(binding = 0, r32f) uniform readonly image3D uFieldSource;
+layout(binding = 1, r32f) uniform readonly image3D uFieldIn;
+layout(binding = 2, r32f) uniform writeonly image3D uFieldOut;
+
+// Solves for the 3 components of a packed vector field at once, using the images below instead
+uniform bool uVectorField;
+
+layout(binding = 4, VELOCITY_FORMAT) uniform readonly image3D uVectorFieldSource;
+layout(binding = 5, VELOCITY_FORMAT) uniform readonly image3D uVectorFieldIn;
+layout(binding = 6) uniform writeonly image3D uVectorFieldOut;
+
+// One plane per component, so neighbouring cells stay in neighbouring banks
+shared float sTile[MAX_TILE_FLOATS];
+
+void storeWorkGroupSumAndMax(float sumValue, float maxValue);
+// Linked from bricks.glsl, the tile is a brick
+uvec3 workGroupBrick();
+ivec3 globalTexel();
+// Linked from ring.glsl
+ivec3 wrapTexel(ivec3 texel);
+ivec3 logicalTexel(ivec3 storedTexel);
+
+// Scalar fields only use the first component. Loads take stored texels.
+vec3 loadSource(ivec3 texel)
+{
+	return uVectorField ? imageLoad(uVectorFieldSource, texel).xyz : vec3(imageLoad(uFieldSource, texel).r, 0, 0);
+}
+
+vec3 loadIn(ivec3 texel)
+{
+	return uVectorField ? imageLoad(uVectorFieldIn, texel).xyz : vec3(imageLoad(uFieldIn, texel).r, 0, 0);
+}
+
+void storeOut(ivec3 texel, vec3 value)
+{
+	if (uVectorField)
+		imageStore(uVectorFieldOut, texel, vec4(value, 0));
+	else
+		imageStore(uFieldOut, texel, vec4(value.x));
+}
+
+vec3 loadTile(int cell, int numCells)
+{
+	return uVectorField ? vec3(sTile[cell], sTile[cell + numCells], sTile[cell + 2 * numCells]) : vec3(sTile[cell], 0, 0);
+}
+
+void storeTile(int cell, int numCells, vec3 value)
+{
+	sTile[cell] = value.x;
+	if (uVectorField)
+	{
+		sTile[cell + numCells] = value.y;
+		sTile[cell + 2 * numCells] = value.z;
+	}
+}
+
+// Outside of the texture, the field is uBoundaryCondition times the boundary texel's value
+vec3 loadNeighbour(int cell, int numCells, ivec3 texel, ivec3 size, vec3 center)
+{
+	bool inside = all(greaterThanEqual(texel, ivec3(0))) && all(lessThan(texel, size));
+	return inside ? loadTile(cell, numCells) : uBoundaryCondition * center;
+}
+
+// Runs uIterations Jacobi iterations on an 8^3 tile in shared memory, starting from the tile and a halo
+// of uIterations texels around it, which is enough for the tile to see the same neighbours as it would
+// through uIterations dispatches of jacobi.glsl. Halo texels are updated too, from neighbours
+// that go stale one layer further in at every iteration, and are thrown away at the end.
+// Iterations stay in shared memory, so relaxation cannot be Chebyshev or red-black SOR.
+// The tile is laid out as stored : halo texels past the edge of the storage wrap around, and a texel
+// only reads its tile neighbours when they are its logical neighbours, inside of the grid.
+void main()
+{
+	ivec3 size = uVectorField ? imageSize(uVectorFieldIn) : imageSize(uFieldIn);
+
+	int halo = uIterations;
+	int side = TILE_SIZE + 2 * halo;
+	int numCells = side * side * side;
+	ivec3 tileOrigin = ivec3(workGroupBrick()) * TILE_SIZE - halo;
+	ivec3 stride = ivec3(1, side, side * side);
+
+	// Each invocation owns the same cells throughout, and keeps their source in registers
+	vec3 source[MAX_CELLS_PER_INVOCATION];
+	vec3 value[MAX_CELLS_PER_INVOCATION];
+
+	for (int n = 0; n < MAX_CELLS_PER_INVOCATION; n++)
+	{
+		int cell = int(gl_LocalInvocationIndex) + n * WORK_GROUP_SIZE;
+		if (cell >= numCells)
+			break;
+
+		ivec3 storedTexel = wrapTexel(tileOrigin + ivec3(cell % side, (cell / side) % side, cell / (side * side)));
+		source[n] = loadSource(storedTexel);
+		storeTile(cell, numCells, loadIn(storedTexel));
+	}
+
+	memoryBarrierShared();
+	barrier();
+
+	float residualSum = 0, residualMax = 0;
+	for (int i = 0; i < uIterations; i++)
+	{
+		for (int n = 0; n < MAX_CELLS_PER_INVOCATION; n++)
+		{
+			int cell = int(gl_LocalInvocationIndex) + n * WORK_GROUP_SIZE;
+			if (cell >= numCells)
+				break;
+
+			ivec3 local = ivec3(cell % side, (cell / side) % side, cell / (side * side));
+			ivec3 texel = logicalTexel(tileOrigin + local);
+			vec3 center = loadTile(cell, numCells);
+			value[n] = center;
+
+			// The outer layer of the tile is missing neighbours, it only ever holds the input field
+			if (any(equal(local, ivec3(0))) || any(equal(local, ivec3(side - 1))))
+				continue;
+
+			vec3 left = loadNeighbour(cell - stride.x, numCells, texel + ivec3(-1,  0,  0), size, center),
+			    right = loadNeighbour(cell + stride.x, numCells, texel + ivec3( 1,  0,  0), size, center),
+			       up = loadNeighbour(cell + stride.y, numCells, texel + ivec3( 0,  1,  0), size, center),
+			     down = loadNeighbour(cell - stride.y, numCells, texel + ivec3( 0, -1,  0), size, center),
+			    front = loadNeighbour(cell + stride.z, numCells, texel + ivec3( 0,  0,  1), size, center),
+			     back = loadNeighbour(cell - stride.z, numCells, texel + ivec3( 0,  0, -1), size, center);
+
+			vec3 jacobi = (left + right + up + down + front + back + uAlpha * source[n]) * uOneOverBeta;
+
+			// Residual of the input field, over the texels this work group writes back
+			if (uComputeResidual && i == 0 && all(greaterThanEqual(local, ivec3(halo))) && all(lessThan(local, ivec3(halo + TILE_SIZE))))
+			{
+				vec3 residual = (jacobi - center) * uResidualScale;
+				residualSum += dot(residual, residual);
+				residualMax = max(residualMax, length(residual));
+			}
+
+			value[n] = mix(center, jacobi, uRelaxation);
+		}
+
+		// Everyone is done reading the previous iterate before it gets overwritten
+		barrier();
+
+		for (int n = 0; n < MAX_CELLS_PER_INVOCATION; n++)
+		{
+			int cell = int(gl_LocalInvocationIndex) + n * WORK_GROUP_SIZE;
+			if (cell >= numCells)
+				break;
+			storeTile(cell, numCells, value[n]);
+		}
+
+		memoryBarrierShared();
+		barrier();
+	}
+
+	// Same value for the whole dispatch, so the reduction runs from uniform control flow
+	if (uComputeResidual)
+		storeWorkGroupSumAndMax(residualSum, residualMax);
+
+	ivec3 local = ivec3(gl_LocalInvocationID) + halo;
+	storeOut(globalTexel(), loadTile(local.x + side * (local.y + side * local.z), numCells));
+}
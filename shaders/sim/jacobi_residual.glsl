@@ -0,0 +1,61 @@
+#version 450
+
+#define REDUCE_WORK_GROUP_SIZE 256
+
+layout(local_size_x = REDUCE_WORK_GROUP_SIZE) in;
+
+uniform uint uNumPartialSums;
+// Only the work groups of the active bricks stored partial sums, see bricks.glsl
+uniform bool uSparseBricks;
+uniform float uOneOverNumTexels;
+uniform int uSlot;
+
+layout(std430, binding = 1) restrict readonly buffer PartialSums
+{
+	vec2 uPartialSums[];
+};
+
+layout(std430, binding = 2) restrict writeonly buffer Residuals
+{
+	vec2 uResiduals[];
+};
+
+// Indirect dispatch arguments of the active bricks, see brick_compact.glsl
+layout(std430, binding = 4) restrict readonly buffer ActiveDispatch
+{
+	uint uActiveDispatch[3];
+};
+
+shared vec2 sSums[REDUCE_WORK_GROUP_SIZE];
+
+vec2 combine(vec2 a, vec2 b)
+{
+	return vec2(a.x + b.x, max(a.y, b.y));
+}
+
+// Single work group finishing the reduction started by storeWorkGroupSumAndMax in jacobi.glsl.
+// Stores the root mean square and the maximum magnitude of the residual in slot uSlot.
+void main()
+{
+	uint index = gl_LocalInvocationIndex;
+
+	uint numPartialSums = uSparseBricks ? uActiveDispatch[0] : uNumPartialSums;
+
+	vec2 value = vec2(0.);
+	for (uint i = index; i < numPartialSums; i += REDUCE_WORK_GROUP_SIZE)
+		value = combine(value, uPartialSums[i]);
+	sSums[index] = value;
+	memoryBarrierShared();
+	barrier();
+
+	for (uint stride = REDUCE_WORK_GROUP_SIZE / 2; stride > 0; stride >>= 1)
+	{
+		if (index < stride)
+			sSums[index] = combine(sSums[index], sSums[index + stride]);
+		memoryBarrierShared();
+		barrier();
+	}
+
+	if (index == 0)
+		uResiduals[uSlot] = vec2(sqrt(sSums[0].x * uOneOverNumTexels), sSums[0].y);
+}
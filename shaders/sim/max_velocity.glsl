@@ -0,0 +1,13 @@
+#version 450
+
+layout(binding = 0, VELOCITY_FORMAT) uniform restrict readonly image3D uVelocity;
+
+void storeWorkGroupSumAndMax(float sumValue, float maxValue);
+
+// Work group's part of the maximum velocity magnitude, finished by jacobi_residual.glsl.
+// Every stored texel is inside of the grid, so there is no need for logical texels.
+void main()
+{
+	vec3 velocity = imageLoad(uVelocity, ivec3(gl_GlobalInvocationID)).xyz;
+	storeWorkGroupSumAndMax(0., length(velocity));
+}
@@ -0,0 +1,27 @@
+#version 450
+
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
+
+layout(binding = 0, r32f) uniform restrict readonly image3D uPreconditioned;
+layout(binding = 1, r32f) uniform restrict image3D uDirection;
+
+layout(std430, binding = 0) restrict readonly buffer PCGScalars
+{
+	float rz;
+	float alpha;
+	float beta;
+	float residual;
+	uint iterations;
+	uint converged;
+} uScalars;
+
+// d = z + beta * d
+void main()
+{
+	if (uScalars.converged != 0)
+		return;
+
+	ivec3 texel = ivec3(gl_GlobalInvocationID);
+
+	imageStore(uDirection, texel, vec4(imageLoad(uPreconditioned, texel).r + uScalars.beta * imageLoad(uDirection, texel).r));
+}
@@ -0,0 +1,46 @@
+#version 450
+
+uniform float uBeta;
+
+layout(binding = 0, r32f) uniform restrict readonly image3D uDirection;
+layout(binding = 1, r32f) uniform restrict writeonly image3D uLaplacian;
+
+layout(std430, binding = 0) restrict readonly buffer PCGScalars
+{
+	float rz;
+	float alpha;
+	float beta;
+	float residual;
+	uint iterations;
+	uint converged;
+} uScalars;
+
+void storeWorkGroupSum(vec2 value);
+// Linked from ring.glsl
+ivec3 ringTexel(ivec3 texel);
+ivec3 logicalTexel(ivec3 storedTexel);
+
+// q = Md with M = beta * I - neighbours, and the work group's part of the dot product d.q
+void main()
+{
+	// Same value for the whole dispatch, so the early out stays uniform
+	if (uScalars.converged != 0)
+		return;
+
+	ivec3 storedTexel = ivec3(gl_GlobalInvocationID);
+	ivec3 texel = logicalTexel(storedTexel);
+
+	// Field is 0 outside of the texture
+	float neighbours = imageLoad(uDirection, ringTexel(texel + ivec3(-1,  0,  0))).r
+		+ imageLoad(uDirection, ringTexel(texel + ivec3( 1,  0,  0))).r
+		+ imageLoad(uDirection, ringTexel(texel + ivec3( 0,  1,  0))).r
+		+ imageLoad(uDirection, ringTexel(texel + ivec3( 0, -1,  0))).r
+		+ imageLoad(uDirection, ringTexel(texel + ivec3( 0,  0,  1))).r
+		+ imageLoad(uDirection, ringTexel(texel + ivec3( 0,  0, -1))).r;
+	float d = imageLoad(uDirection, storedTexel).r;
+	float q = uBeta * d - neighbours;
+
+	imageStore(uLaplacian, storedTexel, vec4(q));
+
+	storeWorkGroupSum(vec2(d * q, 0.));
+}
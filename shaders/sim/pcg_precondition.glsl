@@ -0,0 +1,65 @@
+#version 450
+
+#define PRECONDITION_DIAGONAL 0
+#define PRECONDITION_INCOMPLETE_POISSON_UPPER 1
+#define PRECONDITION_INCOMPLETE_POISSON_LOWER 2
+
+uniform int uPreconditionPass;
+uniform float uOneOverBeta;
+
+layout(binding = 0, r32f) uniform restrict readonly image3D uFieldIn;
+layout(binding = 1, r32f) uniform restrict writeonly image3D uFieldOut;
+layout(binding = 2, r32f) uniform restrict readonly image3D uResidual;
+
+layout(std430, binding = 0) restrict readonly buffer PCGScalars
+{
+	float rz;
+	float alpha;
+	float beta;
+	float residual;
+	uint iterations;
+	uint converged;
+} uScalars;
+
+void storeWorkGroupSum(vec2 value);
+// Linked from ring.glsl
+ivec3 ringTexel(ivec3 texel);
+ivec3 logicalTexel(ivec3 storedTexel);
+
+// Applies the preconditioner z = P^-1 r, and computes the work group's part of r.z and r.r.
+// The diagonal preconditioner is z = r / beta. The incomplete Poisson preconditioner from
+// Ament, Knittel, Weiskopf and Strasser, 2010. A Parallel Preconditioned Conjugate Gradient Solver
+// for the Poisson Problem on a Multi-GPU Platform
+// is z = H H^T r with H = I - L D^-1, where L is the strictly lower part of M and D its diagonal.
+// With M = beta * I - neighbours, H^T adds the upper neighbours scaled by 1 / beta and H adds the
+// lower ones, so it takes two stencil passes.
+void main()
+{
+	if (uScalars.converged != 0)
+		return;
+
+	ivec3 storedTexel = ivec3(gl_GlobalInvocationID);
+	ivec3 texel = logicalTexel(storedTexel);
+	float value = imageLoad(uFieldIn, storedTexel).r;
+
+	// Field is 0 outside of the texture
+	if (uPreconditionPass == PRECONDITION_DIAGONAL)
+		value *= uOneOverBeta;
+	else if (uPreconditionPass == PRECONDITION_INCOMPLETE_POISSON_UPPER)
+		value += (imageLoad(uFieldIn, ringTexel(texel + ivec3(1, 0, 0))).r
+			+ imageLoad(uFieldIn, ringTexel(texel + ivec3(0, 1, 0))).r
+			+ imageLoad(uFieldIn, ringTexel(texel + ivec3(0, 0, 1))).r) * uOneOverBeta;
+	else
+		value += (imageLoad(uFieldIn, ringTexel(texel - ivec3(1, 0, 0))).r
+			+ imageLoad(uFieldIn, ringTexel(texel - ivec3(0, 1, 0))).r
+			+ imageLoad(uFieldIn, ringTexel(texel - ivec3(0, 0, 1))).r) * uOneOverBeta;
+
+	imageStore(uFieldOut, storedTexel, vec4(value));
+
+	// The upper pass only produces an intermediate field
+	if (uPreconditionPass != PRECONDITION_INCOMPLETE_POISSON_UPPER)
+	{
+		float r = imageLoad(uResidual, storedTexel).r;
+		storeWorkGroupSum(vec2(r * value, r * r));
+	}
+}
@@ -0,0 +1,91 @@
+#version 450
+
+#define REDUCE_WORK_GROUP_SIZE 256
+
+layout(local_size_x = REDUCE_WORK_GROUP_SIZE) in;
+
+#define REDUCE_INIT 0
+#define REDUCE_STEP_SIZE 1
+#define REDUCE_DIRECTION 2
+
+uniform int uReducePass;
+uniform uint uNumPartialSums;
+// Converts |r| to the root mean square of the divergence left by the solution
+uniform float uResidualScale;
+uniform float uTolerance;
+
+layout(std430, binding = 0) restrict buffer PCGScalars
+{
+	float rz;
+	float alpha;
+	float beta;
+	float residual;
+	uint iterations;
+	uint converged;
+} uScalars;
+
+layout(std430, binding = 1) restrict readonly buffer PartialSums
+{
+	vec2 uPartialSums[];
+};
+
+shared vec2 sSums[REDUCE_WORK_GROUP_SIZE];
+
+void updateResidual(float rr)
+{
+	uScalars.residual = sqrt(rr) * uResidualScale;
+	uScalars.converged = uScalars.residual <= uTolerance ? 1 : 0;
+}
+
+// Single work group finishing the dot products started by storeWorkGroupSum,
+// and deriving the scalars of the next conjugate gradient step from them.
+void main()
+{
+	if (uReducePass != REDUCE_INIT && uScalars.converged != 0)
+		return;
+
+	uint index = gl_LocalInvocationIndex;
+
+	vec2 sum = vec2(0.);
+	for (uint i = index; i < uNumPartialSums; i += REDUCE_WORK_GROUP_SIZE)
+		sum += uPartialSums[i];
+	sSums[index] = sum;
+	memoryBarrierShared();
+	barrier();
+
+	for (uint stride = REDUCE_WORK_GROUP_SIZE / 2; stride > 0; stride >>= 1)
+	{
+		if (index < stride)
+			sSums[index] += sSums[index + stride];
+		memoryBarrierShared();
+		barrier();
+	}
+
+	if (index != 0)
+		return;
+
+	vec2 total = sSums[0];
+
+	if (uReducePass == REDUCE_INIT)
+	{
+		// total = (r.z, r.r)
+		uScalars.rz = total.x;
+		uScalars.alpha = 0.;
+		uScalars.beta = 0.;
+		uScalars.iterations = 0;
+		updateResidual(total.y);
+	}
+	else if (uReducePass == REDUCE_STEP_SIZE)
+	{
+		// total.x = d.q
+		uScalars.alpha = total.x != 0. ? uScalars.rz / total.x : 0.;
+	}
+	else
+	{
+		// total = (r.z, r.r)
+		uScalars.beta = uScalars.rz != 0. ? total.x / uScalars.rz : 0.;
+		uScalars.rz = total.x;
+		uScalars.iterations++;
+		updateResidual(total.y);
+	}
+}
@@ -0,0 +1,47 @@
+#version 450
+
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
+
+uniform float uAlpha;
+uniform float uBeta;
+
+layout(binding = 0, r32f) uniform restrict readonly image3D uSource;
+layout(binding = 1, r32f) uniform restrict readonly image3D uSolution;
+layout(binding = 2, r32f) uniform restrict writeonly image3D uResidual;
+
+layout(std430, binding = 0) restrict writeonly buffer PCGScalars
+{
+	float rz;
+	float alpha;
+	float beta;
+	float residual;
+	uint iterations;
+	uint converged;
+} uScalars;
+
+// Linked from ring.glsl
+ivec3 ringTexel(ivec3 texel);
+ivec3 logicalTexel(ivec3 storedTexel);
+
+// Initial residual of the Poisson equation solved by jacobi.glsl, written as
+// Mx = alpha * b with M = beta * I - neighbours so that M is symmetric positive definite.
+// The field is 0 outside of the texture.
+void main()
+{
+	ivec3 storedTexel = ivec3(gl_GlobalInvocationID);
+	ivec3 texel = logicalTexel(storedTexel);
+
+	// Start of a new solve, let the next passes run
+	if (texel == ivec3(0))
+		uScalars.converged = 0;
+
+	float neighbours = imageLoad(uSolution, ringTexel(texel + ivec3(-1,  0,  0))).r
+		+ imageLoad(uSolution, ringTexel(texel + ivec3( 1,  0,  0))).r
+		+ imageLoad(uSolution, ringTexel(texel + ivec3( 0,  1,  0))).r
+		+ imageLoad(uSolution, ringTexel(texel + ivec3( 0, -1,  0))).r
+		+ imageLoad(uSolution, ringTexel(texel + ivec3( 0,  0,  1))).r
+		+ imageLoad(uSolution, ringTexel(texel + ivec3( 0,  0, -1))).r;
+	float Mx = uBeta * imageLoad(uSolution, storedTexel).r - neighbours;
+
+	imageStore(uResidual, storedTexel, vec4(uAlpha * imageLoad(uSource, storedTexel).r - Mx));
+}
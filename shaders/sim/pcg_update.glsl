@@ -0,0 +1,31 @@
+#version 450
+
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
+
+layout(binding = 0, r32f) uniform restrict image3D uSolution;
+layout(binding = 1, r32f) uniform restrict image3D uResidual;
+layout(binding = 2, r32f) uniform restrict readonly image3D uDirection;
+layout(binding = 3, r32f) uniform restrict readonly image3D uLaplacian;
+
+layout(std430, binding = 0) restrict readonly buffer PCGScalars
+{
+	float rz;
+	float alpha;
+	float beta;
+	float residual;
+	uint iterations;
+	uint converged;
+} uScalars;
+
+// x += alpha * d, r -= alpha * q
+void main()
+{
+	if (uScalars.converged != 0)
+		return;
+
+	ivec3 texel = ivec3(gl_GlobalInvocationID);
+	float alpha = uScalars.alpha;
+
+	imageStore(uSolution, texel, vec4(imageLoad(uSolution, texel).r + alpha * imageLoad(uDirection, texel).r));
+	imageStore(uResidual, texel, vec4(imageLoad(uResidual, texel).r - alpha * imageLoad(uLaplacian, texel).r));
+}
@@ -0,0 +1,98 @@
+#version 450
+
+#define LINE_WORK_GROUP_SIZE 64
+#define MAX_LINE_LENGTH 1024
+
+layout(local_size_x = LINE_WORK_GROUP_SIZE) in;
+
+// One work group per line of the grid along uAxis
+uniform int uAxis;
+uniform int uRadius;
+// Where the taps of this pass start in uTaps
+uniform int uTapsOffset;
+// First pass of a term : filters the update of one Jacobi iteration on uFieldIn rather than uFieldIn itself
+uniform bool uJacobiUpdateInput;
+uniform float uAlpha;
+uniform float uOneOverBeta;
+// Last pass of a term : adds uScale times the filtered field to uFieldAccumulate
+uniform bool uAccumulate;
+uniform float uScale;
+
+layout(binding = 0, r32f) uniform readonly image3D uFieldIn;
+layout(binding = 1, r32f) uniform readonly image3D uFieldSource;
+layout(binding = 2, r32f) uniform readonly image3D uFieldAccumulate;
+// Not restrict, it's the same image as uFieldAccumulate after the first term
+layout(binding = 3, r32f) uniform writeonly image3D uFieldOut;
+
+layout(std430, binding = 0) restrict readonly buffer FilterTaps
+{
+	float uTaps[];
+};
+
+shared float sLine[MAX_LINE_LENGTH];
+
+// Linked from ring.glsl, lines are logical
+ivec3 ringTexel(ivec3 texel);
+
+ivec3 lineTexel(int i)
+{
+	ivec3 texel;
+	texel[uAxis] = i;
+	texel[(uAxis + 1) % 3] = int(gl_WorkGroupID.x);
+	texel[(uAxis + 2) % 3] = int(gl_WorkGroupID.y);
+	return texel;
+}
+
+float loadInput(ivec3 texel)
+{
+	float value = imageLoad(uFieldIn, ringTexel(texel)).r;
+	if (!uJacobiUpdateInput)
+		return value;
+
+	// Same iteration as jacobi.glsl with zero boundaries, which out of bounds loads give us
+	float neighbours = imageLoad(uFieldIn, ringTexel(texel + ivec3(-1,  0,  0))).r
+		+ imageLoad(uFieldIn, ringTexel(texel + ivec3( 1,  0,  0))).r
+		+ imageLoad(uFieldIn, ringTexel(texel + ivec3( 0,  1,  0))).r
+		+ imageLoad(uFieldIn, ringTexel(texel + ivec3( 0, -1,  0))).r
+		+ imageLoad(uFieldIn, ringTexel(texel + ivec3( 0,  0,  1))).r
+		+ imageLoad(uFieldIn, ringTexel(texel + ivec3( 0,  0, -1))).r;
+	float source = imageLoad(uFieldSource, ringTexel(texel)).r;
+	return (neighbours + uAlpha * source) * uOneOverBeta - value;
+}
+
+// The line extended with odd reflections about the boundary texels, just outside of the grid.
+// Filtering it matches Jacobi iterations with zero boundaries.
+float extendedLine(int i, int length)
+{
+	// % is undefined for negative operands
+	int period = 2 * (length + 1);
+	int m = i + 1;
+	m = m - period * int(floor(float(m) / float(period))) - 1;
+	if (m == -1 || m == length)
+		return 0.;
+	return m < length ? sLine[m] : -sLine[2 * length - m];
+}
+
+// One 1D pass of a separable Poisson filter, see poisson_filter.hpp
+void main()
+{
+	int length = imageSize(uFieldIn)[uAxis];
+	int local = int(gl_LocalInvocationIndex);
+
+	for (int i = local; i < length; i += LINE_WORK_GROUP_SIZE)
+		sLine[i] = loadInput(lineTexel(i));
+	memoryBarrierShared();
+	barrier();
+
+	for (int i = local; i < length; i += LINE_WORK_GROUP_SIZE)
+	{
+		float value = 0.;
+		for (int t = -uRadius; t <= uRadius; t++)
+			value += uTaps[uTapsOffset + t + uRadius] * extendedLine(i + t, length);
+
+		ivec3 texel = ringTexel(lineTexel(i));
+		if (uAccumulate)
+			value = imageLoad(uFieldAccumulate, texel).r + uScale * value;
+		imageStore(uFieldOut, texel, vec4(value));
+	}
+}
@@ -4,10 +4,8 @@ layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
 
 uniform float uOneOverDx;
 
-layout(binding = 0, r32f) uniform restrict image2DArray uVelocityX;
-layout(binding = 1, r32f) uniform restrict image2DArray uVelocityY;
-layout(binding = 2, r32f) uniform restrict image2DArray uVelocityZ;
-layout(binding = 3, r32f) uniform restrict readonly image2DArray uPressure;
+layout(binding = 0, VELOCITY_FORMAT) uniform restrict image3D uVelocity;
+layout(binding = 3, r32f) uniform restrict readonly image3D uPressure;
 
 // Velocity textures are staggered, and the pressure texture is centered.
 // This means that pressure samples are in the middle of velocity samples,
@@ -16,10 +14,29 @@ layout(binding = 3, r32f) uniform restrict readonly image2DArray uPressure;
 // Because we handle two staggered textures at once, we don't use
 // the entry point and do our own boundary detection logic.
 
-void main()
+// Also writes the divergence of the projected velocity, like divergence.glsl would right after.
+// Projects out of place then, into uVelocityOut.
+uniform bool uComputeDivergence;
+
+layout(binding = 4, r32f) uniform restrict writeonly image3D uDivergence;
+layout(binding = 5) uniform restrict writeonly image3D uVelocityOut;
+
+// Projected velocity of the work group's texels and of the layer of texels around them
+#define TILE_SIDE 10
+#define TILE_CELLS 1000
+#define WORK_GROUP_SIZE 512
+
+shared vec3 sVelocity[TILE_CELLS];
+
+// Linked from bricks.glsl and ring.glsl
+uvec3 workGroupBrick();
+ivec3 globalTexel();
+ivec3 ringTexel(ivec3 texel);
+ivec3 logicalTexel(ivec3 storedTexel);
+
+// Takes a logical texel
+vec3 projectedVelocity(ivec3 texel, ivec3 size)
 {
-	ivec3 texel = ivec3(gl_GlobalInvocationID);
-	ivec3 size = imageSize(uPressure) - 1;
 	ivec2 s = ivec2(1, 0);
 	ivec3 zero = ivec3(0);
 
@@ -27,25 +44,73 @@ void main()
 	// coordinate from different gradients, which happen to share a texel.
 	// Clamp coordinates so gradients are 0 on the boundary
 	// TEST: collocated grid
-	float pleft = imageLoad(uPressure, max(zero, texel - s.xyy)).r,
-		 pright = imageLoad(uPressure, min(size, texel + s.xyy)).r,
-		    pup = imageLoad(uPressure, min(size, texel + s.yxy)).r,
-		  pdown = imageLoad(uPressure, max(zero, texel - s.yxy)).r,
-		 pfront = imageLoad(uPressure, min(size, texel + s.yyx)).r,
-		  pback = imageLoad(uPressure, max(zero, texel - s.yyx)).r;
+	float pleft = imageLoad(uPressure, ringTexel(max(zero, texel - s.xyy))).r,
+		 pright = imageLoad(uPressure, ringTexel(min(size, texel + s.xyy))).r,
+		    pup = imageLoad(uPressure, ringTexel(min(size, texel + s.yxy))).r,
+		  pdown = imageLoad(uPressure, ringTexel(max(zero, texel - s.yxy))).r,
+		 pfront = imageLoad(uPressure, ringTexel(min(size, texel + s.yyx))).r,
+		  pback = imageLoad(uPressure, ringTexel(max(zero, texel - s.yyx))).r;
 
 	// TEST: collocated grid
 	vec3 pressureGradientComponents = uOneOverDx * vec3(pright - pleft, pup - pdown, pfront - pback) * 0.5;
 	
-	float oldx = imageLoad(uVelocityX, texel).r;
-	float oldy = imageLoad(uVelocityY, texel).r;
-	float oldz = imageLoad(uVelocityZ, texel).r;
-	float newx = oldx - pressureGradientComponents.x;
-	float newy = oldy - pressureGradientComponents.y;
-	float newz = oldz - pressureGradientComponents.z;
+	vec3 oldVelocity = imageLoad(uVelocity, ringTexel(texel)).xyz;
+	return oldVelocity - pressureGradientComponents;
+}
+
+int tileIndex(ivec3 tileTexel)
+{
+	return tileTexel.x + TILE_SIDE * (tileTexel.y + TILE_SIDE * tileTexel.z);
+}
+
+// Neighbouring work groups project the texels around ours during this dispatch, so project
+// them again here instead of reading them back. The tile is laid out as stored, and halo texels
+// past the edge of the storage wrap around. Outside of the grid, the divergence clamps its
+// coordinates, so do the same : a clamped neighbour is the texel itself rather than its tile neighbour.
+void projectAndComputeDivergence(ivec3 texel, ivec3 storedTexel, ivec3 size)
+{
+	ivec3 tileOrigin = ivec3(workGroupBrick() * gl_WorkGroupSize) - 1;
+	for (int cell = int(gl_LocalInvocationIndex); cell < TILE_CELLS; cell += WORK_GROUP_SIZE)
+	{
+		ivec3 tileTexel = ivec3(cell % TILE_SIDE, (cell / TILE_SIDE) % TILE_SIDE, cell / (TILE_SIDE * TILE_SIDE));
+		sVelocity[cell] = projectedVelocity(logicalTexel(tileOrigin + tileTexel), size);
+	}
+
+	memoryBarrierShared();
+	barrier();
+
+	ivec3 tileTexel = ivec3(gl_LocalInvocationID) + 1;
+	vec3 newVelocity = sVelocity[tileIndex(tileTexel)];
+	// TEST: collocated grid
+	imageStore(uVelocityOut, storedTexel, vec4(newVelocity, 0));
+
+	// Same stencil as divergence.glsl, in 32-bit floats even when velocity is stored in 16-bit floats
+	ivec2 s = ivec2(1, 0);
+	ivec3 zero = ivec3(0);
+	ivec3 center = tileTexel - texel;
+	float xleft = sVelocity[tileIndex(center + max(zero, texel - s.xyy))].x,
+		 xright = sVelocity[tileIndex(center + min(size, texel + s.xyy))].x,
+		    yup = sVelocity[tileIndex(center + min(size, texel + s.yxy))].y,
+		  ydown = sVelocity[tileIndex(center + max(zero, texel - s.yxy))].y,
+		 zfront = sVelocity[tileIndex(center + min(size, texel + s.yyx))].z,
+		  zback = sVelocity[tileIndex(center + max(zero, texel - s.yyx))].z;
 
 	// TEST: collocated grid
-	imageStore(uVelocityX, texel, vec4(/*texel.x == 0 ? 0 : */newx));
-	imageStore(uVelocityY, texel, vec4(/*texel.y == 0 ? 0 : */newy));
-	imageStore(uVelocityZ, texel, vec4(/*texel.z == 0 ? 0 : */newz));
+	float divergence = (xright - xleft + yup - ydown + zfront - zback) * uOneOverDx * 0.5;
+	imageStore(uDivergence, storedTexel, vec4(divergence));
+}
+
+void main()
+{
+	ivec3 storedTexel = globalTexel();
+	ivec3 texel = logicalTexel(storedTexel);
+	ivec3 size = imageSize(uPressure) - 1;
+
+	if (!uComputeDivergence)
+	{
+		// TEST: collocated grid
+		imageStore(uVelocity, storedTexel, vec4(/*texel.x == 0 ? 0 : */projectedVelocity(texel, size), 0));
+	}
+	else
+		projectAndComputeDivergence(texel, storedTexel, size);
 }
@@ -0,0 +1,26 @@
+#version 450
+
+layout(binding = 0, r32f) uniform readonly image3D uCoarseSolution;
+layout(binding = 1, r32f) uniform restrict image3D uFineSolution;
+
+// Dispatched over the fine grid. Trilinearly interpolates the coarse grid correction
+// and adds it to the fine grid solution. Fine texel centers sit a quarter of a coarse texel
+// away from the center of the coarse texel containing them, so interpolation weights are
+// always 3/4 for that texel and 1/4 for its neighbour on the side of the fine texel.
+// The fine grid may be the scrolled simulation grid, coarse levels never are.
+void compute(ivec3 texel, ivec3 outputTexel, bool boundaryTexel, bool unused)
+{
+	ivec3 coarseTexel = texel >> 1;
+	ivec3 direction = (texel & 1) * 2 - 1;
+
+	// Correction is 0 outside of the texture
+	float correction = 0.;
+	for (int i = 0; i < 8; i++)
+	{
+		ivec3 corner = ivec3(i & 1, (i >> 1) & 1, i >> 2);
+		vec3 weights = mix(vec3(0.75), vec3(0.25), vec3(corner));
+		correction += weights.x * weights.y * weights.z * imageLoad(uCoarseSolution, coarseTexel + corner * direction).r;
+	}
+
+	imageStore(uFineSolution, outputTexel, vec4(imageLoad(uFineSolution, outputTexel).r + correction));
+}
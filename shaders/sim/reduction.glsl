@@ -0,0 +1,67 @@
+#version 450
+
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
+
+#define WORK_GROUP_SIZE 512
+
+layout(std430, binding = 1) restrict writeonly buffer PartialSums
+{
+	vec2 uPartialSums[];
+};
+
+shared vec2 sPartialSums[WORK_GROUP_SIZE];
+
+// Sums value over the work group and stores the result in the work group's slot in uPartialSums.
+// Must be called by all invocations of the work group, from uniform control flow.
+void storeWorkGroupSum(vec2 value)
+{
+	uint index = gl_LocalInvocationIndex;
+
+	sPartialSums[index] = value;
+	memoryBarrierShared();
+	barrier();
+
+	for (uint stride = WORK_GROUP_SIZE / 2; stride > 0; stride >>= 1)
+	{
+		if (index < stride)
+			sPartialSums[index] += sPartialSums[index + stride];
+		memoryBarrierShared();
+		barrier();
+	}
+
+	if (index == 0)
+	{
+		uvec3 group = gl_WorkGroupID;
+		uvec3 count = gl_NumWorkGroups;
+		uPartialSums[group.x + count.x * (group.y + count.y * group.z)] = sPartialSums[0];
+	}
+}
+
+// Same as storeWorkGroupSum, but keeps the maximum of maxValue over the work group
+// in the second component of the result instead of its sum.
+void storeWorkGroupSumAndMax(float sumValue, float maxValue)
+{
+	uint index = gl_LocalInvocationIndex;
+
+	sPartialSums[index] = vec2(sumValue, maxValue);
+	memoryBarrierShared();
+	barrier();
+
+	for (uint stride = WORK_GROUP_SIZE / 2; stride > 0; stride >>= 1)
+	{
+		if (index < stride)
+		{
+			vec2 a = sPartialSums[index], b = sPartialSums[index + stride];
+			sPartialSums[index] = vec2(a.x + b.x, max(a.y, b.y));
+		}
+		memoryBarrierShared();
+		barrier();
+	}
+
+	if (index == 0)
+	{
+		uvec3 group = gl_WorkGroupID;
+		uvec3 count = gl_NumWorkGroups;
+		uPartialSums[group.x + count.x * (group.y + count.y * group.z)] = sPartialSums[0];
+	}
+}
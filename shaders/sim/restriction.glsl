@@ -0,0 +1,49 @@
+#version 450
+
+uniform float uOneOverAlpha;
+uniform float uBeta;
+uniform float uBoundaryCondition;
+
+layout(binding = 0, r32f) uniform readonly image3D uFineSource;
+layout(binding = 1, r32f) uniform readonly image3D uFineSolution;
+layout(binding = 2, r32f) uniform writeonly restrict image3D uCoarseSource;
+
+// Linked from ring.glsl. The fine grid may be the scrolled simulation grid, coarse levels never are.
+ivec3 ringTexel(ivec3 texel);
+
+// Outside of the texture, the field is uBoundaryCondition times the boundary texel's value, like in jacobi.glsl
+float loadNeighbour(ivec3 texel, ivec3 size, float center)
+{
+	bool inside = all(greaterThanEqual(texel, ivec3(0))) && all(lessThan(texel, size));
+	return inside ? imageLoad(uFineSolution, ringTexel(texel)).r : uBoundaryCondition * center;
+}
+
+// Residual r = b - Lx of the Poisson equation solved by jacobi.glsl, where
+// Lx = (beta * x - sum of neighbours) / alpha
+float residual(ivec3 texel, ivec3 size)
+{
+	float center = imageLoad(uFineSolution, ringTexel(texel)).r;
+	float neighbours = loadNeighbour(texel + ivec3(-1,  0,  0), size, center)
+		+ loadNeighbour(texel + ivec3( 1,  0,  0), size, center)
+		+ loadNeighbour(texel + ivec3( 0,  1,  0), size, center)
+		+ loadNeighbour(texel + ivec3( 0, -1,  0), size, center)
+		+ loadNeighbour(texel + ivec3( 0,  0,  1), size, center)
+		+ loadNeighbour(texel + ivec3( 0,  0, -1), size, center);
+
+	return imageLoad(uFineSource, ringTexel(texel)).r - (uBeta * center - neighbours) * uOneOverAlpha;
+}
+
+// Dispatched over the coarse grid. Computes the residual of the fine grid and
+// restricts it to the coarse grid by averaging the 8 fine texels covered by each coarse texel.
+// The ring bound is the fine grid's, so only outputTexel is the coarse texel.
+void compute(ivec3 texel, ivec3 outputTexel, bool boundaryTexel, bool unused)
+{
+	ivec3 size = imageSize(uFineSolution);
+	ivec3 fineTexel = outputTexel * 2;
+
+	float sum = 0.;
+	for (int i = 0; i < 8; i++)
+		sum += residual(fineTexel + ivec3(i & 1, (i >> 1) & 1, i >> 2), size);
+
+	imageStore(uCoarseSource, outputTexel, vec4(sum * 0.125));
+}
@@ -0,0 +1,70 @@
+#version 450
+
+// Fields are stored as ring buffers along every axis : logical texel (0, 0, 0) is stored at uGridOrigin,
+// so scrolling the grid only moves the origin, see FluidState::gridOrigin. Dispatches cover the texels
+// as they are stored, and computations happen on logical texels, where the edges of the grid are.
+// Coarse multigrid levels are not scrolled, they bind an origin of 0.
+// Also linked into the draw programs, so nothing in here is specific to compute shaders.
+layout(std140, binding = 0) uniform GridRing
+{
+	ivec4 uGridOrigin;
+	ivec4 uGridSize;
+};
+
+// % is undefined for negative operands
+ivec3 wrapTexel(ivec3 texel)
+{
+	ivec3 size = uGridSize.xyz;
+	return texel - size * ivec3(floor(vec3(texel) / vec3(size)));
+}
+
+bool insideGrid(ivec3 texel)
+{
+	return all(greaterThanEqual(texel, ivec3(0))) && all(lessThan(texel, uGridSize.xyz));
+}
+
+// Where a logical texel is stored. Texels outside of the grid stay outside, so image loads from them
+// still return 0 and image stores to them are still dropped.
+ivec3 ringTexel(ivec3 texel)
+{
+	return insideGrid(texel) ? wrapTexel(texel + uGridOrigin.xyz) : texel;
+}
+
+// Logical texel stored at a texel, which may be past the edge of the storage and wraps around
+ivec3 logicalTexel(ivec3 storedTexel)
+{
+	return wrapTexel(storedTexel - uGridOrigin.xyz);
+}
+
+// Logical texture coordinates to stored ones, for textures that repeat
+vec3 ringUV(vec3 uv)
+{
+	return uv + vec3(uGridOrigin.xyz) / vec3(uGridSize.xyz);
+}
+
+vec4 fetchRing(sampler3D tex, ivec3 texel)
+{
+	return insideGrid(texel) ? texelFetch(tex, ringTexel(texel), 0) : vec4(0);
+}
+
+// Trilinear sample with the field 0 outside of the grid. Textures repeat, so only footprints
+// straddling the edge of the grid have to be fetched texel by texel.
+vec4 sampleRing(sampler3D tex, vec3 uv)
+{
+	vec3 texelSample = uv * vec3(uGridSize.xyz) - 0.5;
+	ivec3 corner = ivec3(floor(texelSample));
+
+	// Level 0 is always magnified, so filtering is trilinear with the default filters
+	if (all(greaterThanEqual(corner, ivec3(0))) && all(lessThan(corner, uGridSize.xyz - 1)))
+		return textureLod(tex, ringUV(uv), 0.);
+
+	vec3 t = texelSample - vec3(corner);
+	vec4 corners[2];
+	for (int z = 0; z < 2; z++)
+	{
+		vec4 bottom = mix(fetchRing(tex, corner + ivec3(0, 0, z)), fetchRing(tex, corner + ivec3(1, 0, z)), t.x);
+		vec4 top = mix(fetchRing(tex, corner + ivec3(0, 1, z)), fetchRing(tex, corner + ivec3(1, 1, z)), t.x);
+		corners[z] = mix(bottom, top, t.y);
+	}
+	return mix(corners[0], corners[1], t.z);
+}
@@ -0,0 +1,17 @@
+#version 450
+
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
+
+layout(binding = 0, INK_FORMAT) uniform restrict readonly image3D uField;
+layout(binding = 1) uniform restrict writeonly image3D uFieldOut;
+
+// Linked from ring.glsl
+ivec3 logicalTexel(ivec3 storedTexel);
+
+// Copies a field to where its texels would be stored with a grid origin of 0,
+// so the copy outlives later scrolls of the grid.
+void main()
+{
+	ivec3 storedTexel = ivec3(gl_GlobalInvocationID);
+	imageStore(uFieldOut, logicalTexel(storedTexel), imageLoad(uField, storedTexel));
+}